@@ -0,0 +1,86 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 Philipp Badenhoop
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include "../include/asionet/Crc32c.h"
+
+// Measures the throughput of the CRC-32C implementations for several message sizes.
+// Build in release mode for meaningful numbers.
+
+namespace
+{
+
+template<typename Crc32c>
+double measureGigabytesPerSecond(const std::vector<std::uint8_t> & data, std::size_t messageSize, Crc32c crc32c)
+{
+	using Clock = std::chrono::steady_clock;
+
+	constexpr std::size_t numBytesPerRun = std::size_t{1} << 30;
+	auto numMessages = numBytesPerRun / messageSize;
+	volatile std::uint32_t sink = 0;
+
+	auto startTime = Clock::now();
+	for (std::size_t i = 0; i < numMessages; i++)
+	{
+		auto offset = (i * messageSize) % (data.size() - messageSize + 1);
+		sink = sink ^ crc32c(data.data() + offset, messageSize);
+	}
+	std::chrono::duration<double> duration = Clock::now() - startTime;
+
+	return (double) (numMessages * messageSize) / duration.count() / 1e9;
+}
+
+}
+
+int main()
+{
+	using namespace asionet::utils;
+
+	std::vector<std::uint8_t> data(std::size_t{1} << 20);
+	for (std::size_t i = 0; i < data.size(); i++)
+		data[i] = (std::uint8_t) (i * 2654435761u >> 13);
+
+	auto portable = [](const std::uint8_t * bytes, std::size_t size)
+	{ return ~internal::crc32cPortable(bytes, size, ~0u); };
+	auto selected = [](const std::uint8_t * bytes, std::size_t size)
+	{ return crc32c(bytes, size); };
+
+	std::cout << "crc32c() uses the " << (hasHardwareCrc32c() ? "SSE4.2 crc32 instruction" : "portable implementation")
+	          << "\n10 Gbit/s take 1.25 GB/s.\n\n"
+	          << std::setw(14) << "message size" << std::setw(16) << "portable GB/s" << std::setw(16) << "crc32c() GB/s"
+	          << "\n";
+
+	for (std::size_t messageSize : {64, 512, 1472, 16384, 65536})
+	{
+		std::cout << std::setw(14) << messageSize
+		          << std::setw(16) << std::fixed << std::setprecision(2)
+		          << measureGigabytesPerSecond(data, messageSize, portable)
+		          << std::setw(16) << measureGigabytesPerSecond(data, messageSize, selected) << std::endl;
+	}
+
+	return 0;
+}
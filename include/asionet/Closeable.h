@@ -88,6 +88,24 @@ struct IsOpen
 	}
 };
 
+// Passing this as timeout to timedAsyncOperation() runs the operation without arming a timer.
+constexpr time::Duration noTimeout = time::Duration::max();
+
+namespace internal
+{
+
+template<typename Closeable>
+error::Error operationError(Closeable & closeable, const boost::system::error_code & boostCode)
+{
+	if (!IsOpen<Closeable>{}(closeable))
+		return error::aborted;
+	if (boostCode)
+		return error::Error{error::codes::failedOperation, boostCode};
+	return error::success;
+}
+
+}
+
 template<
 	typename AsyncOperation,
 	typename... AsyncOperationArgs,
@@ -99,6 +117,18 @@ void timedAsyncOperation(AsyncOperation asyncOperation,
                          const Handler & handler,
                          AsyncOperationArgs && ... asyncOperationArgs)
 {
+	if (timeout == noTimeout)
+	{
+		asyncOperation(
+			std::forward<AsyncOperationArgs>(asyncOperationArgs)...,
+			[&, handler](const boost::system::error_code & boostCode, auto && ... remainingHandlerArgs)
+			{
+				auto error = internal::operationError(closeable, boostCode);
+				handler(error, std::forward<decltype(remainingHandlerArgs)>(remainingHandlerArgs)...);
+			});
+		return;
+	}
+
 	auto & context = closeable.get_executor().context();
 	auto serializer = std::make_shared<WorkSerializer>(context);
 
@@ -117,12 +147,7 @@ void timedAsyncOperation(AsyncOperation asyncOperation,
 			{
 				timer->cancel();
 
-				auto error = error::success;
-				if (!IsOpen<Closeable>{}(closeable))
-					error = error::aborted;
-				else if (boostCode)
-					error = error::Error{error::codes::failedOperation, boostCode};
-
+				auto error = internal::operationError(closeable, boostCode);
 				handler(error, std::forward<decltype(remainingHandlerArgs)>(remainingHandlerArgs)...);
 			}));
 }
@@ -0,0 +1,211 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 Philipp Badenhoop
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef ASIONET_COMPRESSION_H
+#define ASIONET_COMPRESSION_H
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include "Utils.h"
+
+// The codecs are only available if their library is linked, which the build signals by defining these macros.
+#ifdef ASIONET_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef ASIONET_WITH_LZ4
+#include <lz4.h>
+#endif
+#ifdef ASIONET_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+namespace asionet
+{
+namespace compression
+{
+
+/**
+ * A compression policy shrinks encoded messages before they are framed. It provides
+ * - MIN_SIZE: the number of bytes from which on a message is worth compressing,
+ * - compress(data, size, compressed): appends the compressed bytes to 'compressed' and returns false on failure and
+ * - decompress(data, size, original, originalSize): restores exactly 'originalSize' bytes into 'original' and returns
+ *   false if the data is corrupt.
+ * Messages are only sent compressed if that actually makes them smaller, so each message carries a flag which tells the
+ * receiver whether to decompress it. Services may declare the policy as 'using Compression = ...;'.
+ */
+struct None
+{
+	static constexpr std::size_t MIN_SIZE = std::numeric_limits<std::size_t>::max();
+
+	static bool compress(const char *, std::size_t, std::string &)
+	{ return false; }
+
+	static bool decompress(const char *, std::size_t, char *, std::size_t)
+	{ return false; }
+};
+
+using Default = None;
+
+#ifdef ASIONET_WITH_ZLIB
+template<std::size_t minSize = 512, int level = Z_DEFAULT_COMPRESSION>
+struct Zlib
+{
+	static constexpr std::size_t MIN_SIZE = minSize;
+
+	static bool compress(const char * data, std::size_t size, std::string & compressed)
+	{
+		auto offset = compressed.size();
+		auto numBytes = ::compressBound((uLong) size);
+		compressed.resize(offset + numBytes);
+		if (::compress2((Bytef *) &compressed[offset], &numBytes, (const Bytef *) data, (uLong) size, level) != Z_OK)
+			return false;
+
+		compressed.resize(offset + numBytes);
+		return true;
+	}
+
+	static bool decompress(const char * data, std::size_t size, char * original, std::size_t originalSize)
+	{
+		uLongf numBytes = originalSize;
+		return ::uncompress((Bytef *) original, &numBytes, (const Bytef *) data, (uLong) size) == Z_OK
+		       && numBytes == originalSize;
+	}
+};
+#endif
+
+#ifdef ASIONET_WITH_LZ4
+// Much faster than zlib at a lower ratio, so it also pays off for smaller messages.
+template<std::size_t minSize = 256>
+struct Lz4
+{
+	static constexpr std::size_t MIN_SIZE = minSize;
+
+	static bool compress(const char * data, std::size_t size, std::string & compressed)
+	{
+		if (size > LZ4_MAX_INPUT_SIZE)
+			return false;
+
+		auto offset = compressed.size();
+		auto maxNumBytes = LZ4_compressBound((int) size);
+		compressed.resize(offset + maxNumBytes);
+		auto numBytes = LZ4_compress_default(data, &compressed[offset], (int) size, maxNumBytes);
+		if (numBytes <= 0)
+			return false;
+
+		compressed.resize(offset + numBytes);
+		return true;
+	}
+
+	static bool decompress(const char * data, std::size_t size, char * original, std::size_t originalSize)
+	{
+		if (size > LZ4_MAX_INPUT_SIZE || originalSize > LZ4_MAX_INPUT_SIZE)
+			return false;
+
+		return LZ4_decompress_safe(data, original, (int) size, (int) originalSize) == (int) originalSize;
+	}
+};
+#endif
+
+#ifdef ASIONET_WITH_ZSTD
+template<std::size_t minSize = 512, int level = 3>
+struct Zstd
+{
+	static constexpr std::size_t MIN_SIZE = minSize;
+
+	static bool compress(const char * data, std::size_t size, std::string & compressed)
+	{
+		auto offset = compressed.size();
+		auto maxNumBytes = ZSTD_compressBound(size);
+		compressed.resize(offset + maxNumBytes);
+		auto numBytes = ZSTD_compress(&compressed[offset], maxNumBytes, data, size, level);
+		if (ZSTD_isError(numBytes))
+			return false;
+
+		compressed.resize(offset + numBytes);
+		return true;
+	}
+
+	static bool decompress(const char * data, std::size_t size, char * original, std::size_t originalSize)
+	{
+		auto numBytes = ZSTD_decompress(original, originalSize, data, size);
+		return !ZSTD_isError(numBytes) && numBytes == originalSize;
+	}
+};
+#endif
+
+namespace internal
+{
+
+// Compressed data starts with the size of the original data so that the receiver can check it before allocating.
+constexpr std::size_t ORIGINAL_SIZE_BYTES = 4;
+
+template<typename Compression>
+constexpr bool isEnabled()
+{
+	return !std::is_same<Compression, None>::value;
+}
+
+// Replaces the data by its compressed form if it is large enough for the policy and actually shrinks.
+// Returns whether it did.
+template<typename Compression>
+bool compress(std::string & data)
+{
+	if (data.size() < Compression::MIN_SIZE || data.size() > std::numeric_limits<std::uint32_t>::max())
+		return false;
+
+	std::string compressed(ORIGINAL_SIZE_BYTES, '\0');
+	utils::toBigEndian<ORIGINAL_SIZE_BYTES>((std::uint8_t *) &compressed[0], data.size());
+	if (!Compression::compress(data.data(), data.size(), compressed) || compressed.size() >= data.size())
+		return false;
+
+	data = std::move(compressed);
+	return true;
+}
+
+// Returns false if the data is corrupt or its original size exceeds maxSize.
+template<typename Compression, typename ConstBuffer>
+bool decompress(const ConstBuffer & buffer, std::size_t maxSize, std::string & data)
+{
+	if (buffer.size() < ORIGINAL_SIZE_BYTES)
+		return false;
+
+	// The codec reads right from the buffer the message has been received into.
+	auto compressed = buffer.bytes();
+	auto originalSize = utils::fromBigEndian<ORIGINAL_SIZE_BYTES, std::size_t>((const std::uint8_t *) compressed);
+	if (originalSize > maxSize)
+		return false;
+
+	data.resize(originalSize);
+	return Compression::decompress(compressed + ORIGINAL_SIZE_BYTES, buffer.size() - ORIGINAL_SIZE_BYTES,
+	                               &data[0], originalSize);
+}
+
+}
+
+}
+}
+
+#endif //ASIONET_COMPRESSION_H
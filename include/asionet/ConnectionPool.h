@@ -0,0 +1,303 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 Philipp Badenhoop
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef ASIONET_CONNECTIONPOOL_H
+#define ASIONET_CONNECTIONPOOL_H
+
+#include <algorithm>
+#include <deque>
+#include <queue>
+#include <mutex>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <boost/asio/ip/tcp.hpp>
+#include "Closeable.h"
+#include "Context.h"
+#include "Time.h"
+#include "Timer.h"
+
+namespace asionet
+{
+
+/**
+ * Keeps established TCP connections alive between calls so that they can be reused by subsequent calls to the same
+ * endpoint. Connections are grouped by a key which is either built from a host/port pair or from an endpoint.
+ *
+ * A caller borrows a socket with asyncAcquire(). If there is a healthy idle connection for the key, it is handed out
+ * with 'reused' set to true. Otherwise, a fresh (unconnected) socket is handed out and the caller is responsible for
+ * connecting it. If the number of open connections for a key has reached maxConnectionsPerEndpoint, the caller is
+ * queued until another caller releases a connection of that key.
+ *
+ * Every borrowed socket must be given back with release(). Open sockets are kept as idle connections (up to
+ * maxIdleConnectionsPerEndpoint per key), closed sockets are dropped. Idle connections expire after idleTimeout, even if
+ * nobody acquires a connection of their key again.
+ *
+ * This class is thread-safe. Objects of this class should always be declared as std::shared_ptr.
+ */
+class ConnectionPool : public std::enable_shared_from_this<ConnectionPool>
+{
+public:
+	using Protocol = boost::asio::ip::tcp;
+	using Socket = Protocol::socket;
+	using Endpoint = Protocol::endpoint;
+	using SocketPtr = std::shared_ptr<Socket>;
+	using AcquireHandler = std::function<void(const SocketPtr & socket, bool reused)>;
+
+	explicit ConnectionPool(asionet::Context & context,
+	                        std::size_t maxConnectionsPerEndpoint = 64,
+	                        std::size_t maxIdleConnectionsPerEndpoint = 8,
+	                        time::Duration idleTimeout = std::chrono::seconds(60))
+		: context(context)
+		  , maxConnectionsPerEndpoint(maxConnectionsPerEndpoint)
+		  , maxIdleConnectionsPerEndpoint(maxIdleConnectionsPerEndpoint)
+		  , idleTimeout(idleTimeout)
+		  , expiryTimer(std::make_shared<Timer>(context))
+	{}
+
+	~ConnectionPool()
+	{
+		expiryTimer->cancel();
+	}
+
+	static std::string makeKey(const std::string & host, std::uint16_t port)
+	{
+		return host + ":" + std::to_string(port);
+	}
+
+	static std::string makeKey(const Endpoint & endpoint)
+	{
+		return makeKey(endpoint.address().to_string(), endpoint.port());
+	}
+
+	void asyncAcquire(const std::string & key, AcquireHandler handler)
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		auto & entry = entries[key];
+
+		SocketPtr socket;
+		while (!entry.idle.empty())
+		{
+			auto idleConnection = std::move(entry.idle.back());
+			entry.idle.pop_back();
+
+			if (time::now() - idleConnection.since < idleTimeout && isHealthy(*idleConnection.socket))
+			{
+				socket = std::move(idleConnection.socket);
+				break;
+			}
+
+			closeable::Closer<Socket>::close(*idleConnection.socket);
+			entry.numOpen--;
+		}
+
+		if (socket)
+		{
+			deliver(std::move(handler), std::move(socket), true);
+			return;
+		}
+
+		if (entry.numOpen < maxConnectionsPerEndpoint)
+		{
+			entry.numOpen++;
+			deliver(std::move(handler), std::make_shared<Socket>(context), false);
+			return;
+		}
+
+		entry.waiters.push(std::move(handler));
+	}
+
+	void release(const std::string & key, SocketPtr socket)
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		auto & entry = entries[key];
+
+		auto reusable = socket->is_open();
+
+		if (!entry.waiters.empty())
+		{
+			auto handler = std::move(entry.waiters.front());
+			entry.waiters.pop();
+			if (reusable)
+				deliver(std::move(handler), std::move(socket), true);
+			else
+				deliver(std::move(handler), std::make_shared<Socket>(context), false);
+			return;
+		}
+
+		if (reusable && entry.idle.size() < maxIdleConnectionsPerEndpoint)
+		{
+			entry.idle.push_back(IdleConnection{std::move(socket), time::now()});
+			if (!expiring)
+				scheduleExpiry(idleTimeout);
+			return;
+		}
+
+		closeable::Closer<Socket>::close(*socket);
+		entry.numOpen--;
+	}
+
+	/**
+	 * Hands out fresh (unconnected) sockets which the caller connects and then gives back with release() in order to
+	 * have 'numConnections' idle connections for the key. Fewer sockets are handed out if there are idle connections
+	 * already or if the limits of the pool would be exceeded otherwise.
+	 */
+	std::vector<SocketPtr> reserve(const std::string & key, std::size_t numConnections)
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		auto & entry = entries[key];
+
+		auto numWanted = std::min(numConnections, maxIdleConnectionsPerEndpoint);
+		std::vector<SocketPtr> sockets;
+		while (entry.idle.size() + sockets.size() < numWanted && entry.numOpen < maxConnectionsPerEndpoint)
+		{
+			entry.numOpen++;
+			sockets.push_back(std::make_shared<Socket>(context));
+		}
+		return sockets;
+	}
+
+	// Closes all idle connections.
+	void clear()
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		for (auto & pair : entries)
+		{
+			auto & entry = pair.second;
+			for (auto & idleConnection : entry.idle)
+				closeable::Closer<Socket>::close(*idleConnection.socket);
+			entry.numOpen -= entry.idle.size();
+			entry.idle.clear();
+		}
+	}
+
+	std::size_t numIdleConnections(const std::string & key) const
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		auto it = entries.find(key);
+		return it == entries.end() ? 0 : it->second.idle.size();
+	}
+
+	std::size_t numOpenConnections(const std::string & key) const
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		auto it = entries.find(key);
+		return it == entries.end() ? 0 : it->second.numOpen;
+	}
+
+	// An idle connection is healthy if it is still open and the peer has neither closed it nor sent unexpected data.
+	static bool isHealthy(Socket & socket)
+	{
+		if (!socket.is_open())
+			return false;
+
+		boost::system::error_code error;
+		socket.non_blocking(true, error);
+		if (error)
+			return false;
+
+		char byte;
+		socket.receive(boost::asio::buffer(&byte, 1), Socket::message_peek, error);
+
+		boost::system::error_code ignoredError;
+		socket.non_blocking(false, ignoredError);
+
+		return error == boost::asio::error::would_block;
+	}
+
+private:
+	struct IdleConnection
+	{
+		SocketPtr socket;
+		time::TimePoint since;
+	};
+
+	struct Entry
+	{
+		std::deque<IdleConnection> idle;
+		std::queue<AcquireHandler> waiters;
+		std::size_t numOpen{0};
+	};
+
+	asionet::Context & context;
+	std::size_t maxConnectionsPerEndpoint;
+	std::size_t maxIdleConnectionsPerEndpoint;
+	time::Duration idleTimeout;
+	mutable std::mutex mutex;
+	std::unordered_map<std::string, Entry> entries;
+	std::shared_ptr<Timer> expiryTimer;
+	// Whether the timer is going to close expired idle connections.
+	bool expiring{false};
+
+	// Must be called with the mutex locked.
+	void scheduleExpiry(time::Duration delay)
+	{
+		expiring = true;
+		// The handler keeps the timer alive, but not the pool.
+		std::weak_ptr<ConnectionPool> weakSelf = shared_from_this();
+		expiryTimer->startTimeout(
+			delay,
+			[weakSelf, timer = expiryTimer]
+			{
+				if (auto self = weakSelf.lock())
+					self->closeExpiredConnections();
+			});
+	}
+
+	void closeExpiredConnections()
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		expiring = false;
+
+		// Connections are appended when released, so the oldest ones of each key are at the front.
+		auto now = time::now();
+		auto nextExpiry = time::TimePoint::max();
+		for (auto & pair : entries)
+		{
+			auto & entry = pair.second;
+			while (!entry.idle.empty() && now - entry.idle.front().since >= idleTimeout)
+			{
+				closeable::Closer<Socket>::close(*entry.idle.front().socket);
+				entry.idle.pop_front();
+				entry.numOpen--;
+			}
+
+			if (!entry.idle.empty())
+				nextExpiry = std::min(nextExpiry, entry.idle.front().since + idleTimeout);
+		}
+
+		if (nextExpiry != time::TimePoint::max())
+			scheduleExpiry(nextExpiry - now);
+	}
+
+	void deliver(AcquireHandler && handler, SocketPtr && socket, bool reused)
+	{
+		context.post(
+			[handler = std::move(handler), socket = std::move(socket), reused]
+			{ handler(socket, reused); });
+	}
+};
+
+}
+
+#endif //ASIONET_CONNECTIONPOOL_H
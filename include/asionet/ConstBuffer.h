@@ -13,20 +13,34 @@ namespace asionet
 namespace internal
 {
 
+// Refers to the bytes which are currently stored in a streambuf.
+// The bytes remain valid even if they are consumed from the streambuf afterwards, but only until new bytes are written
+// into the streambuf (e.g. by starting another read operation on it).
 class ConstStreamBuffer
 {
 public:
-	using ConstIterator = boost::asio::buffers_iterator<boost::asio::streambuf::const_buffers_type>;
+	using Data = boost::asio::streambuf::const_buffers_type;
+	using ConstIterator = boost::asio::buffers_iterator<Data>;
 
 	ConstStreamBuffer(boost::asio::streambuf & buffer, std::size_t numBytes, std::size_t offset)
-		: buffer(buffer), numBytes(numBytes), offset(offset)
+		: ConstStreamBuffer(buffer.data(), numBytes, offset)
+	{}
+
+	ConstStreamBuffer(const Data & data, std::size_t numBytes, std::size_t offset)
+		: data(data), numBytes(numBytes), offset(offset)
 	{
-		assert(buffer.size() >= offset + numBytes);
+		assert(boost::asio::buffer_size(data) >= offset + numBytes);
 	}
 
 	char operator[](std::size_t pos) const
 	{
-		return ((const char *) buffer.data().data())[pos + offset];
+		return ((const char *) data.data())[pos + offset];
+	}
+
+	// The bytes of the buffer are contiguous in memory.
+	const char * bytes() const
+	{
+		return (const char *) data.data() + offset;
 	}
 
 	std::size_t size() const
@@ -36,16 +50,22 @@ public:
 
 	ConstIterator begin() const
 	{
-		return boost::asio::buffers_begin(buffer.data()) + offset;
+		return boost::asio::buffers_begin(data) + offset;
 	}
 
 	ConstIterator end() const
 	{
-		return boost::asio::buffers_begin(buffer.data()) + offset + numBytes;
+		return boost::asio::buffers_begin(data) + offset + numBytes;
+	}
+
+	// Returns the buffer without its first 'pos' bytes.
+	ConstStreamBuffer subBuffer(std::size_t pos) const
+	{
+		return ConstStreamBuffer{data, numBytes - pos, offset + pos};
 	}
 
 private:
-	boost::asio::streambuf & buffer;
+	Data data;
 	std::size_t numBytes;
 	std::size_t offset;
 };
@@ -55,7 +75,56 @@ class ConstVectorBuffer
 public:
 	using ConstIterator = std::vector<char>::const_iterator;
 
-	explicit ConstVectorBuffer(std::vector<char> & buffer, std::size_t numBytes, std::size_t offset)
+	explicit ConstVectorBuffer(const std::vector<char> & buffer, std::size_t numBytes, std::size_t offset)
+		: buffer(buffer), numBytes(numBytes), offset(offset)
+	{
+		assert(buffer.size() >= offset + numBytes);
+	}
+
+	char operator[](std::size_t pos) const
+	{
+		return buffer[pos + offset];
+	}
+
+	// The bytes of the buffer are contiguous in memory.
+	const char * bytes() const
+	{
+		return buffer.data() + offset;
+	}
+
+	std::size_t size() const
+	{
+		return numBytes;
+	}
+
+	ConstIterator begin() const
+	{
+		return buffer.begin() + offset;
+	}
+
+	ConstIterator end() const
+	{
+		return buffer.begin() + offset + numBytes;
+	}
+
+	// Returns the buffer without its first 'pos' bytes.
+	ConstVectorBuffer subBuffer(std::size_t pos) const
+	{
+		return ConstVectorBuffer{buffer, numBytes - pos, offset + pos};
+	}
+
+private:
+	const std::vector<char> & buffer;
+	std::size_t numBytes;
+	std::size_t offset;
+};
+
+class ConstStringBuffer
+{
+public:
+	using ConstIterator = std::string::const_iterator;
+
+	explicit ConstStringBuffer(const std::string & buffer, std::size_t numBytes, std::size_t offset)
 		: buffer(buffer), numBytes(numBytes), offset(offset)
 	{
 		assert(buffer.size() >= offset + numBytes);
@@ -66,6 +135,12 @@ public:
 		return buffer[pos + offset];
 	}
 
+	// The bytes of the buffer are contiguous in memory.
+	const char * bytes() const
+	{
+		return buffer.data() + offset;
+	}
+
 	std::size_t size() const
 	{
 		return numBytes;
@@ -81,8 +156,14 @@ public:
 		return buffer.begin() + offset + numBytes;
 	}
 
+	// Returns the buffer without its first 'pos' bytes.
+	ConstStringBuffer subBuffer(std::size_t pos) const
+	{
+		return ConstStringBuffer{buffer, numBytes - pos, offset + pos};
+	}
+
 private:
-	std::vector<char> buffer;
+	const std::string & buffer;
 	std::size_t numBytes;
 	std::size_t offset;
 };
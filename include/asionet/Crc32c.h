@@ -0,0 +1,163 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 Philipp Badenhoop
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef ASIONET_CRC32C_H
+#define ASIONET_CRC32C_H
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+// The SSE4.2 crc32 instruction is used if the CPU supports it, which is checked at runtime.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define ASIONET_HAS_SSE42_CRC32C 1
+#include <nmmintrin.h>
+#endif
+
+namespace asionet
+{
+namespace utils
+{
+namespace internal
+{
+
+// Reflected Castagnoli polynomial.
+constexpr std::uint32_t CRC32C_POLYNOMIAL = 0x82f63b78;
+
+using Crc32cTables = std::array<std::array<std::uint32_t, 256>, 8>;
+
+inline const Crc32cTables & crc32cTables()
+{
+	static const Crc32cTables tables = []
+	{
+		Crc32cTables tables;
+		for (std::uint32_t i = 0; i < 256; i++)
+		{
+			auto crc = i;
+			for (int bit = 0; bit < 8; bit++)
+				crc = (crc >> 1) ^ (CRC32C_POLYNOMIAL & (0u - (crc & 1)));
+			tables[0][i] = crc;
+		}
+
+		for (std::size_t slice = 1; slice < tables.size(); slice++)
+		{
+			for (std::size_t i = 0; i < 256; i++)
+				tables[slice][i] = (tables[slice - 1][i] >> 8) ^ tables[0][tables[slice - 1][i] & 0xff];
+		}
+		return tables;
+	}();
+	return tables;
+}
+
+// Processes 8 bytes at once with the slicing-by-8 algorithm. Takes and returns the non-inverted crc.
+inline std::uint32_t crc32cPortable(const std::uint8_t * bytes, std::size_t size, std::uint32_t crc)
+{
+	const auto & tables = crc32cTables();
+
+	for (; size >= 8; size -= 8, bytes += 8)
+	{
+		auto low = crc ^ ((std::uint32_t) bytes[0]
+		                  | ((std::uint32_t) bytes[1] << 8)
+		                  | ((std::uint32_t) bytes[2] << 16)
+		                  | ((std::uint32_t) bytes[3] << 24));
+		crc = tables[7][low & 0xff]
+		      ^ tables[6][(low >> 8) & 0xff]
+		      ^ tables[5][(low >> 16) & 0xff]
+		      ^ tables[4][low >> 24]
+		      ^ tables[3][bytes[4]]
+		      ^ tables[2][bytes[5]]
+		      ^ tables[1][bytes[6]]
+		      ^ tables[0][bytes[7]];
+	}
+
+	for (; size > 0; size--, bytes++)
+		crc = (crc >> 8) ^ tables[0][(crc ^ *bytes) & 0xff];
+
+	return crc;
+}
+
+#ifdef ASIONET_HAS_SSE42_CRC32C
+
+__attribute__((target("sse4.2")))
+inline std::uint32_t crc32cHardware(const std::uint8_t * bytes, std::size_t size, std::uint32_t crc)
+{
+#if defined(__x86_64__)
+	std::uint64_t crc64 = crc;
+	for (; size >= 8; size -= 8, bytes += 8)
+	{
+		std::uint64_t word;
+		std::memcpy(&word, bytes, sizeof(word));
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	crc = (std::uint32_t) crc64;
+#endif
+
+	for (; size >= 4; size -= 4, bytes += 4)
+	{
+		std::uint32_t word;
+		std::memcpy(&word, bytes, sizeof(word));
+		crc = _mm_crc32_u32(crc, word);
+	}
+
+	for (; size > 0; size--, bytes++)
+		crc = _mm_crc32_u8(crc, *bytes);
+
+	return crc;
+}
+
+#endif
+
+using Crc32cFunction = std::uint32_t (*)(const std::uint8_t * bytes, std::size_t size, std::uint32_t crc);
+
+inline Crc32cFunction selectCrc32c()
+{
+#ifdef ASIONET_HAS_SSE42_CRC32C
+	if (__builtin_cpu_supports("sse4.2"))
+		return crc32cHardware;
+#endif
+	return crc32cPortable;
+}
+
+}
+
+// Returns whether crc32c() runs on the crc32 instruction of the CPU.
+inline bool hasHardwareCrc32c()
+{
+	static const bool hardware = internal::selectCrc32c() != internal::crc32cPortable;
+	return hardware;
+}
+
+/**
+ * Computes the CRC-32C (Castagnoli) checksum of the given bytes.
+ * To compute the checksum of data in several pieces, pass the checksum of the previous pieces as 'crc'.
+ */
+inline std::uint32_t crc32c(const void * data, std::size_t size, std::uint32_t crc = 0)
+{
+	static const internal::Crc32cFunction function = internal::selectCrc32c();
+	return ~function((const std::uint8_t *) data, size, ~crc);
+}
+
+}
+}
+
+#endif //ASIONET_CRC32C_H
@@ -33,14 +33,13 @@
 namespace asionet
 {
 
-template<typename Message>
+template<typename Message, typename Framing = framing::Default, typename Compression = compression::None>
 class DatagramReceiver
 {
 public:
 	using Protocol = boost::asio::ip::udp;
 	using Endpoint = Protocol::endpoint;
 	using Socket = Protocol::socket;
-	using Frame = asionet::internal::Frame;
 	using ReceiveHandler = std::function<
 		void(const error::Error & error,
 			 Message & message,
@@ -50,7 +49,8 @@ public:
 		: context(context)
 		  , bindingPort(bindingPort)
 		  , socket(context)
-		  , buffer(maxMessageSize + Frame::HEADER_SIZE)
+		  , buffer(maxMessageSize + Framing::MAX_HEADER_SIZE + Framing::TRAILER_SIZE
+		           + message::internal::datagramFlagSize<Compression>())
 		  , operationManager(context, [this]{ this->cancelOperation(); })
 	{}
 
@@ -75,7 +75,7 @@ private:
 
 	struct AsyncState
 	{
-		AsyncState(DatagramReceiver<Message> & receiver,
+		AsyncState(DatagramReceiver<Message, Framing, Compression> & receiver,
 		           ReceiveHandler && handler)
 			: handler(std::move(handler))
 			  , finishedNotifier(receiver.operationManager)
@@ -91,7 +91,7 @@ private:
 
 		auto state = std::make_shared<AsyncState>(*this, std::move(handler));
 
-		message::asyncReceiveDatagram<Message>(
+		message::asyncReceiveDatagram<Message, Framing, Compression>(
 			socket, buffer, timeout,
 			[this, state = std::move(state)] (const auto & error, auto & message, const auto & senderEndpoint)
 			{
@@ -32,7 +32,7 @@
 namespace asionet
 {
 
-template<typename Message>
+template<typename Message, typename Framing = framing::Default, typename Compression = compression::None>
 class DatagramSender
 {
 public:
@@ -62,7 +62,7 @@ public:
 				   SendHandler handler)
 	{
 		auto data = std::make_shared<std::string>();
-		if (!message::internal::encode(message, *data))
+		if (!message::internal::encodeDatagram<Compression>(message, *data))
 		{
 			context.post(
 				[handler] { handler(error::encoding); });
@@ -86,7 +86,7 @@ private:
 
 	struct AsyncState
 	{
-		AsyncState(DatagramSender<Message> & sender,
+		AsyncState(DatagramSender<Message, Framing, Compression> & sender,
 		           std::shared_ptr<std::string> && data,
 		           SendHandler && handler)
 			: data(std::move(data))
@@ -116,7 +116,7 @@ private:
 
 		auto state = std::make_shared<AsyncState>(*this, std::move(data), std::move(handler));
 
-		asionet::socket::asyncSendTo(
+		asionet::socket::asyncSendTo<Framing>(
 			socket, dataRef, endpoint, timeout,
 			[this, state = std::move(state)](const auto & error)
 			{
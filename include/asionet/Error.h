@@ -71,6 +71,9 @@ const Error decoding{codes::decoding};
 namespace codes { constexpr ErrorCode invalidFrame{5}; }
 const Error invalidFrame{codes::invalidFrame};
 
+namespace codes { constexpr ErrorCode overloaded{6}; }
+const Error overloaded{codes::overloaded};
+
 }
 }
 
@@ -25,51 +25,294 @@
 #define ASIONET_FRAME_H
 
 #include <cstdint>
+#include <limits>
 #include <boost/asio/buffer.hpp>
+#include "Crc32c.h"
 #include "Utils.h"
 
 namespace asionet
 {
+
+/**
+ * A framing policy defines how the boundaries of messages are marked on the wire. It provides
+ * - MAX_HEADER_SIZE: the maximum number of bytes in front of a message,
+ * - optionally MIN_HEADER_SIZE: the number of bytes which are read at once before trying to decode the header,
+ * - encodeHeader(numDataBytes, header, numHeaderBytes): writes the header of a message into 'header' (which holds
+ *   MAX_HEADER_SIZE bytes) and returns false if a message of this size cannot be framed,
+ * - decodeHeader(bytes, size, numHeaderBytes, numDataBytes): parses the header at the front of the given bytes and
+ * - TRAILER_SIZE, encodeTrailer(data, numDataBytes, trailer) and checkTrailer(data, numDataBytes, trailer) for the bytes
+ *   which follow each message (see Checksummed and WithoutTrailer).
+ * All functions which send or receive frames take the policy as their first template parameter and
+ * services may declare it as 'using Framing = ...;'. Both sides of a connection have to use the same policy.
+ */
+namespace framing
+{
+
+// What decodeHeader() found at the front of the bytes.
+enum class HeaderStatus
+{
+    complete,
+    incomplete,
+    invalid
+};
+
+// Provides the trailer part of the policy contract for policies which don't append anything to a message.
+struct WithoutTrailer
+{
+    static constexpr std::size_t TRAILER_SIZE = 0;
+
+    static void encodeTrailer(const std::uint8_t *, std::size_t, std::uint8_t *)
+    {}
+
+    static bool checkTrailer(const std::uint8_t *, std::size_t, const std::uint8_t *)
+    {
+        return true;
+    }
+};
+
+template<std::size_t numBytes, typename Int>
+struct BigEndianLengthPrefix : WithoutTrailer
+{
+    static constexpr std::size_t MIN_HEADER_SIZE = numBytes;
+    static constexpr std::size_t MAX_HEADER_SIZE = numBytes;
+
+    static bool encodeHeader(std::size_t numDataBytes, std::uint8_t * header, std::size_t & numHeaderBytes)
+    {
+        if (numDataBytes > std::numeric_limits<Int>::max())
+            return false;
+
+        utils::toBigEndian<numBytes>(header, (Int) numDataBytes);
+        numHeaderBytes = numBytes;
+        return true;
+    }
+
+    static HeaderStatus decodeHeader(const std::uint8_t * bytes,
+                                     std::size_t size,
+                                     std::size_t & numHeaderBytes,
+                                     std::size_t & numDataBytes)
+    {
+        if (size < numBytes)
+            return HeaderStatus::incomplete;
+
+        auto length = utils::fromBigEndian<numBytes, Int>(bytes);
+        if (length > std::numeric_limits<std::size_t>::max() - numBytes)
+            return HeaderStatus::invalid;
+
+        numHeaderBytes = numBytes;
+        numDataBytes = (std::size_t) length;
+        return HeaderStatus::complete;
+    }
+};
+
+// The default: Each message is preceded by its size as a 4 byte big endian integer.
+using LengthPrefix32 = BigEndianLengthPrefix<4, std::uint32_t>;
+
+// For payloads of 4 GiB and more.
+using LengthPrefix64 = BigEndianLengthPrefix<8, std::uint64_t>;
+
+// The size is encoded with 7 bits per byte (LEB128), so messages below 128 bytes only take a single header byte.
+struct Varint : WithoutTrailer
+{
+    static constexpr std::size_t MIN_HEADER_SIZE = 1;
+    static constexpr std::size_t MAX_HEADER_SIZE = 10;
+
+    static bool encodeHeader(std::size_t numDataBytes, std::uint8_t * header, std::size_t & numHeaderBytes)
+    {
+        auto value = (std::uint64_t) numDataBytes;
+        numHeaderBytes = 0;
+        do
+        {
+            header[numHeaderBytes] = (std::uint8_t) (value & 0x7f);
+            value >>= 7;
+            if (value != 0)
+                header[numHeaderBytes] |= 0x80;
+            numHeaderBytes++;
+        } while (value != 0);
+        return true;
+    }
+
+    static HeaderStatus decodeHeader(const std::uint8_t * bytes,
+                                     std::size_t size,
+                                     std::size_t & numHeaderBytes,
+                                     std::size_t & numDataBytes)
+    {
+        std::uint64_t value = 0;
+        for (std::size_t i = 0; i < MAX_HEADER_SIZE; i++)
+        {
+            if (i == size)
+                return HeaderStatus::incomplete;
+
+            auto bits = (std::uint64_t) (bytes[i] & 0x7f);
+            // The tenth byte may only hold the most significant bit of a 64 bit integer.
+            if (i == MAX_HEADER_SIZE - 1 && bits > 1)
+                return HeaderStatus::invalid;
+
+            value |= bits << (7 * i);
+            if ((bytes[i] & 0x80) == 0)
+            {
+                if (value > std::numeric_limits<std::size_t>::max() - MAX_HEADER_SIZE)
+                    return HeaderStatus::invalid;
+
+                numHeaderBytes = i + 1;
+                numDataBytes = (std::size_t) value;
+                return HeaderStatus::complete;
+            }
+        }
+        return HeaderStatus::invalid;
+    }
+};
+
+// Every message has exactly 'size' bytes, so there's no header at all.
+template<std::size_t size>
+struct FixedSize : WithoutTrailer
+{
+    static_assert(size > 0, "Messages must not be empty.");
+
+    static constexpr std::size_t MIN_HEADER_SIZE = 0;
+    static constexpr std::size_t MAX_HEADER_SIZE = 0;
+
+    static bool encodeHeader(std::size_t numDataBytes, std::uint8_t *, std::size_t & numHeaderBytes)
+    {
+        numHeaderBytes = 0;
+        return numDataBytes == size;
+    }
+
+    static HeaderStatus decodeHeader(const std::uint8_t *,
+                                     std::size_t,
+                                     std::size_t & numHeaderBytes,
+                                     std::size_t & numDataBytes)
+    {
+        numHeaderBytes = 0;
+        numDataBytes = size;
+        return HeaderStatus::complete;
+    }
+};
+
+// Policies which don't tell the size of their shortest header are read byte by byte until the header is complete.
+template<typename Framing, typename = void>
+struct MinHeaderSizeOf
+{
+    static constexpr std::size_t value = Framing::MAX_HEADER_SIZE > 0 ? 1 : 0;
+};
+
+template<typename Framing>
+struct MinHeaderSizeOf<Framing, decltype((void) Framing::MIN_HEADER_SIZE)>
+{
+    static constexpr std::size_t value = Framing::MIN_HEADER_SIZE;
+};
+
+/**
+ * Appends the CRC-32C checksum of each message to it so that corrupted messages are rejected with
+ * error::invalidFrame before they are decoded. The size in the header of the underlying policy includes the 4 bytes
+ * of the checksum, so Checksummed<FixedSize<N>> carries messages of N - 4 bytes.
+ */
+template<typename Framing = LengthPrefix32>
+struct Checksummed
+{
+    static constexpr std::size_t MIN_HEADER_SIZE = MinHeaderSizeOf<Framing>::value;
+    static constexpr std::size_t MAX_HEADER_SIZE = Framing::MAX_HEADER_SIZE;
+    static constexpr std::size_t TRAILER_SIZE = 4;
+
+    static_assert(Framing::TRAILER_SIZE == 0, "A framing policy can only have a single trailer.");
+
+    static bool encodeHeader(std::size_t numDataBytes, std::uint8_t * header, std::size_t & numHeaderBytes)
+    {
+        if (numDataBytes > std::numeric_limits<std::size_t>::max() - TRAILER_SIZE)
+            return false;
+
+        return Framing::encodeHeader(numDataBytes + TRAILER_SIZE, header, numHeaderBytes);
+    }
+
+    static HeaderStatus decodeHeader(const std::uint8_t * bytes,
+                                     std::size_t size,
+                                     std::size_t & numHeaderBytes,
+                                     std::size_t & numDataBytes)
+    {
+        auto status = Framing::decodeHeader(bytes, size, numHeaderBytes, numDataBytes);
+        if (status != HeaderStatus::complete)
+            return status;
+
+        if (numDataBytes < TRAILER_SIZE)
+            return HeaderStatus::invalid;
+
+        numDataBytes -= TRAILER_SIZE;
+        return HeaderStatus::complete;
+    }
+
+    static void encodeTrailer(const std::uint8_t * data, std::size_t numDataBytes, std::uint8_t * trailer)
+    {
+        utils::toBigEndian<4>(trailer, utils::crc32c(data, numDataBytes));
+    }
+
+    static bool checkTrailer(const std::uint8_t * data, std::size_t numDataBytes, const std::uint8_t * trailer)
+    {
+        return utils::fromBigEndian<4, std::uint32_t>(trailer) == utils::crc32c(data, numDataBytes);
+    }
+};
+
+using Default = LengthPrefix32;
+
+}
+
 namespace internal
 {
 
-class Frame
+template<typename Framing>
+class BasicFrame
 {
 public:
-    static constexpr std::size_t HEADER_SIZE = 4;
+    // The number of buffers which getBuffers() returns.
+    static constexpr std::size_t NUM_BUFFERS = Framing::TRAILER_SIZE > 0 ? 3 : 2;
 
-    Frame(const std::uint8_t * data, std::uint32_t numDataBytes)
-        : data(data), numDataBytes(numDataBytes)
+    BasicFrame(const std::uint8_t * data, std::size_t numDataBytes)
+        : numDataBytes(numDataBytes), data(data)
     {
-        utils::toBigEndian<4>(header, numDataBytes);
+        valid = Framing::encodeHeader(numDataBytes, header, numHeaderBytes);
+        if (valid)
+            Framing::encodeTrailer(data, numDataBytes, trailer);
     }
 
-    Frame(const Frame &) = delete;
+    BasicFrame(const BasicFrame &) = delete;
 
-    Frame & operator=(const Frame &) = delete;
+    BasicFrame & operator=(const BasicFrame &) = delete;
 
-    Frame(Frame &&) = delete;
+    BasicFrame(BasicFrame &&) = delete;
 
-    Frame & operator=(Frame &&) = delete;
+    BasicFrame & operator=(BasicFrame &&) = delete;
 
     auto getBuffers() const
     {
-        return std::vector<boost::asio::const_buffer>{
-            boost::asio::buffer((const void *) header, sizeof(header)),
+        std::vector<boost::asio::const_buffer> buffers{
+            boost::asio::buffer((const void *) header, numHeaderBytes),
             boost::asio::buffer((const void *) data, numDataBytes)};
+        if (Framing::TRAILER_SIZE > 0)
+            buffers.push_back(boost::asio::buffer((const void *) trailer, Framing::TRAILER_SIZE));
+        return buffers;
     }
 
     std::size_t getSize() const
     {
-        return sizeof(header) + numDataBytes;
+        return numHeaderBytes + numDataBytes + Framing::TRAILER_SIZE;
+    }
+
+    // Returns false if the framing policy cannot frame a message of this size.
+    bool isValid() const
+    {
+        return valid;
     }
 
 private:
-    std::uint32_t numDataBytes;
-    std::uint8_t header[4];
+    std::size_t numDataBytes;
+    // Never empty so that policies without a header or trailer need no special treatment.
+    std::uint8_t header[Framing::MAX_HEADER_SIZE > 0 ? Framing::MAX_HEADER_SIZE : 1];
+    std::size_t numHeaderBytes{0};
     const std::uint8_t * data;
+    std::uint8_t trailer[Framing::TRAILER_SIZE > 0 ? Framing::TRAILER_SIZE : 1];
+    bool valid;
 };
 
+using Frame = BasicFrame<framing::Default>;
+
 }
 }
 
@@ -0,0 +1,241 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 Philipp Badenhoop
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef ASIONET_LOADBALANCEDSERVICECLIENT_H
+#define ASIONET_LOADBALANCEDSERVICECLIENT_H
+
+#include <algorithm>
+#include <mutex>
+#include <random>
+#include <vector>
+#include "MultiplexedServiceClient.h"
+
+namespace asionet
+{
+
+/**
+ * Service client which spreads its calls over a set of endpoints serving the same service.
+ *
+ * For each endpoint, the client keeps track of an exponentially weighted moving average (EWMA) of its call durations
+ * and of the number of calls which are currently in flight. Each call picks two random endpoints and goes to the one
+ * with the lower cost, which is its average latency multiplied by its number of outstanding calls plus one
+ * ("power of two choices"). This avoids herding on a single endpoint while steering calls away from slow ones.
+ * A failed call counts as if it took its whole timeout, so endpoints which fail fast (e.g. because they refuse
+ * connections) don't look like fast ones.
+ *
+ * An endpoint whose calls failed consecutiveFailures times in a row is ejected from the selection for ejectionTime
+ * multiplied by the number of times it has been ejected in a row. If all endpoints are ejected, the client picks among
+ * all of them anyway.
+ *
+ * Calls are performed by a MultiplexedServiceClient, so any number of calls may be in flight at the same time.
+ * This class is thread-safe.
+ */
+template<typename Service>
+class LoadBalancedServiceClient
+{
+public:
+	using RequestMessage = typename Service::RequestMessage;
+	using ResponseMessage = typename Service::ResponseMessage;
+	using CallHandler = std::function<void(const error::Error & error, ResponseMessage & response)>;
+
+	LoadBalancedServiceClient(asionet::Context & context,
+	                          std::size_t maxMessageSize = 512,
+	                          time::Duration idleTimeout = std::chrono::seconds(60))
+		: context(context)
+		  , client(context, maxMessageSize, idleTimeout)
+		  , randomEngine(std::random_device{}())
+	{}
+
+	void addEndpoint(const std::string & host, std::uint16_t port)
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		if (findEndpoint(host, port) != endpoints.end())
+			return;
+
+		auto endpoint = std::make_shared<EndpointState>();
+		endpoint->host = host;
+		endpoint->port = port;
+		endpoints.push_back(std::move(endpoint));
+	}
+
+	// Calls which are in flight to the endpoint are not affected.
+	void removeEndpoint(const std::string & host, std::uint16_t port)
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		auto it = findEndpoint(host, port);
+		if (it != endpoints.end())
+			endpoints.erase(it);
+	}
+
+	/**
+	 * @param smoothingFactor Weight of the latest call duration in the moving average (between 0 and 1).
+	 */
+	void setLatencySmoothing(double smoothingFactor)
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		this->smoothingFactor = smoothingFactor;
+	}
+
+	void setOutlierEjection(std::size_t consecutiveFailures, time::Duration ejectionTime)
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		this->consecutiveFailures = consecutiveFailures;
+		this->ejectionTime = ejectionTime;
+	}
+
+	void asyncCall(const RequestMessage & request, time::Duration timeout, CallHandler handler)
+	{
+		auto endpoint = pickEndpoint();
+		if (!endpoint)
+		{
+			context.post(
+				[handler = std::move(handler)]
+				{
+					ResponseMessage noResponse;
+					handler(error::failedOperation, noResponse);
+				});
+			return;
+		}
+
+		auto startTime = time::now();
+		client.asyncCall(
+			request, endpoint->host, endpoint->port, timeout,
+			[this, endpoint, startTime, timeout, handler = std::move(handler)](const auto & error, auto & response)
+			{
+				this->finishCall(*endpoint, startTime, timeout, error);
+				handler(error, response);
+			});
+	}
+
+	void cancel()
+	{
+		client.cancel();
+	}
+
+private:
+	struct EndpointState
+	{
+		std::string host;
+		std::uint16_t port;
+		// Moving average of the call durations in seconds.
+		double latency{0.0};
+		std::size_t outstanding{0};
+		std::size_t failures{0};
+		std::size_t ejections{0};
+		time::TimePoint ejectedUntil{};
+	};
+
+	using EndpointPtr = std::shared_ptr<EndpointState>;
+
+	asionet::Context & context;
+	MultiplexedServiceClient<Service> client;
+	std::mutex mutex;
+	std::vector<EndpointPtr> endpoints;
+	std::minstd_rand randomEngine;
+	double smoothingFactor{0.3};
+	std::size_t consecutiveFailures{5};
+	time::Duration ejectionTime{std::chrono::seconds(30)};
+
+	typename std::vector<EndpointPtr>::iterator findEndpoint(const std::string & host, std::uint16_t port)
+	{
+		return std::find_if(endpoints.begin(), endpoints.end(),
+		                    [&](const auto & endpoint) { return endpoint->host == host && endpoint->port == port; });
+	}
+
+	EndpointPtr pickEndpoint()
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		auto nowTime = time::now();
+
+		std::vector<EndpointPtr> candidates;
+		for (auto & endpoint : endpoints)
+		{
+			if (endpoint->ejectedUntil <= nowTime)
+				candidates.push_back(endpoint);
+		}
+
+		if (candidates.empty())
+			candidates = endpoints;
+
+		if (candidates.empty())
+			return nullptr;
+
+		auto picked = candidates.front();
+		if (candidates.size() > 1)
+		{
+			std::uniform_int_distribution<std::size_t> distribution{0, candidates.size() - 1};
+			auto first = distribution(randomEngine);
+			// Draw the second one from the remaining candidates so that we always compare two different endpoints.
+			auto second = (first + 1 + distribution(randomEngine) % (candidates.size() - 1)) % candidates.size();
+			picked = isCheaper(*candidates[second], *candidates[first]) ? candidates[second] : candidates[first];
+		}
+
+		picked->outstanding++;
+		return picked;
+	}
+
+	static bool isCheaper(const EndpointState & lhs, const EndpointState & rhs)
+	{
+		auto lhsCost = lhs.latency * (lhs.outstanding + 1);
+		auto rhsCost = rhs.latency * (rhs.outstanding + 1);
+		// Endpoints without any finished calls yet have no latency so we fall back to their number of outstanding calls.
+		if (lhsCost == rhsCost)
+			return lhs.outstanding < rhs.outstanding;
+		return lhsCost < rhsCost;
+	}
+
+	void finishCall(EndpointState & endpoint,
+	                const time::TimePoint & startTime,
+	                const time::Duration & timeout,
+	                const error::Error & error)
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		auto nowTime = time::now();
+		auto duration = std::chrono::duration<double>(error ? std::max(nowTime - startTime, timeout)
+		                                                    : nowTime - startTime).count();
+
+		endpoint.outstanding--;
+		if (endpoint.latency == 0.0)
+			endpoint.latency = duration;
+		else
+			endpoint.latency = smoothingFactor * duration + (1.0 - smoothingFactor) * endpoint.latency;
+
+		if (!error)
+		{
+			endpoint.failures = 0;
+			endpoint.ejections = 0;
+			return;
+		}
+
+		if (++endpoint.failures < consecutiveFailures)
+			return;
+
+		endpoint.failures = 0;
+		endpoint.ejections++;
+		endpoint.ejectedUntil = nowTime + ejectionTime * endpoint.ejections;
+	}
+};
+
+}
+
+#endif //ASIONET_LOADBALANCEDSERVICECLIENT_H
@@ -0,0 +1,112 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 Philipp Badenhoop
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef ASIONET_LOADSHEDDER_H
+#define ASIONET_LOADSHEDDER_H
+
+#include <cmath>
+#include "Time.h"
+
+namespace asionet
+{
+namespace utils
+{
+
+/**
+ * Decides which requests to shed based on how long they have been waiting to be handled, following CoDel.
+ * Short bursts are absorbed: Nothing is shed as long as the waiting time drops below 'target' at least once per
+ * 'interval'. Once it has stayed above target for a whole interval, requests are shed at an increasing rate
+ * (one per interval / sqrt(number of requests shed so far)) until the waiting time falls below target again.
+ * This class is not thread-safe.
+ */
+class LoadShedder
+{
+public:
+	LoadShedder(time::Duration target, time::Duration interval)
+		: target(target)
+		  , interval(interval)
+	{}
+
+	// Returns true if the request which has been waiting for queueDelay should be shed.
+	bool shouldShed(time::Duration queueDelay, time::TimePoint now = time::now())
+	{
+		if (queueDelay < target)
+		{
+			firstAboveTime = time::TimePoint{};
+			dropping = false;
+			return false;
+		}
+
+		if (firstAboveTime == time::TimePoint{})
+		{
+			firstAboveTime = now + interval;
+			return false;
+		}
+
+		if (now < firstAboveTime)
+			return false;
+
+		if (!dropping)
+		{
+			dropping = true;
+			// If we've stopped shedding only recently, the queue is likely still overloaded.
+			// So we continue with roughly the same rate as before.
+			count = count > 2 && now - dropNext < 8 * interval ? count - 2 : 1;
+			dropNext = controlLaw(now);
+			return true;
+		}
+
+		if (now < dropNext)
+			return false;
+
+		count++;
+		dropNext = controlLaw(dropNext);
+		return true;
+	}
+
+	// Whether requests are currently being shed.
+	bool isDropping() const
+	{
+		return dropping;
+	}
+
+private:
+	time::Duration target;
+	time::Duration interval;
+	// The point in time at which we start shedding if the waiting time doesn't fall below target until then.
+	time::TimePoint firstAboveTime{};
+	time::TimePoint dropNext{};
+	std::size_t count{0};
+	bool dropping{false};
+
+	time::TimePoint controlLaw(time::TimePoint t) const
+	{
+		using Seconds = std::chrono::duration<double>;
+		return t + std::chrono::duration_cast<time::Duration>(Seconds{interval} / std::sqrt((double) count));
+	}
+};
+
+}
+}
+
+#endif //ASIONET_LOADSHEDDER_H
@@ -0,0 +1,160 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 Philipp Badenhoop
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef ASIONET_LRUCACHE_H
+#define ASIONET_LRUCACHE_H
+
+#include <list>
+#include <unordered_map>
+#include "Time.h"
+
+namespace asionet
+{
+namespace utils
+{
+
+/**
+ * Key-value cache which evicts the least recently used entries once their total cost exceeds 'capacity'.
+ * Each entry costs 1 unless told otherwise, so by default the capacity is the maximum number of entries.
+ * Each entry expires at a given point in time after which it is treated as if it wasn't there.
+ * Keys are stored only once, so a cost which includes the size of the key matches the memory it takes.
+ * This class is not thread-safe.
+ */
+template<typename Key, typename Value, typename Hash = std::hash<Key>>
+class LruCache
+{
+public:
+	explicit LruCache(std::size_t capacity)
+		: capacity(capacity)
+	{}
+
+	// Returns a pointer to the cached value or nullptr if there is no such entry or if it has expired.
+	// The pointer is valid until the cache is modified.
+	Value * get(const Key & key)
+	{
+		auto it = index.find(key);
+		if (it == index.end())
+			return nullptr;
+
+		auto entryIt = it->second;
+		if (entryIt->expiry <= time::now())
+		{
+			totalCost -= entryIt->cost;
+			index.erase(it);
+			entries.erase(entryIt);
+			return nullptr;
+		}
+
+		// Mark as most recently used.
+		entries.splice(entries.begin(), entries, entryIt);
+		return &entryIt->value;
+	}
+
+	void put(const Key & key, Value value, time::TimePoint expiry, std::size_t cost = 1)
+	{
+		auto it = index.find(key);
+		if (it != index.end())
+		{
+			auto entryIt = it->second;
+			totalCost = totalCost - entryIt->cost + cost;
+			entryIt->value = std::move(value);
+			entryIt->expiry = expiry;
+			entryIt->cost = cost;
+			entries.splice(entries.begin(), entries, entryIt);
+			evict();
+			return;
+		}
+
+		auto indexIt = index.emplace(key, entries.end()).first;
+		entries.push_front(Entry{&indexIt->first, std::move(value), expiry, cost});
+		indexIt->second = entries.begin();
+		totalCost += cost;
+		evict();
+	}
+
+	void erase(const Key & key)
+	{
+		auto it = index.find(key);
+		if (it == index.end())
+			return;
+
+		totalCost -= it->second->cost;
+		entries.erase(it->second);
+		index.erase(it);
+	}
+
+	void clear()
+	{
+		index.clear();
+		entries.clear();
+		totalCost = 0;
+	}
+
+	std::size_t size() const
+	{
+		return entries.size();
+	}
+
+	// The total cost of all entries.
+	std::size_t cost() const
+	{
+		return totalCost;
+	}
+
+	void setCapacity(std::size_t capacity)
+	{
+		this->capacity = capacity;
+		evict();
+	}
+
+private:
+	struct Entry
+	{
+		// Points to the key in the index whose elements don't move.
+		const Key * key;
+		Value value;
+		time::TimePoint expiry;
+		std::size_t cost;
+	};
+
+	std::size_t capacity;
+	std::size_t totalCost{0};
+	// Ordered from most to least recently used.
+	std::list<Entry> entries;
+	std::unordered_map<Key, typename std::list<Entry>::iterator, Hash> index;
+
+	void evict()
+	{
+		while (totalCost > capacity)
+		{
+			totalCost -= entries.back().cost;
+			index.erase(index.find(*entries.back().key));
+			entries.pop_back();
+		}
+	}
+};
+
+}
+}
+
+#endif //ASIONET_LRUCACHE_H
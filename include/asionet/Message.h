@@ -25,12 +25,14 @@
 #define ASIONET_MESSAGE_H
 
 #include <cstdint>
+#include <type_traits>
 #include <vector>
 #include <boost/system/error_code.hpp>
 #include <boost/asio/write.hpp>
 #include <boost/asio/read.hpp>
 #include "Stream.h"
 #include "Socket.h"
+#include "Compression.h"
 #include <boost/algorithm/string/replace.hpp>
 
 namespace asionet
@@ -103,9 +105,69 @@ bool decode(const ConstBuffer & buffer, Message & message)
 	}
 }
 
+// Encodes the message and compresses it if that pays off. 'compressed' tells the receiver how to decode the data.
+template<typename Compression, typename Message>
+bool encodeAndCompress(const Message & message, std::string & data, bool & compressed)
+{
+	compressed = false;
+	if (!encode(message, data))
+		return false;
+
+	compressed = compression::internal::compress<Compression>(data);
+	return true;
+}
+
+// Compressed data which would exceed maxSize bytes is rejected without decompressing it.
+template<typename Compression, typename Message, typename ConstBuffer>
+bool decompressAndDecode(const ConstBuffer & buffer, bool compressed, std::size_t maxSize, Message & message)
+{
+	if (!compressed)
+		return decode(buffer, message);
+
+	std::string data;
+	if (!compression::internal::decompress<Compression>(buffer, maxSize, data))
+		return false;
+
+	return decode(asionet::internal::ConstStringBuffer{data, data.size(), 0}, message);
+}
+
+// Datagrams of a compression policy start with a byte which tells whether the rest is compressed.
+// Without compression, they carry nothing but the message.
+template<typename Compression>
+constexpr std::size_t datagramFlagSize()
+{
+	return compression::internal::isEnabled<Compression>() ? 1 : 0;
+}
+
+template<typename Compression, typename Message>
+bool encodeDatagram(const Message & message, std::string & data)
+{
+	if (!compression::internal::isEnabled<Compression>())
+		return encode(message, data);
+
+	bool compressed;
+	if (!encodeAndCompress<Compression>(message, data, compressed))
+		return false;
+
+	data.insert(data.begin(), (char) compressed);
+	return true;
+}
+
+template<typename Compression, typename Message, typename ConstBuffer>
+bool decodeDatagram(const ConstBuffer & buffer, std::size_t maxSize, Message & message)
+{
+	if (!compression::internal::isEnabled<Compression>())
+		return decode(buffer, message);
+
+	if (buffer.size() == 0 || (std::uint8_t) buffer[0] > 1)
+		return false;
+
+	return decompressAndDecode<Compression>(buffer.subBuffer(1), buffer[0] != 0, maxSize, message);
 }
 
-template<typename Message, typename SyncWriteStream>
+}
+
+template<typename Message, typename Framing = framing::Default, typename SyncWriteStream>
 void asyncSend(SyncWriteStream & stream,
                const Message & message,
                const time::Duration & timeout,
@@ -122,32 +184,55 @@ void asyncSend(SyncWriteStream & stream,
 	// keep reference because of std::move()
 	auto & dataRef = *data;
 
-	asionet::stream::asyncWrite(
+	asionet::stream::asyncWrite<Framing>(
 		stream, dataRef, timeout,
 		[handler = std::move(handler), data = std::move(data)](const auto & errorCode) { handler(errorCode); });
 };
 
-template<typename Message, typename SyncReadStream>
+namespace internal
+{
+
+template<typename Message>
+asionet::stream::ReadHandler decodingHandler(ReceiveHandler<Message> handler)
+{
+	return [handler = std::move(handler)](const auto & errorCode, const auto & constBuffer)
+	{
+		Message message;
+		if (!internal::decode(constBuffer, message))
+		{
+			handler(error::decoding, message);
+			return;
+		}
+		handler(errorCode, message);
+	};
+}
+
+}
+
+template<typename Message, typename Framing = framing::Default, typename SyncReadStream>
 void asyncReceive(SyncReadStream & stream,
                   boost::asio::streambuf & buffer,
                   const time::Duration & timeout,
                   ReceiveHandler<Message> handler)
 {
-	asionet::stream::asyncRead(
-		stream, buffer, timeout,
-		[handler = std::move(handler)](const auto & errorCode, const auto & constBuffer)
-		{
-			Message message;
-			if (!internal::decode(constBuffer, message))
-			{
-				handler(error::decoding, message);
-				return;
-			}
-			handler(errorCode, message);
-		});
+	asionet::stream::asyncRead<Framing>(stream, buffer, timeout, internal::decodingHandler<Message>(std::move(handler)));
+};
+
+// Like asyncReceive() but reads ahead (see stream::asyncReadAhead()), so the same buffer has to be passed to each call.
+template<typename Message, typename Framing = framing::Default, typename SyncReadStream>
+void asyncReceiveAhead(SyncReadStream & stream,
+                       boost::asio::streambuf & buffer,
+                       const time::Duration & timeout,
+                       ReceiveHandler<Message> handler)
+{
+	asionet::stream::asyncReadAhead<Framing>(
+		stream, buffer, timeout, internal::decodingHandler<Message>(std::move(handler)));
 };
 
-template<typename Message, typename DatagramSocket>
+template<typename Message,
+         typename Framing = framing::Default,
+         typename Compression = compression::None,
+         typename DatagramSocket>
 void asyncSendDatagram(DatagramSocket & socket,
                        const Message & message,
                        const std::string & ip,
@@ -156,10 +241,15 @@ void asyncSendDatagram(DatagramSocket & socket,
                        SendToHandler handler)
 {
 	using Endpoint = boost::asio::ip::udp::endpoint;
-	asyncSendDatagram(socket, message, Endpoint{boost::asio::ip::address::from_string(ip), port}, timeout, handler);
+	asyncSendDatagram<Message, Framing, Compression>(
+		socket, message, Endpoint{boost::asio::ip::address::from_string(ip), port}, timeout, handler);
 }
 
-template<typename Message, typename DatagramSocket, typename Endpoint>
+template<typename Message,
+         typename Framing = framing::Default,
+         typename Compression = compression::None,
+         typename DatagramSocket,
+         typename Endpoint>
 void asyncSendDatagram(DatagramSocket & socket,
                        const Message & message,
                        const Endpoint & endpoint,
@@ -167,7 +257,7 @@ void asyncSendDatagram(DatagramSocket & socket,
                        SendToHandler handler)
 {
 	auto data = std::make_shared<std::string>();
-	if (!internal::encode(message, *data))
+	if (!internal::encodeDatagram<Compression>(message, *data))
 	{
 		socket.get_executor().context().post(
 			[handler] { handler(error::encoding); });
@@ -177,23 +267,29 @@ void asyncSendDatagram(DatagramSocket & socket,
 	// keep reference because of std::move()
 	auto & dataRef = *data;
 
-	asionet::socket::asyncSendTo(
+	asionet::socket::asyncSendTo<Framing>(
 		socket, dataRef, endpoint, timeout,
 		[handler = std::move(handler), data = std::move(data)](const auto & error) { handler(error); });
 }
 
-template<typename Message, typename DatagramSocket>
+// Compressed messages are restored up to the size of the buffer.
+template<typename Message,
+         typename Framing = framing::Default,
+         typename Compression = compression::None,
+         typename DatagramSocket>
 void asyncReceiveDatagram(DatagramSocket & socket,
                           std::vector<char> & buffer,
                           const time::Duration & timeout,
                           ReceiveFromHandler<Message> handler)
 {
-	asionet::socket::asyncReceiveFrom(
+	asionet::socket::asyncReceiveFrom<Framing>(
 		socket, buffer, timeout,
-		[handler = std::move(handler)](const auto & error, const auto & constBuffer, const auto & senderEndpoint)
+		[handler = std::move(handler), maxSize = buffer.size()](const auto & error,
+		                                                        const auto & constBuffer,
+		                                                        const auto & senderEndpoint)
 		{
 			Message message;
-			if (!internal::decode(constBuffer, message))
+			if (!error && !internal::decodeDatagram<Compression>(constBuffer, maxSize, message))
 			{
 				handler(error::decoding, message, senderEndpoint);
 				return;
@@ -0,0 +1,486 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 Philipp Badenhoop
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef ASIONET_MULTIPLEXEDSERVICECLIENT_H
+#define ASIONET_MULTIPLEXEDSERVICECLIENT_H
+
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <boost/asio/ip/tcp.hpp>
+#include "Message.h"
+#include "Error.h"
+#include "Context.h"
+#include "Timer.h"
+#include "ConnectionPool.h"
+#include "ServiceHeader.h"
+
+namespace asionet
+{
+
+/**
+ * Service client which sends all calls to the same endpoint over a single connection without waiting for the
+ * responses of previous calls. Each request carries an id which the server echoes in its response so that
+ * responses may arrive in any order.
+ *
+ * In contrast to ServiceClient, calls are not queued: any number of calls may be in flight at the same time, each of
+ * them guarded by its own timeout. A connection is closed if no response has been received for idleTimeout. If a
+ * connection fails, all calls which are in flight on it are completed with the connection's error.
+ *
+ * Requests which have to wait for the request in front of them to be sent are written together with a single write.
+ * Optionally, requests can be held back for a short batching window so that bursts of calls are written at once.
+ */
+template<typename Service>
+class MultiplexedServiceClient
+{
+public:
+	using RequestMessage = typename Service::RequestMessage;
+	using ResponseMessage = typename Service::ResponseMessage;
+	using CallHandler = std::function<void(const error::Error & error, ResponseMessage & response)>;
+	using Protocol = boost::asio::ip::tcp;
+	using EndpointIterator = Protocol::resolver::iterator;
+	using Socket = Protocol::socket;
+	using Framing = typename internal::FramingOf<Service>::type;
+	using Compression = typename internal::CompressionOf<Service>::type;
+
+	MultiplexedServiceClient(asionet::Context & context,
+	                         std::size_t maxMessageSize = 512,
+	                         time::Duration idleTimeout = std::chrono::seconds(60))
+		: context(context)
+		  , maxMessageSize(maxMessageSize)
+		  , idleTimeout(idleTimeout)
+	{}
+
+	void asyncCall(const RequestMessage & request,
+	               const std::string & host,
+	               std::uint16_t port,
+	               time::Duration timeout,
+	               CallHandler handler)
+	{
+		Connector connector = [host, port](Socket & socket, const time::Duration & timeout, socket::ConnectHandler handler)
+		{ asionet::socket::asyncConnect(socket, host, port, timeout, std::move(handler)); };
+		startCall(request, ConnectionPool::makeKey(host, port), connector, timeout, handler);
+	}
+
+	void asyncCall(const RequestMessage & request,
+	               EndpointIterator endpointIterator,
+	               time::Duration timeout,
+	               CallHandler handler)
+	{
+		std::string key;
+		if (endpointIterator != EndpointIterator{})
+			key = ConnectionPool::makeKey(endpointIterator->endpoint());
+		Connector connector = [endpointIterator](Socket & socket, const time::Duration & timeout, socket::ConnectHandler handler)
+		{ asionet::socket::asyncConnect(socket, endpointIterator, timeout, std::move(handler)); };
+		startCall(request, key, connector, timeout, handler);
+	}
+
+	/**
+	 * Holds back requests for up to 'window' so that requests of further calls are written together with them.
+	 * A batch is written as soon as it holds at least maxBatchBytes. A window of zero disables batching.
+	 * Must be called before any calls are made.
+	 */
+	void setBatching(time::Duration window, std::size_t maxBatchBytes)
+	{
+		batchingWindow = window;
+		maxBatchSize = maxBatchBytes;
+	}
+
+	// Closes all connections which completes all calls in flight with error::aborted.
+	void cancel()
+	{
+		std::vector<std::shared_ptr<Connection>> closedConnections;
+		{
+			std::lock_guard<std::mutex> lock{mutex};
+			for (auto & pair : connections)
+				closedConnections.push_back(pair.second);
+		}
+
+		for (auto & connection : closedConnections)
+			failConnection(connection, error::aborted);
+	}
+
+private:
+	using RequestId = internal::ServiceHeader::RequestId;
+	using Connector = std::function<void(Socket & socket, const time::Duration & timeout, socket::ConnectHandler handler)>;
+
+	struct PendingCall
+	{
+		CallHandler handler;
+		std::shared_ptr<Timer> timer;
+	};
+
+	struct Response
+	{
+		RequestId requestId;
+		error::Error error;
+		ResponseMessage message;
+	};
+
+	using Batch = std::vector<std::string>;
+
+	struct Connection
+	{
+		Connection(MultiplexedServiceClient<Service> & client, const std::string & key)
+			: key(key)
+			  , socket(client.context)
+			  , buffer(client.maxMessageSize + Framing::MAX_HEADER_SIZE + Framing::TRAILER_SIZE
+			           + internal::ServiceHeader::MAX_SIZE)
+			  , batchTimer(std::make_shared<Timer>(client.context))
+		{}
+
+		std::string key;
+		Socket socket;
+		boost::asio::streambuf buffer;
+		std::mutex mutex;
+		bool connected{false};
+		bool closed{false};
+		std::unordered_map<RequestId, PendingCall> pendingCalls;
+		// Requests which wait for the connection to be established, for the batching window to pass or for the
+		// requests in front of them to be sent.
+		std::deque<std::string> writeQueue;
+		std::size_t numQueuedBytes{0};
+		bool writing{false};
+		bool flushScheduled{false};
+		std::shared_ptr<Timer> batchTimer;
+	};
+
+	asionet::Context & context;
+	std::size_t maxMessageSize;
+	time::Duration idleTimeout;
+	time::Duration batchingWindow{0};
+	std::size_t maxBatchSize{65536};
+	std::atomic<RequestId> nextRequestId{0};
+	std::mutex mutex;
+	std::unordered_map<std::string, std::shared_ptr<Connection>> connections;
+
+	void startCall(const RequestMessage & request,
+	               const std::string & key,
+	               const Connector & connector,
+	               const time::Duration & timeout,
+	               CallHandler & handler)
+	{
+		auto requestId = nextRequestId++;
+
+		std::string sendData;
+		internal::ServiceHeader header{internal::ServiceHeader::MULTIPLEXED, requestId};
+		internal::describeService<Service>(header);
+		// Time spent while connecting or batching is not subtracted, so the server may consider it a bit longer.
+		header.setTimeout(timeout);
+		if (!internal::encodeServiceMessage<Compression>(header, request, sendData))
+		{
+			context.post(
+				[handler]
+				{
+					ResponseMessage noResponse;
+					handler(error::encoding, noResponse);
+				});
+			return;
+		}
+
+		bool newConnection = false;
+		std::shared_ptr<Connection> connection;
+		{
+			std::lock_guard<std::mutex> lock{mutex};
+			auto & entry = connections[key];
+			if (!entry)
+			{
+				entry = std::make_shared<Connection>(*this, key);
+				newConnection = true;
+			}
+			connection = entry;
+		}
+
+		auto timer = std::make_shared<Timer>(context);
+		std::shared_ptr<Batch> batch;
+		bool scheduleFlush = false;
+		{
+			std::lock_guard<std::mutex> lock{connection->mutex};
+			if (connection->closed)
+			{
+				context.post(
+					[handler]
+					{
+						ResponseMessage noResponse;
+						handler(error::aborted, noResponse);
+					});
+				return;
+			}
+
+			connection->pendingCalls.emplace(requestId, PendingCall{std::move(handler), timer});
+
+			connection->numQueuedBytes += sendData.size();
+			connection->writeQueue.push_back(std::move(sendData));
+
+			if (connection->connected && !connection->writing)
+			{
+				if (batchingWindow == time::Duration::zero() || connection->numQueuedBytes >= maxBatchSize)
+					batch = takeBatch(*connection);
+				else if (!connection->flushScheduled)
+					scheduleFlush = connection->flushScheduled = true;
+			}
+		}
+
+		// The timer's handler keeps the timer alive since the call may complete and drop it while the handler is pending.
+		std::weak_ptr<Connection> weakConnection = connection;
+		timer->startTimeout(
+			timeout,
+			[this, weakConnection, requestId, timer]
+			{
+				auto connection = weakConnection.lock();
+				if (connection)
+					this->completeCall(connection, requestId, error::aborted);
+			});
+
+		if (newConnection)
+			connect(connection, connector, timeout);
+
+		if (scheduleFlush)
+			scheduleBatch(connection);
+
+		if (batch)
+			write(connection, std::move(batch));
+	}
+
+	void connect(const std::shared_ptr<Connection> & connection, const Connector & connector, const time::Duration & timeout)
+	{
+		connector(
+			connection->socket, timeout,
+			[this, connection](const auto & error)
+			{
+				if (error)
+				{
+					this->failConnection(connection, error);
+					return;
+				}
+
+				// Small requests must not be held back by Nagle's algorithm while waiting for outstanding responses.
+				boost::system::error_code ignoredError;
+				connection->socket.set_option(Protocol::no_delay{true}, ignoredError);
+
+				std::shared_ptr<Batch> batch;
+				{
+					std::lock_guard<std::mutex> lock{connection->mutex};
+					connection->connected = true;
+					if (!connection->writeQueue.empty())
+						batch = this->takeBatch(*connection);
+				}
+
+				this->receiveResponse(connection);
+
+				if (batch)
+					this->write(connection, std::move(batch));
+			});
+	}
+
+	void scheduleBatch(const std::shared_ptr<Connection> & connection)
+	{
+		// The timer's handler keeps the timer alive since the connection may be dropped while the handler is pending.
+		std::weak_ptr<Connection> weakConnection = connection;
+		auto timer = connection->batchTimer;
+		timer->startTimeout(
+			batchingWindow,
+			[this, weakConnection, timer]
+			{
+				auto connection = weakConnection.lock();
+				if (connection)
+					this->flush(connection);
+			});
+	}
+
+	void flush(const std::shared_ptr<Connection> & connection)
+	{
+		std::shared_ptr<Batch> batch;
+		{
+			std::lock_guard<std::mutex> lock{connection->mutex};
+			connection->flushScheduled = false;
+			if (connection->closed || connection->writing || connection->writeQueue.empty())
+				return;
+			batch = takeBatch(*connection);
+		}
+
+		write(connection, std::move(batch));
+	}
+
+	// Takes the queued requests which are written next. The connection's mutex must be locked.
+	std::shared_ptr<Batch> takeBatch(Connection & connection)
+	{
+		auto batch = std::make_shared<Batch>();
+		std::size_t numBytes = 0;
+		while (!connection.writeQueue.empty()
+		       && (batch->empty() || numBytes + connection.writeQueue.front().size() <= maxBatchSize))
+		{
+			numBytes += connection.writeQueue.front().size();
+			batch->push_back(std::move(connection.writeQueue.front()));
+			connection.writeQueue.pop_front();
+		}
+
+		connection.numQueuedBytes -= numBytes;
+		connection.writing = true;
+		return batch;
+	}
+
+	void write(const std::shared_ptr<Connection> & connection, std::shared_ptr<Batch> batch)
+	{
+		auto & batchRef = *batch;
+
+		asionet::stream::asyncWrite<Framing>(
+			connection->socket, batchRef, idleTimeout,
+			[this, connection, batch = std::move(batch)](const auto & error)
+			{
+				if (error)
+				{
+					this->failConnection(connection, error);
+					return;
+				}
+
+				// Requests which have been queued in the meantime are written right away.
+				std::shared_ptr<Batch> nextBatch;
+				{
+					std::lock_guard<std::mutex> lock{connection->mutex};
+					if (connection->writeQueue.empty())
+					{
+						connection->writing = false;
+						return;
+					}
+					nextBatch = this->takeBatch(*connection);
+				}
+
+				this->write(connection, std::move(nextBatch));
+			});
+	}
+
+	void receiveResponse(const std::shared_ptr<Connection> & connection)
+	{
+		asionet::stream::asyncReadFrames<Framing>(
+			connection->socket, connection->buffer, idleTimeout,
+			[this, connection](const auto & readError, const auto & frames)
+			{
+				if (readError)
+				{
+					this->failConnection(connection, readError);
+					return;
+				}
+
+				// Decode all responses before receiving the next ones since this invalidates the frames.
+				std::vector<Response> responses;
+				responses.reserve(frames.size());
+				error::Error frameError;
+				for (const auto & frame : frames)
+				{
+					internal::ServiceHeader header;
+					Response response;
+					response.error = internal::decodeServiceMessage<Compression>(
+						frame, maxMessageSize, header, response.message);
+					if (response.error == error::invalidFrame)
+					{
+						frameError = response.error;
+						break;
+					}
+
+					// The server is going to close the connection after this response, so new calls must not use it
+					// anymore. Responses to the calls which are already in flight may still arrive.
+					if (header.isClosing())
+						this->retireConnection(connection);
+
+					response.requestId = header.getRequestId();
+					responses.push_back(std::move(response));
+				}
+
+				// The responses have been decoded so we're free to receive the next ones.
+				if (!frameError)
+					this->receiveResponse(connection);
+
+				for (auto & response : responses)
+					this->completeCall(connection, response.requestId, response.error, response.message);
+
+				if (frameError)
+					this->failConnection(connection, frameError);
+			});
+	}
+
+	void completeCall(const std::shared_ptr<Connection> & connection, RequestId requestId, const error::Error & error)
+	{
+		ResponseMessage noResponse;
+		completeCall(connection, requestId, error, noResponse);
+	}
+
+	void completeCall(const std::shared_ptr<Connection> & connection,
+	                  RequestId requestId,
+	                  const error::Error & error,
+	                  ResponseMessage & response)
+	{
+		PendingCall call;
+		{
+			std::lock_guard<std::mutex> lock{connection->mutex};
+			auto it = connection->pendingCalls.find(requestId);
+			// The call has already timed out.
+			if (it == connection->pendingCalls.end())
+				return;
+			call = std::move(it->second);
+			connection->pendingCalls.erase(it);
+		}
+
+		call.timer->cancel();
+		call.handler(error, response);
+	}
+
+	void retireConnection(const std::shared_ptr<Connection> & connection)
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		auto it = connections.find(connection->key);
+		if (it != connections.end() && it->second == connection)
+			connections.erase(it);
+	}
+
+	void failConnection(const std::shared_ptr<Connection> & connection, const error::Error & error)
+	{
+		retireConnection(connection);
+
+		std::unordered_map<RequestId, PendingCall> failedCalls;
+		{
+			std::lock_guard<std::mutex> lock{connection->mutex};
+			if (connection->closed)
+				return;
+			connection->closed = true;
+			failedCalls.swap(connection->pendingCalls);
+			connection->writeQueue.clear();
+			connection->numQueuedBytes = 0;
+		}
+
+		closeable::Closer<Socket>::close(connection->socket);
+
+		for (auto & pair : failedCalls)
+		{
+			auto & call = pair.second;
+			call.timer->cancel();
+			ResponseMessage noResponse;
+			call.handler(error, noResponse);
+		}
+	}
+};
+
+}
+
+#endif //ASIONET_MULTIPLEXEDSERVICECLIENT_H
@@ -30,6 +30,7 @@
 #include "Utils.h"
 #include "Context.h"
 #include "AsyncOperationManager.h"
+#include "ResolverCache.h"
 
 namespace asionet
 {
@@ -76,6 +77,21 @@ private:
     std::atomic<bool> opened{true};
 };
 
+template<typename Results>
+void cacheResolveResult(const std::string & host,
+                        const std::string & service,
+                        const error::Error & error,
+                        const Results & results)
+{
+    using Protocol = typename Results::protocol_type;
+
+    // Canceled or timed out resolutions carry no boost error code and must not be cached.
+    if (error && !error.boostCode)
+        return;
+
+    ResolverCache<Protocol>::shared().insert(host, service, results, error.boostCode);
+}
+
 }
 
 template<typename Protocol>
@@ -129,12 +145,32 @@ private:
                                const time::Duration & timeout,
                                const ResolveHandler & handler)
     {
+        using Cache = ResolverCache<Protocol>;
+
+        auto state = std::make_shared<AsyncState>(*this, handler);
+
+        // Skip resolving if the host is already an IP address or if we've resolved it recently.
+        typename Cache::Results results;
+        boost::system::error_code cachedError;
+        if (Cache::resolveNumeric(host, service, results) || Cache::shared().lookup(host, service, results, cachedError))
+        {
+            context.post(
+                [state = std::move(state), results, cachedError]
+                {
+                    error::Error error;
+                    if (cachedError)
+                        error = error::Error{error::codes::failedOperation, cachedError};
+
+                    state->finishedNotifier.notify();
+                    state->handler(error, results);
+                });
+            return;
+        }
+
         resolver.open();
 
         typename UnderlyingResolver::Query query{host, service};
 
-        auto state = std::make_shared<AsyncState>(*this, handler);
-
         auto resolveOperation = [this](auto && ... args)
         { resolver.async_resolve(std::forward<decltype(args)>(args)...); };
 
@@ -142,8 +178,10 @@ private:
             resolveOperation,
             resolver,
             timeout,
-            [this, state = std::move(state)](const auto & error, const auto & endpointIterator)
+            [this, host, service, state = std::move(state)](const auto & error, const auto & endpointIterator)
             {
+                internal::cacheResolveResult(host, service, error, endpointIterator);
+
 	            state->finishedNotifier.notify();
                 state->handler(error, endpointIterator);
             },
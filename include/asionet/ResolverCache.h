@@ -0,0 +1,169 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 Philipp Badenhoop
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef ASIONET_RESOLVERCACHE_H
+#define ASIONET_RESOLVERCACHE_H
+
+#include <mutex>
+#include <boost/asio/ip/address.hpp>
+#include <boost/asio/ip/basic_resolver_results.hpp>
+#include "LruCache.h"
+#include "Time.h"
+
+namespace asionet
+{
+
+/**
+ * Thread-safe cache of name resolution results which is consulted by Resolver and socket::asyncConnect before
+ * querying the system's resolver.
+ *
+ * Successful resolutions are cached for 'timeToLive', permanent failures (unknown hosts or services) for
+ * 'negativeTimeToLive'. Temporary failures of the name service as well as canceled or timed out resolutions are not
+ * cached at all. Hosts which are numeric IP addresses with numeric services
+ * are never resolved nor cached.
+ */
+template<typename Protocol>
+class ResolverCache
+{
+public:
+	using Results = boost::asio::ip::basic_resolver_results<Protocol>;
+	using Endpoint = typename Protocol::endpoint;
+
+	explicit ResolverCache(std::size_t maxSize = 1024,
+	                       time::Duration timeToLive = std::chrono::seconds(60),
+	                       time::Duration negativeTimeToLive = std::chrono::seconds(5))
+		: cache(maxSize)
+		  , timeToLive(timeToLive)
+		  , negativeTimeToLive(negativeTimeToLive)
+	{}
+
+	// The cache which is used by Resolver and socket::asyncConnect.
+	static ResolverCache & shared()
+	{
+		static ResolverCache instance;
+		return instance;
+	}
+
+	// Returns true if there is an entry for the host and service in which case either 'results' or 'error' is set.
+	bool lookup(const std::string & host,
+	            const std::string & service,
+	            Results & results,
+	            boost::system::error_code & error)
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		auto entry = cache.get(makeKey(host, service));
+		if (!entry)
+			return false;
+
+		results = entry->results;
+		error = entry->error;
+		return true;
+	}
+
+	void insert(const std::string & host,
+	            const std::string & service,
+	            const Results & results,
+	            const boost::system::error_code & error)
+	{
+		if (error && !isCacheable(error))
+			return;
+
+		std::lock_guard<std::mutex> lock{mutex};
+		auto expiry = time::now() + (error ? negativeTimeToLive : timeToLive);
+		cache.put(makeKey(host, service), Entry{results, error}, expiry);
+	}
+
+	void clear()
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		cache.clear();
+	}
+
+	void setMaxSize(std::size_t maxSize)
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		cache.setCapacity(maxSize);
+	}
+
+	void setTimeToLive(time::Duration timeToLive, time::Duration negativeTimeToLive)
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		this->timeToLive = timeToLive;
+		this->negativeTimeToLive = negativeTimeToLive;
+	}
+
+	std::size_t size() const
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		return cache.size();
+	}
+
+	// Returns true if the host is an IP address and the service a port number in which case there's nothing to resolve.
+	static bool resolveNumeric(const std::string & host, const std::string & service, Results & results)
+	{
+		if (service.empty() || service.size() > 5 || service.find_first_not_of("0123456789") != std::string::npos)
+			return false;
+
+		auto port = std::stoul(service);
+		if (port > 0xffff)
+			return false;
+
+		boost::system::error_code error;
+		auto address = boost::asio::ip::make_address(host, error);
+		if (error)
+			return false;
+
+		results = Results::create(Endpoint{address, (std::uint16_t) port}, host, service);
+		return true;
+	}
+
+private:
+	struct Entry
+	{
+		Results results;
+		boost::system::error_code error;
+	};
+
+	mutable std::mutex mutex;
+	utils::LruCache<std::string, Entry> cache;
+	time::Duration timeToLive;
+	time::Duration negativeTimeToLive;
+
+	static std::string makeKey(const std::string & host, const std::string & service)
+	{
+		return host + ":" + service;
+	}
+
+	// Only permanent answers of the name service are worth caching. A name server which didn't respond in time
+	// (try_again) shouldn't block the host, and neither should local failures like cancellation.
+	static bool isCacheable(const boost::system::error_code & error)
+	{
+		return error == boost::asio::error::host_not_found
+		       || error == boost::asio::error::no_data
+		       || error == boost::asio::error::service_not_found;
+	}
+};
+
+}
+
+#endif //ASIONET_RESOLVERCACHE_H
@@ -24,6 +24,8 @@
 #ifndef ASIONET_SERVICECLIENT_H
 #define ASIONET_SERVICECLIENT_H
 
+#include <algorithm>
+#include <deque>
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/connect.hpp>
@@ -31,7 +33,11 @@
 #include "Utils.h"
 #include "Error.h"
 #include "Context.h"
+#include "Timer.h"
 #include "AsyncOperationManager.h"
+#include "ConnectionPool.h"
+#include "Monitor.h"
+#include "ServiceHeader.h"
 
 namespace asionet
 {
@@ -43,31 +49,38 @@ public:
 	using RequestMessage = typename Service::RequestMessage;
 	using ResponseMessage = typename Service::ResponseMessage;
 	using CallHandler = std::function<void(const error::Error & error, ResponseMessage & response)>;
+	using WarmUpHandler = std::function<void(const error::Error & error, std::size_t numConnections)>;
 	using Protocol = boost::asio::ip::tcp;
 	using EndpointIterator = Protocol::resolver::iterator;
 	using Socket = Protocol::socket;
-	using Frame = asionet::internal::Frame;
+	using Framing = typename internal::FramingOf<Service>::type;
+	using Compression = typename internal::CompressionOf<Service>::type;
 
 	ServiceClient(asionet::Context & context, std::size_t maxMessageSize = 512)
 		: context(context)
-		  , socket(context)
 		  , maxMessageSize(maxMessageSize)
 		  , operationManager(context, [this] { this->cancelOperation(); })
 	{}
 
+	/**
+	 * Creates a client which borrows its connections from the given pool instead of connecting for each call.
+	 * Connections are returned to the pool after each successful call so that subsequent calls to the same endpoint
+	 * can reuse them. The pool may be shared between multiple clients.
+	 */
+	ServiceClient(asionet::Context & context, std::shared_ptr<ConnectionPool> pool, std::size_t maxMessageSize = 512)
+		: context(context)
+		  , maxMessageSize(maxMessageSize)
+		  , pool(std::move(pool))
+		  , operationManager(context, [this] { this->cancelOperation(); })
+	{}
+
 	void asyncCall(const RequestMessage & request,
 	               std::string host,
 	               std::uint16_t port,
 	               time::Duration timeout,
 	               CallHandler handler)
 	{
-		auto sendData = encode(request, handler);
-		if (!sendData)
-			return;
-
-		auto asyncOperation = [this](auto && ... args)
-		{ this->asyncCallOperation(std::forward<decltype(args)>(args)...); };
-		operationManager.startOperation(asyncOperation, sendData, host, port, timeout, handler);
+		startCall(request, {makeTarget(host, port)}, timeout, handler);
 	}
 
 	void asyncCall(const RequestMessage & request,
@@ -75,13 +88,33 @@ public:
 	               time::Duration timeout,
 	               CallHandler handler)
 	{
-		auto sendData = encode(request, handler);
-		if (!sendData)
-			return;
+		startCall(request, {makeTarget(endpointIterator)}, timeout, handler);
+	}
 
-		auto asyncOperation = [this](auto && ... args)
-		{ this->asyncCallOperation(std::forward<decltype(args)>(args)...); };
-		operationManager.startOperation(asyncOperation, sendData, endpointIterator, timeout, handler);
+	/**
+	 * Hedged call: The request is sent to host:port first. If there's no response after the hedging delay (see
+	 * setHedging()) or if the first request fails, the request is sent to backupHost:backupPort as well.
+	 * The call completes with whichever response arrives first and the other request is canceled.
+	 * Since both servers may end up handling the request, only use this for idempotent services.
+	 */
+	void asyncCall(const RequestMessage & request,
+	               std::string host,
+	               std::uint16_t port,
+	               std::string backupHost,
+	               std::uint16_t backupPort,
+	               time::Duration timeout,
+	               CallHandler handler)
+	{
+		startCall(request, {makeTarget(host, port), makeTarget(backupHost, backupPort)}, timeout, handler);
+	}
+
+	void asyncCall(const RequestMessage & request,
+	               EndpointIterator endpointIterator,
+	               EndpointIterator backupEndpointIterator,
+	               time::Duration timeout,
+	               CallHandler handler)
+	{
+		startCall(request, {makeTarget(endpointIterator), makeTarget(backupEndpointIterator)}, timeout, handler);
 	}
 
 	void cancel()
@@ -89,132 +122,557 @@ public:
 		operationManager.cancelOperation();
 	}
 
+	/**
+	 * Sets the delay after which hedged calls send their backup request. The delay is the given percentile (between
+	 * 0 and 1) of the durations of the recent successful calls of this client. As long as there are too few of them,
+	 * initialDelay is used instead.
+	 */
+	void setHedging(double percentile, time::Duration initialDelay)
+	{
+		std::lock_guard<std::mutex> lock{latencyMutex};
+		hedgingPercentile = percentile;
+		initialHedgingDelay = initialDelay;
+	}
+
+	/**
+	 * Lets calls to a host name race connection attempts to its addresses (see socket::asyncConnectRacing()) instead of
+	 * trying one address after another. The next address is tried whenever the previous attempt hasn't finished within
+	 * attemptDelay. A delay of zero (the default) disables racing.
+	 */
+	void setConnectRacing(time::Duration attemptDelay)
+	{
+		connectAttemptDelay = attemptDelay;
+	}
+
+	/**
+	 * Connects in the background so that the pool holds numConnectionsPerEndpoint idle connections to each of the
+	 * given host/port pairs (as far as the limits of the pool allow). This way, the first calls neither have to resolve
+	 * nor to connect. The handler is called with the number of newly established connections once all of them are done.
+	 * If any connection fails, it receives the error of that connection. Warming up is not affected by cancel().
+	 * Without a pool, there's nowhere to keep the connections, so the handler receives error::failedOperation.
+	 */
+	void asyncWarmUp(const std::vector<std::pair<std::string, std::uint16_t>> & endpoints,
+	                 std::size_t numConnectionsPerEndpoint,
+	                 time::Duration timeout,
+	                 WarmUpHandler handler)
+	{
+		if (!pool)
+		{
+			context.post([handler] { handler(error::failedOperation, 0); });
+			return;
+		}
+
+		struct WarmUpState
+		{
+			WarmUpHandler handler;
+			std::mutex mutex;
+			std::size_t numPending{0};
+			std::size_t numConnections{0};
+			error::Error error{error::success};
+		};
+
+		auto state = std::make_shared<WarmUpState>();
+		state->handler = std::move(handler);
+
+		std::vector<std::pair<std::string, std::vector<ConnectionPool::SocketPtr>>> reservations;
+		for (const auto & endpoint : endpoints)
+		{
+			auto key = ConnectionPool::makeKey(endpoint.first, endpoint.second);
+			auto sockets = pool->reserve(key, numConnectionsPerEndpoint);
+			state->numPending += sockets.size();
+			reservations.emplace_back(std::move(key), std::move(sockets));
+		}
+
+		if (state->numPending == 0)
+		{
+			context.post([state] { state->handler(error::success, 0); });
+			return;
+		}
+
+		for (std::size_t i = 0; i < endpoints.size(); ++i)
+		{
+			for (auto & socket : reservations[i].second)
+			{
+				// Capture the pool instead of this since the client may be gone until the connection is established.
+				asionet::socket::asyncConnect(
+					*socket, endpoints[i].first, endpoints[i].second, timeout,
+					[pool = pool, key = reservations[i].first, socket, state](const auto & error)
+					{
+						// The pool drops closed sockets.
+						if (error)
+							closeable::Closer<Socket>::close(*socket);
+						pool->release(key, socket);
+
+						bool done;
+						{
+							std::lock_guard<std::mutex> lock{state->mutex};
+							if (error)
+								state->error = error;
+							else
+								state->numConnections++;
+							done = --state->numPending == 0;
+						}
+
+						if (done)
+							state->handler(state->error, state->numConnections);
+					});
+			}
+		}
+	}
+
 private:
+	// Returns an empty canceler if closing the socket cancels the connect already.
+	using Connector = std::function<socket::ConnectCanceler(Socket & socket,
+	                                                        const time::Duration & timeout,
+	                                                        socket::ConnectHandler handler)>;
+
+	// Number of recent call durations from which the hedging delay is derived.
+	static constexpr std::size_t LATENCY_WINDOW_SIZE = 128;
+	static constexpr std::size_t MIN_LATENCY_SAMPLES = 16;
+
+	// The endpoint where a request is sent to.
+	struct Target
+	{
+		std::string poolKey;
+		Connector connector;
+	};
+
+	// A single request of a call over its own connection. Hedged calls consist of up to two attempts.
+	struct Attempt
+	{
+		Attempt(ServiceClient<Service> & client, const Target & target, time::Duration timeout)
+			: target(target)
+			  , timeout(timeout)
+			  , startTime(time::now())
+			  , beginTime(startTime)
+			  , buffer(client.maxMessageSize + Framing::MAX_HEADER_SIZE + Framing::TRAILER_SIZE
+			           + internal::ServiceHeader::MAX_SIZE)
+		{}
+
+		Target target;
+		time::Duration timeout;
+		time::TimePoint startTime;
+		time::TimePoint beginTime;
+		boost::asio::streambuf buffer;
+		std::string sendData;
+		std::shared_ptr<Socket> socket;
+		// Whether the socket is a connection borrowed from the pool which has already been used before.
+		bool reused{false};
+		bool retried{false};
+		// Cancels the racing connect which is in progress (see connectingAttempts).
+		socket::ConnectCanceler cancelConnect;
+		bool connected{false};
+	};
+
+	using AttemptPtr = std::shared_ptr<Attempt>;
+
 	// We must keep track of some variables during the async handler chain.
 	struct AsyncState
 	{
 		AsyncState(ServiceClient<Service> & client,
 			       CallHandler && handler,
-		           std::shared_ptr<std::string> && sendData,
+		           std::shared_ptr<internal::ServiceMessage> && messageData,
+		           std::vector<Target> && targets,
 		           time::Duration && timeout,
 		           time::TimePoint && startTime)
 			: handler(std::move(handler))
-			  , sendData(std::move(sendData))
+			  , messageData(std::move(messageData))
+			  , targets(std::move(targets))
 			  , timeout(std::move(timeout))
 			  , startTime(std::move(startTime))
-			  , buffer(client.maxMessageSize + Frame::HEADER_SIZE)
 			  , finishedNotifier(client.operationManager)
 		{}
 
 		CallHandler handler;
-		std::shared_ptr<std::string> sendData;
+		std::shared_ptr<internal::ServiceMessage> messageData;
+		std::vector<Target> targets;
 		time::Duration timeout;
 		time::TimePoint startTime;
-		boost::asio::streambuf buffer;
 		AsyncOperationManager<PendingOperationQueue>::FinishedOperationNotifier finishedNotifier;
+		std::mutex mutex;
+		std::size_t numStartedAttempts{0};
+		std::size_t numRunningAttempts{0};
+		bool finished{false};
+		std::shared_ptr<Timer> hedgingTimer;
 	};
 
+	using StatePtr = std::shared_ptr<AsyncState>;
+
 	asionet::Context & context;
-	Socket socket;
 	std::size_t maxMessageSize;
+	std::shared_ptr<ConnectionPool> pool;
+	utils::Monitor<std::vector<std::shared_ptr<Socket>>> currentSockets;
+	// Attempts whose connect can't be canceled by closing their socket.
+	utils::Monitor<std::vector<AttemptPtr>> connectingAttempts;
+	std::mutex latencyMutex;
+	std::deque<time::Duration> latencies;
+	double hedgingPercentile{0.95};
+	time::Duration initialHedgingDelay{std::chrono::milliseconds(100)};
+	std::atomic<time::Duration> connectAttemptDelay{time::Duration::zero()};
 	AsyncOperationManager<PendingOperationQueue> operationManager;
 
-	void asyncCallOperation(std::shared_ptr<std::string> & sendData,
-		                    std::string & host,
-	                        std::uint16_t & port,
-		                    time::Duration & timeout,
-		                    CallHandler & handler)
+	Target makeTarget(const std::string & host, std::uint16_t port) const
 	{
-		// Container for our variables which are needed for the subsequent asynchronous calls to connect, receive and send.
-		// When 'state' goes out of scope, it does cleanup.
-		auto state = std::make_shared<AsyncState>(
-			*this, std::move(handler), std::move(sendData), std::move(timeout), std::move(time::now()));
+		time::Duration attemptDelay = connectAttemptDelay;
+		return Target{
+			ConnectionPool::makeKey(host, port),
+			[host, port, attemptDelay](Socket & socket, const time::Duration & timeout, socket::ConnectHandler handler)
+			{
+				if (attemptDelay > time::Duration::zero())
+					return asionet::socket::asyncConnectRacing(socket, host, port, timeout, attemptDelay, std::move(handler));
 
-		newSocket();
+				asionet::socket::asyncConnect(socket, host, port, timeout, std::move(handler));
+				return asionet::socket::ConnectCanceler{};
+			}};
+	}
 
-		// keep reference due to std::move()
-		auto & timeoutRef = state->timeout;
+	static Target makeTarget(const EndpointIterator & endpointIterator)
+	{
+		std::string poolKey;
+		if (endpointIterator != EndpointIterator{})
+			poolKey = ConnectionPool::makeKey(endpointIterator->endpoint());
 
-		// Connect to server.
-		asionet::socket::asyncConnect(
-			socket, host, port, timeoutRef,
-			[this, state = std::move(state)](const auto & error) mutable
-			{ this->connectHandler(state, error); });
+		return Target{
+			poolKey,
+			[endpointIterator](Socket & socket, const time::Duration & timeout, socket::ConnectHandler handler)
+			{
+				asionet::socket::asyncConnect(socket, endpointIterator, timeout, std::move(handler));
+				return asionet::socket::ConnectCanceler{};
+			}};
+	}
+
+	void startCall(const RequestMessage & request, std::vector<Target> targets, time::Duration timeout, CallHandler & handler)
+	{
+		auto messageData = encode(request, handler);
+		if (!messageData)
+			return;
+
+		auto asyncOperation = [this](auto && ... args)
+		{ this->asyncCallOperation(std::forward<decltype(args)>(args)...); };
+		operationManager.startOperation(asyncOperation, messageData, targets, timeout, handler);
 	}
 
-	void asyncCallOperation(std::shared_ptr<std::string> & sendData,
-	                        EndpointIterator & endpointIterator,
+	void asyncCallOperation(std::shared_ptr<internal::ServiceMessage> & messageData,
+	                        std::vector<Target> & targets,
 	                        time::Duration & timeout,
 	                        CallHandler & handler)
 	{
+		// Container for our variables which are needed for the subsequent asynchronous calls to connect, receive and send.
+		// When 'state' goes out of scope, it does cleanup.
 		auto state = std::make_shared<AsyncState>(
-			*this, std::move(handler), std::move(sendData), std::move(timeout), std::move(time::now()));
+			*this, std::move(handler), std::move(messageData), std::move(targets), std::move(timeout), std::move(time::now()));
 
-		newSocket();
+		if (state->targets.size() > 1)
+			startHedgingTimer(state);
 
-		auto & timeoutRef = state->timeout;
-
-		asionet::socket::asyncConnect(
-			socket, endpointIterator, timeoutRef,
-			[this, state = std::move(state)](const auto & error) mutable
-			{ this->connectHandler(state, error); });
+		startAttempt(state);
 	}
 
 	void cancelOperation()
 	{
-		closeable::Closer<Socket>::close(socket);
+		closeCurrentSockets();
 	}
 
-	void connectHandler(std::shared_ptr<AsyncState> & state, const error::Error & error)
+	void closeCurrentSockets()
+	{
+		currentSockets([](auto & sockets)
+		               {
+			               for (auto & socket : sockets)
+				               closeable::Closer<Socket>::close(*socket);
+		               });
+
+		// The cancelers are called outside of the monitor since they may call the connect handlers right away.
+		std::vector<socket::ConnectCanceler> cancelers;
+		connectingAttempts([&](auto & attempts)
+		                   {
+			                   for (auto & attempt : attempts)
+				                   cancelers.push_back(attempt->cancelConnect);
+		                   });
+		for (auto & cancelConnect : cancelers)
+			cancelConnect();
+	}
+
+	void startHedgingTimer(const StatePtr & state)
+	{
+		auto timer = std::make_shared<Timer>(context);
+		{
+			std::lock_guard<std::mutex> lock{state->mutex};
+			state->hedgingTimer = timer;
+		}
+
+		// The timer's handler keeps the timer alive since the call may complete and drop it while the handler is pending.
+		std::weak_ptr<AsyncState> weakState = state;
+		timer->startTimeout(
+			hedgingDelay(),
+			[this, weakState, timer]
+			{
+				auto state = weakState.lock();
+				if (state && !operationManager.isCanceled())
+					this->startAttempt(state);
+			});
+	}
+
+	void startAttempt(const StatePtr & state)
+	{
+		AttemptPtr attempt;
+		{
+			std::lock_guard<std::mutex> lock{state->mutex};
+			if (state->finished || state->numStartedAttempts == state->targets.size())
+				return;
+
+			auto timeout = state->timeout - (time::now() - state->startTime);
+			attempt = std::make_shared<Attempt>(*this, state->targets[state->numStartedAttempts], timeout);
+			state->numStartedAttempts++;
+			state->numRunningAttempts++;
+		}
+
+		acquireSocket(state, attempt);
+	}
+
+	void acquireSocket(const StatePtr & state, const AttemptPtr & attempt)
+	{
+		if (!pool)
+		{
+			setSocket(attempt, std::make_shared<Socket>(context));
+			connect(state, attempt);
+			return;
+		}
+
+		pool->asyncAcquire(
+			attempt->target.poolKey,
+			[this, state, attempt](const auto & socket, bool reused)
+			{
+				attempt->reused = reused;
+				this->setSocket(attempt, socket);
+
+				if (this->isDone(state))
+				{
+					this->finishAttempt(state, attempt, error::aborted);
+					return;
+				}
+
+				this->updateTimeout(attempt->timeout, attempt->startTime);
+
+				if (reused)
+				{
+					this->sendRequest(state, attempt);
+					return;
+				}
+
+				this->connect(state, attempt);
+			});
+	}
+
+	void connect(const StatePtr & state, const AttemptPtr & attempt)
+	{
+		// Connect to server.
+		auto cancelConnect = attempt->target.connector(
+			*attempt->socket, attempt->timeout,
+			[this, state, attempt](const auto & error)
+			{
+				connectingAttempts([&](auto & attempts)
+				                   {
+					                   attempt->connected = true;
+					                   attempts.erase(std::remove(attempts.begin(), attempts.end(), attempt), attempts.end());
+				                   });
+				this->connectHandler(state, attempt, error);
+			});
+
+		if (!cancelConnect)
+			return;
+
+		connectingAttempts([&](auto & attempts)
+		                   {
+			                   if (attempt->connected)
+				                   return;
+			                   attempt->cancelConnect = cancelConnect;
+			                   attempts.push_back(attempt);
+		                   });
+
+		// The call may have been canceled before the attempt could be registered.
+		if (operationManager.isCanceled())
+			cancelConnect();
+	}
+
+	void connectHandler(const StatePtr & state, const AttemptPtr & attempt, const error::Error & error)
 	{
 		if (error)
 		{
-			ResponseMessage noResponse;
-			socket.close();
-			state->finishedNotifier.notify();
-			state->handler(error, noResponse);
+			finishAttempt(state, attempt, error);
 			return;
 		}
 
-		this->updateTimeout(state->timeout, state->startTime);
+		this->updateTimeout(attempt->timeout, attempt->startTime);
+		sendRequest(state, attempt);
+	}
 
-		auto & sendDataRef = state->sendData;
-		auto & timeoutRef = state->timeout;
+	void sendRequest(const StatePtr & state, const AttemptPtr & attempt)
+	{
+		// Tell the server how long we're still waiting so that it doesn't bother with the request once we've given up.
+		internal::ServiceHeader header;
+		internal::describeService<Service>(header);
+		header.setTimeout(attempt->timeout);
+		internal::writeServiceMessage(header, *state->messageData, attempt->sendData);
 
 		// Send the request.
-		asionet::stream::asyncWrite(
-			socket, *sendDataRef, timeoutRef,
-			[this, state = std::move(state)](const auto & error) mutable
-			{ this->writeHandler(state, error); });
+		asionet::stream::asyncWrite<Framing>(
+			*attempt->socket, attempt->sendData, attempt->timeout,
+			[this, state, attempt](const auto & error)
+			{ this->writeHandler(state, attempt, error); });
 	}
 
-	void writeHandler(std::shared_ptr<AsyncState> & state, const error::Error & error)
+	void writeHandler(const StatePtr & state, const AttemptPtr & attempt, const error::Error & error)
 	{
 		if (error)
 		{
-			ResponseMessage noResponse;
-			socket.close();
-			state->finishedNotifier.notify();
-			state->handler(error, noResponse);
+			if (!retry(state, attempt, error))
+				finishAttempt(state, attempt, error);
 			return;
 		}
 
-		this->updateTimeout(state->timeout, state->startTime);
-
-		auto & bufferRef = state->buffer;
-		auto & timeoutRef = state->timeout;
+		this->updateTimeout(attempt->timeout, attempt->startTime);
 
 		// Receive the response.
-		asionet::message::asyncReceive<ResponseMessage>(
-			socket, bufferRef, timeoutRef,
-			[this, state = std::move(state)](auto const & error, auto & response)
+		asionet::stream::asyncRead<Framing>(
+			*attempt->socket, attempt->buffer, attempt->timeout,
+			[this, state, attempt](auto const & readError, const auto & data)
 			{
-				socket.close();
-				state->finishedNotifier.notify();
-				state->handler(error, response);
+				ResponseMessage response;
+				auto error = readError;
+				if (!error)
+				{
+					internal::ServiceHeader header;
+					error = internal::decodeServiceMessage<Compression>(data, maxMessageSize, header, response);
+					// The server is going to close the connection so there's no point in reusing it.
+					if (header.isClosing())
+						closeable::Closer<Socket>::close(*attempt->socket);
+				}
+
+				if (error && this->retry(state, attempt, error))
+					return;
+
+				this->finishAttempt(state, attempt, error, response);
 			});
 	}
 
+	// A pooled connection may have been closed by the server while it was idle, which we only notice when using it.
+	// In this case, we try once again with another connection.
+	bool retry(const StatePtr & state, const AttemptPtr & attempt, const error::Error & error)
+	{
+		if (!attempt->reused || attempt->retried || error != error::failedOperation || isDone(state))
+			return false;
+
+		attempt->retried = true;
+		releaseSocket(attempt, false);
+		acquireSocket(state, attempt);
+		return true;
+	}
+
+	bool isDone(const StatePtr & state)
+	{
+		if (operationManager.isCanceled())
+			return true;
+
+		std::lock_guard<std::mutex> lock{state->mutex};
+		return state->finished;
+	}
+
+	void finishAttempt(const StatePtr & state, const AttemptPtr & attempt, const error::Error & error)
+	{
+		ResponseMessage noResponse;
+		finishAttempt(state, attempt, error, noResponse);
+	}
+
+	void finishAttempt(const StatePtr & state, const AttemptPtr & attempt, const error::Error & error, ResponseMessage & response)
+	{
+		releaseSocket(attempt, !error);
+
+		bool startBackup = false;
+		std::shared_ptr<Timer> hedgingTimer;
+		{
+			std::lock_guard<std::mutex> lock{state->mutex};
+			if (state->finished)
+				return;
+
+			state->numRunningAttempts--;
+
+			// A failed request of a hedged call leaves the decision to the other one. If the backup request hasn't
+			// been sent yet, there's no point in waiting for the hedging delay anymore.
+			if (error)
+			{
+				startBackup = state->numStartedAttempts < state->targets.size() && !operationManager.isCanceled();
+				if (!startBackup && state->numRunningAttempts > 0)
+					return;
+			}
+
+			state->finished = !startBackup;
+			hedgingTimer = state->hedgingTimer;
+		}
+
+		if (hedgingTimer)
+			hedgingTimer->cancel();
+
+		if (startBackup)
+		{
+			startAttempt(state);
+			return;
+		}
+
+		if (!error)
+		{
+			recordLatency(time::now() - attempt->beginTime);
+			// Cancel the other request of a hedged call.
+			closeCurrentSockets();
+		}
+
+		state->finishedNotifier.notify();
+		state->handler(error, response);
+	}
+
+	void releaseSocket(const AttemptPtr & attempt, bool reusable)
+	{
+		if (!attempt->socket)
+			return;
+
+		if (!pool || !reusable)
+			closeable::Closer<Socket>::close(*attempt->socket);
+
+		currentSockets([&](auto & sockets)
+		               { sockets.erase(std::remove(sockets.begin(), sockets.end(), attempt->socket), sockets.end()); });
+
+		if (pool)
+			pool->release(attempt->target.poolKey, std::move(attempt->socket));
+
+		attempt->socket = nullptr;
+	}
+
+	void setSocket(const AttemptPtr & attempt, const std::shared_ptr<Socket> & socket)
+	{
+		attempt->socket = socket;
+		currentSockets([&](auto & sockets) { sockets.push_back(socket); });
+	}
+
+	void recordLatency(time::Duration latency)
+	{
+		std::lock_guard<std::mutex> lock{latencyMutex};
+		latencies.push_back(latency);
+		if (latencies.size() > LATENCY_WINDOW_SIZE)
+			latencies.pop_front();
+	}
+
+	time::Duration hedgingDelay()
+	{
+		std::lock_guard<std::mutex> lock{latencyMutex};
+		if (latencies.size() < MIN_LATENCY_SAMPLES)
+			return initialHedgingDelay;
+
+		std::vector<time::Duration> sortedLatencies{latencies.begin(), latencies.end()};
+		auto index = (std::size_t) (hedgingPercentile * (sortedLatencies.size() - 1));
+		index = std::min(index, sortedLatencies.size() - 1);
+		std::nth_element(sortedLatencies.begin(), sortedLatencies.begin() + index, sortedLatencies.end());
+		return sortedLatencies[index];
+	}
+
 	static void updateTimeout(time::Duration & timeout, time::TimePoint & startTime)
 	{
 		auto nowTime = time::now();
@@ -223,10 +681,11 @@ private:
 		timeout -= timeSpend;
 	}
 
-	std::shared_ptr<std::string> encode(const RequestMessage & request, CallHandler & handler)
+	std::shared_ptr<internal::ServiceMessage> encode(const RequestMessage & request, CallHandler & handler)
 	{
-		auto sendData = std::make_shared<std::string>();
-		if (!message::internal::encode(request, *sendData))
+		// The header depends on the remaining time of each attempt, so it is added right before sending.
+		auto messageData = std::make_shared<internal::ServiceMessage>();
+		if (!internal::encodeServiceMessage<Compression>(request, *messageData))
 		{
 			context.post(
 				[handler]
@@ -236,12 +695,7 @@ private:
 				});
 			return nullptr;
 		}
-		return sendData;
-	}
-
-	void newSocket()
-	{
-		socket = Socket(context);
+		return messageData;
 	}
 };
 
@@ -0,0 +1,346 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 Philipp Badenhoop
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef ASIONET_SERVICEHEADER_H
+#define ASIONET_SERVICEHEADER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <utility>
+#include "Message.h"
+#include "Compression.h"
+#include "Utils.h"
+#include "Error.h"
+#include "Time.h"
+
+namespace asionet
+{
+namespace internal
+{
+
+/**
+ * Header which precedes the encoded message inside the frame of each service request and response.
+ *
+ * Layout (big endian):
+ *      1 byte  flags (including the priority of a request in two bits)
+ *      4 bytes request id
+ *      2 bytes service id (only if the SERVICE flag is set)
+ *      4 bytes timeout in milliseconds (only if the TIMEOUT flag is set)
+ *
+ * The request id is chosen by the client and echoed by the server so that responses can be matched to their requests
+ * on connections which carry multiple requests at the same time.
+ * The timeout is the time the client is still going to wait for the response when sending the request. It is relative
+ * since the clocks of client and server are not necessarily synchronized.
+ * The service id tells a ServiceRouter which of the services behind its port the request is addressed to.
+ * Whether the message behind the header is compressed is flagged for each request and response on its own since only
+ * messages which are large enough are compressed.
+ */
+class ServiceHeader
+{
+public:
+	using Flags = std::uint8_t;
+	using RequestId = std::uint32_t;
+	using ServiceId = std::uint16_t;
+
+	static constexpr std::size_t MIN_SIZE = 5;
+	static constexpr std::size_t MAX_SIZE = 11;
+
+	// The client may send further requests over the same connection before receiving the response.
+	static constexpr Flags MULTIPLEXED = 0x01;
+	// The server closes the connection after this response.
+	static constexpr Flags CLOSING = 0x02;
+	// The request carries the time the client is going to wait for its response.
+	static constexpr Flags TIMEOUT = 0x04;
+	// The server rejected the request because it is too busy. The response carries no message.
+	static constexpr Flags OVERLOADED = 0x08;
+	// The request carries the id of the service it is addressed to.
+	static constexpr Flags SERVICE = 0x10;
+	// Two bits which hold the priority of the request. The higher, the more urgent.
+	static constexpr Flags PRIORITY = 0x60;
+	// The message is compressed by the compression policy of the service.
+	static constexpr Flags COMPRESSED = 0x80;
+	static constexpr Flags KNOWN_FLAGS = MULTIPLEXED | CLOSING | TIMEOUT | OVERLOADED | SERVICE | PRIORITY | COMPRESSED;
+
+	static constexpr std::size_t NUM_PRIORITIES = 4;
+
+	ServiceHeader() = default;
+
+	ServiceHeader(Flags flags, RequestId requestId)
+		: flags(flags), requestId(requestId)
+	{}
+
+	Flags getFlags() const
+	{ return flags; }
+
+	RequestId getRequestId() const
+	{ return requestId; }
+
+	bool isMultiplexed() const
+	{ return (flags & MULTIPLEXED) != 0; }
+
+	bool isClosing() const
+	{ return (flags & CLOSING) != 0; }
+
+	bool isOverloaded() const
+	{ return (flags & OVERLOADED) != 0; }
+
+	bool hasTimeout() const
+	{ return (flags & TIMEOUT) != 0; }
+
+	bool hasServiceId() const
+	{ return (flags & SERVICE) != 0; }
+
+	bool isCompressed() const
+	{ return (flags & COMPRESSED) != 0; }
+
+	void setCompressed(bool compressed)
+	{ flags = (Flags) (compressed ? flags | COMPRESSED : flags & ~COMPRESSED); }
+
+	ServiceId getServiceId() const
+	{ return serviceId; }
+
+	void setServiceId(ServiceId serviceId)
+	{
+		flags |= SERVICE;
+		this->serviceId = serviceId;
+	}
+
+	std::uint8_t getPriority() const
+	{ return (std::uint8_t) ((flags & PRIORITY) >> PRIORITY_SHIFT); }
+
+	// Priorities beyond the highest one are lowered to it.
+	void setPriority(std::uint8_t priority)
+	{
+		auto clampedPriority = std::min<std::size_t>(priority, NUM_PRIORITIES - 1);
+		flags = (Flags) ((flags & ~PRIORITY) | (clampedPriority << PRIORITY_SHIFT));
+	}
+
+	time::Duration getTimeout() const
+	{ return std::chrono::milliseconds(timeout); }
+
+	// Timeouts are rounded up to whole milliseconds. Those which do not fit into the header are not transmitted at all.
+	void setTimeout(time::Duration timeout)
+	{
+		using Milliseconds = std::chrono::milliseconds;
+		auto milliseconds = std::chrono::duration_cast<Milliseconds>(timeout + Milliseconds{1} - time::Duration{1}).count();
+		if (milliseconds > std::numeric_limits<std::uint32_t>::max())
+		{
+			flags &= ~TIMEOUT;
+			return;
+		}
+
+		flags |= TIMEOUT;
+		this->timeout = milliseconds > 0 ? (std::uint32_t) milliseconds : 0;
+	}
+
+	std::size_t size() const
+	{ return timeoutOffset() + (hasTimeout() ? sizeof(timeout) : 0); }
+
+	void writeTo(std::string & data) const
+	{
+		std::uint8_t bytes[MAX_SIZE];
+		bytes[0] = flags;
+		utils::toBigEndian<4>(bytes + 1, requestId);
+		if (hasServiceId())
+			utils::toBigEndian<2>(bytes + MIN_SIZE, serviceId);
+		if (hasTimeout())
+			utils::toBigEndian<4>(bytes + timeoutOffset(), timeout);
+		data.append((const char *) bytes, size());
+	}
+
+	// Returns the number of header bytes or 0 if the buffer does not start with a valid header.
+	template<typename ConstBuffer>
+	std::size_t readFrom(const ConstBuffer & buffer)
+	{
+		if (buffer.size() < MIN_SIZE)
+			return 0;
+
+		flags = (std::uint8_t) buffer[0];
+		if ((flags & ~KNOWN_FLAGS) != 0 || buffer.size() < size())
+			return 0;
+
+		std::uint8_t bytes[MAX_SIZE];
+		for (std::size_t i = 0; i < size(); ++i)
+			bytes[i] = (std::uint8_t) buffer[i];
+
+		requestId = utils::fromBigEndian<4, RequestId>(bytes + 1);
+		serviceId = hasServiceId() ? utils::fromBigEndian<2, ServiceId>(bytes + MIN_SIZE) : 0;
+		timeout = hasTimeout() ? utils::fromBigEndian<4, std::uint32_t>(bytes + timeoutOffset()) : 0;
+		return size();
+	}
+
+private:
+	static constexpr std::size_t PRIORITY_SHIFT = 5;
+
+	Flags flags{0};
+	RequestId requestId{0};
+	ServiceId serviceId{0};
+	// In milliseconds.
+	std::uint32_t timeout{0};
+
+	std::size_t timeoutOffset() const
+	{ return MIN_SIZE + (hasServiceId() ? sizeof(serviceId) : 0); }
+};
+
+/**
+ * Services which are hosted by a ServiceRouter declare their id as 'static constexpr std::uint16_t ID = ...;'.
+ * Clients of such services then address each request to it.
+ */
+template<typename Service, typename = void>
+struct ServiceIdOf
+{
+	static constexpr bool routed = false;
+	static constexpr ServiceHeader::ServiceId value = 0;
+};
+
+template<typename Service>
+struct ServiceIdOf<Service, decltype((void) Service::ID)>
+{
+	static constexpr bool routed = true;
+	static constexpr ServiceHeader::ServiceId value = Service::ID;
+};
+
+/**
+ * Services whose requests should be handled before others (e.g. health checks) declare their priority as
+ * 'static constexpr std::uint8_t PRIORITY = ...;' from 0 (the default) to ServiceHeader::NUM_PRIORITIES - 1.
+ */
+template<typename Service, typename = void>
+struct ServicePriorityOf
+{
+	static constexpr std::uint8_t value = 0;
+};
+
+template<typename Service>
+struct ServicePriorityOf<Service, decltype((void) Service::PRIORITY)>
+{
+	static constexpr std::uint8_t value = Service::PRIORITY;
+};
+
+/**
+ * Services which frame their messages differently than framing::Default declare the policy as
+ * 'using Framing = ...;'. Clients and servers of the service pick it up at compile time.
+ */
+template<typename Service, typename = void>
+struct FramingOf
+{
+	using type = framing::Default;
+};
+
+template<typename Service>
+struct FramingOf<Service, decltype((void) std::declval<typename Service::Framing>())>
+{
+	using type = typename Service::Framing;
+};
+
+/**
+ * Services whose messages should be compressed declare the policy as 'using Compression = ...;'.
+ * Only the messages which the policy considers large enough are compressed, which the header of each of them tells.
+ */
+template<typename Service, typename = void>
+struct CompressionOf
+{
+	using type = compression::Default;
+};
+
+template<typename Service>
+struct CompressionOf<Service, decltype((void) std::declval<typename Service::Compression>())>
+{
+	using type = typename Service::Compression;
+};
+
+// Puts what the service declares about itself into the header of its requests.
+template<typename Service>
+void describeService(ServiceHeader & header)
+{
+	if (ServiceIdOf<Service>::routed)
+		header.setServiceId(ServiceIdOf<Service>::value);
+	header.setPriority(ServicePriorityOf<Service>::value);
+}
+
+// An encoded message which may be sent several times (e.g. when retrying or caching), so it's compressed only once.
+struct ServiceMessage
+{
+	std::string data;
+	bool compressed{false};
+};
+
+template<typename Compression = compression::Default, typename Message>
+bool encodeServiceMessage(const Message & message, ServiceMessage & serviceMessage)
+{
+	return message::internal::encodeAndCompress<Compression>(message, serviceMessage.data, serviceMessage.compressed);
+}
+
+// Builds the data of a service frame from the header and the already encoded message.
+inline void writeServiceMessage(ServiceHeader header, const ServiceMessage & message, std::string & data)
+{
+	header.setCompressed(message.compressed);
+	data.clear();
+	data.reserve(header.size() + message.data.size());
+	header.writeTo(data);
+	data.append(message.data);
+}
+
+template<typename Compression = compression::Default, typename Message>
+bool encodeServiceMessage(const ServiceHeader & header, const Message & message, std::string & data)
+{
+	ServiceMessage serviceMessage;
+	if (!encodeServiceMessage<Compression>(message, serviceMessage))
+		return false;
+
+	writeServiceMessage(header, serviceMessage, data);
+	return true;
+}
+
+// Messages whose decoding depends on the header (e.g. the requests of a ServiceRouter) overload this.
+template<typename Message>
+void prepareDecoding(const ServiceHeader &, Message &)
+{}
+
+// Compressed messages which would exceed maxMessageSize bytes are rejected without decompressing them.
+template<typename Compression = compression::Default, typename Message, typename ConstBuffer>
+error::Error decodeServiceMessage(const ConstBuffer & buffer,
+                                  std::size_t maxMessageSize,
+                                  ServiceHeader & header,
+                                  Message & message)
+{
+	auto numHeaderBytes = header.readFrom(buffer);
+	if (numHeaderBytes == 0)
+		return error::invalidFrame;
+
+	if (header.isOverloaded())
+		return error::overloaded;
+
+	prepareDecoding(header, message);
+	if (!message::internal::decompressAndDecode<Compression>(
+		buffer.subBuffer(numHeaderBytes), header.isCompressed(), maxMessageSize, message))
+		return error::decoding;
+
+	return error::success;
+}
+
+}
+}
+
+#endif //ASIONET_SERVICEHEADER_H
@@ -0,0 +1,528 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 Philipp Badenhoop
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef ASIONET_SERVICEROUTER_H
+#define ASIONET_SERVICEROUTER_H
+
+#include <array>
+#include <functional>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include "ServiceServer.h"
+#include "ConstBuffer.h"
+
+namespace asionet
+{
+namespace internal
+{
+
+// The services of a router sorted by their ids so that a service is found by binary search.
+template<std::size_t NUM_SERVICES>
+struct ServiceTable
+{
+	ServiceHeader::ServiceId ids[NUM_SERVICES];
+	// The position of each service among those of the router.
+	std::size_t indexes[NUM_SERVICES];
+
+	// Returns NUM_SERVICES if there's no service with that id.
+	std::size_t find(ServiceHeader::ServiceId id) const
+	{
+		std::size_t first = 0;
+		std::size_t last = NUM_SERVICES;
+		while (first < last)
+		{
+			auto middle = first + (last - first) / 2;
+			if (ids[middle] < id)
+				first = middle + 1;
+			else
+				last = middle;
+		}
+		return first < NUM_SERVICES && ids[first] == id ? indexes[first] : NUM_SERVICES;
+	}
+};
+
+template<typename... Services>
+constexpr ServiceTable<sizeof...(Services)> makeServiceTable()
+{
+	ServiceTable<sizeof...(Services)> table{{ServiceIdOf<Services>::value...}, {}};
+	for (std::size_t i = 0; i < sizeof...(Services); i++)
+		table.indexes[i] = i;
+
+	for (std::size_t i = 1; i < sizeof...(Services); i++)
+	{
+		for (auto j = i; j > 0 && table.ids[j - 1] > table.ids[j]; j--)
+		{
+			auto id = table.ids[j];
+			table.ids[j] = table.ids[j - 1];
+			table.ids[j - 1] = id;
+			auto index = table.indexes[j];
+			table.indexes[j] = table.indexes[j - 1];
+			table.indexes[j - 1] = index;
+		}
+	}
+	return table;
+}
+
+// Holds at most one of the messages at a time, so that only the message which is in use gets constructed.
+template<typename... Messages>
+class MessageVariant
+{
+public:
+	static constexpr std::size_t NUM_MESSAGES = sizeof...(Messages);
+
+	template<std::size_t Index>
+	using MessageAt = typename std::tuple_element<Index, std::tuple<Messages...>>::type;
+
+	MessageVariant() = default;
+
+	MessageVariant(const MessageVariant & other)
+	{
+		copyFrom(other);
+	}
+
+	MessageVariant(MessageVariant && other)
+	{
+		moveFrom(other);
+	}
+
+	MessageVariant & operator=(const MessageVariant & other)
+	{
+		if (this != &other)
+		{
+			reset();
+			copyFrom(other);
+		}
+		return *this;
+	}
+
+	MessageVariant & operator=(MessageVariant && other)
+	{
+		if (this != &other)
+		{
+			reset();
+			moveFrom(other);
+		}
+		return *this;
+	}
+
+	~MessageVariant()
+	{
+		reset();
+	}
+
+	// Returns NUM_MESSAGES if there's no message.
+	std::size_t getIndex() const
+	{
+		return index;
+	}
+
+	// Replaces the current message by a default-constructed one.
+	template<std::size_t Index>
+	MessageAt<Index> & emplace()
+	{
+		reset();
+		auto message = new(&storage) MessageAt<Index>();
+		index = Index;
+		return *message;
+	}
+
+	// The variant has to hold the message at 'Index'.
+	template<std::size_t Index>
+	MessageAt<Index> & get()
+	{
+		return *reinterpret_cast<MessageAt<Index> *>(&storage);
+	}
+
+	template<std::size_t Index>
+	const MessageAt<Index> & get() const
+	{
+		return *reinterpret_cast<const MessageAt<Index> *>(&storage);
+	}
+
+	void reset()
+	{
+		if (index < NUM_MESSAGES)
+			destroy(std::index_sequence_for<Messages...>{});
+		index = NUM_MESSAGES;
+	}
+
+private:
+	using Storage = typename std::aligned_union<0, Messages...>::type;
+
+	std::size_t index{NUM_MESSAGES};
+	Storage storage;
+
+	void copyFrom(const MessageVariant & other)
+	{
+		if (other.index < NUM_MESSAGES)
+			copy(other, std::index_sequence_for<Messages...>{});
+		index = other.index;
+	}
+
+	void moveFrom(MessageVariant & other)
+	{
+		if (other.index < NUM_MESSAGES)
+			move(other, std::index_sequence_for<Messages...>{});
+		index = other.index;
+	}
+
+	template<std::size_t... Indexes>
+	void copy(const MessageVariant & other, std::index_sequence<Indexes...>)
+	{
+		using Copy = void (*)(const MessageVariant & from, MessageVariant & to);
+		static constexpr std::array<Copy, NUM_MESSAGES> copyTable{{&copyMessageAt<Indexes>...}};
+		copyTable[other.index](other, *this);
+	}
+
+	template<std::size_t... Indexes>
+	void move(MessageVariant & other, std::index_sequence<Indexes...>)
+	{
+		using Move = void (*)(MessageVariant & from, MessageVariant & to);
+		static constexpr std::array<Move, NUM_MESSAGES> moveTable{{&moveMessageAt<Indexes>...}};
+		moveTable[other.index](other, *this);
+	}
+
+	template<std::size_t... Indexes>
+	void destroy(std::index_sequence<Indexes...>)
+	{
+		using Destroy = void (*)(MessageVariant & variant);
+		static constexpr std::array<Destroy, NUM_MESSAGES> destroyTable{{&destroyMessageAt<Indexes>...}};
+		destroyTable[index](*this);
+	}
+
+	template<std::size_t Index>
+	static void copyMessageAt(const MessageVariant & from, MessageVariant & to)
+	{
+		new(&to.storage) MessageAt<Index>(from.template get<Index>());
+	}
+
+	template<std::size_t Index>
+	static void moveMessageAt(MessageVariant & from, MessageVariant & to)
+	{
+		new(&to.storage) MessageAt<Index>(std::move(from.template get<Index>()));
+	}
+
+	template<std::size_t Index>
+	static void destroyMessageAt(MessageVariant & variant)
+	{
+		using Message = MessageAt<Index>;
+		variant.template get<Index>().~Message();
+	}
+};
+
+// A request to a router. Only the message of the service it's addressed to is constructed and decoded.
+template<typename... Services>
+struct RoutedRequest
+{
+	static constexpr std::size_t NUM_SERVICES = sizeof...(Services);
+
+	// The position of the addressed service among those of the router. It is NUM_SERVICES if the router does not host
+	// that service or the message could not be decoded.
+	std::size_t index{NUM_SERVICES};
+	MessageVariant<typename Services::RequestMessage...> message;
+
+	template<typename ConstBuffer>
+	void decode(const ConstBuffer & buffer)
+	{
+		if (index < NUM_SERVICES && !decodeMessage(buffer, std::index_sequence_for<Services...>{}))
+		{
+			index = NUM_SERVICES;
+			message.reset();
+		}
+	}
+
+private:
+	template<typename ConstBuffer, std::size_t... Indexes>
+	bool decodeMessage(const ConstBuffer & buffer, std::index_sequence<Indexes...>)
+	{
+		using Decode = bool (*)(const ConstBuffer & buffer, RoutedRequest & request);
+		static constexpr std::array<Decode, NUM_SERVICES> decodeTable{{&decodeMessageAt<Indexes, ConstBuffer>...}};
+		return decodeTable[index](buffer, *this);
+	}
+
+	template<std::size_t Index, typename ConstBuffer>
+	static bool decodeMessageAt(const ConstBuffer & buffer, RoutedRequest & request)
+	{
+		return asionet::message::internal::decode(buffer, request.message.template emplace<Index>());
+	}
+};
+
+template<typename... Services>
+void prepareDecoding(const ServiceHeader & header, RoutedRequest<Services...> & request)
+{
+	static constexpr auto serviceTable = makeServiceTable<Services...>();
+	request.index = serviceTable.find(header.getServiceId());
+}
+
+// The response of a router which holds the message of the service which has been requested.
+template<typename... Services>
+struct RoutedResponse
+{
+	static constexpr std::size_t NUM_SERVICES = sizeof...(Services);
+
+	MessageVariant<typename Services::ResponseMessage...> message;
+
+	// Encodes nothing if there's no message.
+	void encode(std::string & data) const
+	{
+		if (message.getIndex() < NUM_SERVICES)
+			encodeMessage(data, std::index_sequence_for<Services...>{});
+	}
+
+private:
+	template<std::size_t... Indexes>
+	void encodeMessage(std::string & data, std::index_sequence<Indexes...>) const
+	{
+		using Encode = void (*)(const RoutedResponse & response, std::string & data);
+		static constexpr std::array<Encode, NUM_SERVICES> encodeTable{{&encodeMessageAt<Indexes>...}};
+		encodeTable[message.getIndex()](*this, data);
+	}
+
+	template<std::size_t Index>
+	static void encodeMessageAt(const RoutedResponse & response, std::string & data)
+	{
+		using Message = typename decltype(response.message)::template MessageAt<Index>;
+		asionet::message::Encoder<Message>{}(response.message.template get<Index>(), data);
+	}
+};
+
+// The server behind a router decodes each request right into the message of the service it's addressed to.
+template<typename MessageFraming, typename MessageCompression, typename... Services>
+struct RoutedService
+{
+	using RequestMessage = RoutedRequest<Services...>;
+	using ResponseMessage = RoutedResponse<Services...>;
+	using Framing = MessageFraming;
+	using Compression = MessageCompression;
+};
+
+}
+
+namespace message
+{
+
+template<typename... Services>
+struct Encoder<asionet::internal::RoutedResponse<Services...>>
+{
+	void operator()(const asionet::internal::RoutedResponse<Services...> & response, std::string & data) const
+	{ response.encode(data); }
+};
+
+template<typename... Services>
+struct Decoder<asionet::internal::RoutedRequest<Services...>>
+{
+	template<typename ConstBuffer>
+	void operator()(const ConstBuffer & buffer, asionet::internal::RoutedRequest<Services...> & request) const
+	{ request.decode(buffer); }
+};
+
+}
+
+/**
+ * Hosts several services on a single port so that they share the acceptor, the connections and their buffers.
+ * Each service declares a unique 'static constexpr std::uint16_t ID = ...;' which its clients put into every request.
+ * The router finds the service by a binary search over the ids, which are sorted at compile time, decodes the request
+ * right from the receive buffer of the connection and calls the handler of that service. Requests from clients which
+ * don't address a service at all go to the service with ID 0 (if any), so an existing service can be moved behind a
+ * router without updating its clients.
+ * Requests to unknown services or services without a handler are dropped, as well as those which cannot be decoded.
+ * Since they share the connections, all services have to use the same framing and compression policies.
+ */
+template<typename... Services>
+class ServiceRouter
+{
+public:
+	using Framing = typename internal::FramingOf<
+		typename std::tuple_element<0, std::tuple<Services...>>::type>::type;
+	using Compression = typename internal::CompressionOf<
+		typename std::tuple_element<0, std::tuple<Services...>>::type>::type;
+	using Server = ServiceServer<internal::RoutedService<Framing, Compression, Services...>>;
+	using RequestContext = typename Server::RequestContext;
+	using ServiceId = internal::ServiceHeader::ServiceId;
+
+	template<typename Service>
+	using RequestHandler = std::function<void(const RequestContext & requestContext,
+	                                          typename Service::RequestMessage & requestMessage,
+	                                          typename Service::ResponseMessage & responseMessage)>;
+
+	ServiceRouter(asionet::Context & context,
+	              uint16_t bindingPort,
+	              std::size_t maxMessageSize = 512)
+		: server(context, bindingPort, maxMessageSize)
+	{
+		static_assert(allRouted(), "Each service of a router has to declare its ID.");
+		static_assert(uniqueIds(), "The services of a router must have different IDs.");
+		static_assert(sameFraming(), "The services of a router have to use the same framing policy.");
+		static_assert(sameCompression(), "The services of a router have to use the same compression policy.");
+	}
+
+	// The handlers are handed over to the server when advertising, so they have to be set again before advertising anew.
+	template<typename Service>
+	void setHandler(RequestHandler<Service> handler)
+	{
+		static_assert(indexOf<Service>() < NUM_SERVICES, "The service is not hosted by this router.");
+		std::get<indexOf<Service>()>(handlers) = std::move(handler);
+	}
+
+	void advertise(time::Duration receiveTimeout = std::chrono::seconds(60),
+	               time::Duration sendTimeout = std::chrono::seconds(10))
+	{
+		typename Server::RequestDispatcher dispatcher =
+			[this, handlers = std::move(handlers)](const RequestContext & requestContext,
+			                                       RoutedRequest & request,
+			                                       typename Server::Reply & reply)
+			{
+				RoutedResponse response;
+				if (dispatch(handlers, requestContext, request, response))
+					server.respond(reply, response);
+				else
+					server.dropRequest(reply);
+			};
+		server.startAdvertising(dispatcher, receiveTimeout, sendTimeout);
+	}
+
+	void cancel()
+	{
+		server.cancel();
+	}
+
+	// The server which serves the connections of all services, e.g. for setting its options.
+	Server & getServer()
+	{
+		return server;
+	}
+
+private:
+	using Handlers = std::tuple<RequestHandler<Services>...>;
+	using RoutedRequest = internal::RoutedRequest<Services...>;
+	using RoutedResponse = internal::RoutedResponse<Services...>;
+	// Calls the handler and fills in the response. Returns false if there's nothing to respond.
+	using Dispatch = bool (*)(const Handlers & handlers,
+	                          const RequestContext & requestContext,
+	                          RoutedRequest & request,
+	                          RoutedResponse & response);
+
+	static constexpr std::size_t NUM_SERVICES = sizeof...(Services);
+
+	Server server;
+	Handlers handlers;
+
+	static constexpr std::array<ServiceId, NUM_SERVICES> serviceIds()
+	{
+		return {{internal::ServiceIdOf<Services>::value...}};
+	}
+
+	static constexpr bool allRouted()
+	{
+		constexpr bool routed[] = {true, internal::ServiceIdOf<Services>::routed...};
+		for (auto isRouted : routed)
+		{
+			if (!isRouted)
+				return false;
+		}
+		return true;
+	}
+
+	static constexpr bool sameFraming()
+	{
+		constexpr bool same[] = {true, std::is_same<typename internal::FramingOf<Services>::type, Framing>::value...};
+		for (auto isSame : same)
+		{
+			if (!isSame)
+				return false;
+		}
+		return true;
+	}
+
+	static constexpr bool sameCompression()
+	{
+		constexpr bool same[] = {true, std::is_same<typename internal::CompressionOf<Services>::type, Compression>::value...};
+		for (auto isSame : same)
+		{
+			if (!isSame)
+				return false;
+		}
+		return true;
+	}
+
+	static constexpr bool uniqueIds()
+	{
+		constexpr auto ids = serviceIds();
+		for (std::size_t i = 0; i < NUM_SERVICES; i++)
+		{
+			for (std::size_t j = i + 1; j < NUM_SERVICES; j++)
+			{
+				if (ids[i] == ids[j])
+					return false;
+			}
+		}
+		return true;
+	}
+
+	template<typename Service>
+	static constexpr std::size_t indexOf()
+	{
+		constexpr bool matches[] = {std::is_same<Service, Services>::value..., false};
+		for (std::size_t i = 0; i < NUM_SERVICES; i++)
+		{
+			if (matches[i])
+				return i;
+		}
+		return NUM_SERVICES;
+	}
+
+	template<typename Service>
+	static bool dispatchTo(const Handlers & handlers,
+	                       const RequestContext & requestContext,
+	                       RoutedRequest & request,
+	                       RoutedResponse & response)
+	{
+		constexpr auto index = indexOf<Service>();
+		auto & handler = std::get<index>(handlers);
+		if (!handler)
+			return false;
+
+		handler(requestContext,
+		        request.message.template get<index>(),
+		        response.message.template emplace<index>());
+		return true;
+	}
+
+	static bool dispatch(const Handlers & handlers,
+	                     const RequestContext & requestContext,
+	                     RoutedRequest & request,
+	                     RoutedResponse & response)
+	{
+		static constexpr std::array<Dispatch, NUM_SERVICES> dispatchTable{{&dispatchTo<Services>...}};
+		if (request.index >= NUM_SERVICES)
+			return false;
+
+		return dispatchTable[request.index](handlers, requestContext, request, response);
+	}
+};
+
+}
+
+#endif //ASIONET_SERVICEROUTER_H
@@ -24,12 +24,30 @@
 #ifndef ASIONET_SERVICESERVER_H
 #define ASIONET_SERVICESERVER_H
 
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "LoadShedder.h"
+#include "LruCache.h"
 #include "Message.h"
 #include "Context.h"
+#include "ServiceHeader.h"
+#include "Timer.h"
+#include "TimingWheel.h"
+#include "WriteQueue.h"
 
 namespace asionet
 {
 
+template<typename... Services>
+class ServiceRouter;
+
 /**
  * Note that Service::ResponseMessage has to be default-constructable.
  * @tparam Service
@@ -37,37 +55,141 @@ namespace asionet
 template<typename Service>
 class ServiceServer
 {
+private:
+	struct PendingReply;
+
 public:
 	using RequestMessage = typename Service::RequestMessage;
 	using ResponseMessage = typename Service::ResponseMessage;
 	using Protocol = boost::asio::ip::tcp;
 	using Socket = Protocol::socket;
 	using Acceptor = Protocol::acceptor;
-	using Frame = asionet::internal::Frame;
+	using Framing = typename internal::FramingOf<Service>::type;
+	using Compression = typename internal::CompressionOf<Service>::type;
+	// Each request and response is sent in such a frame, behind an internal::ServiceHeader.
+	using Frame = internal::BasicFrame<Framing>;
 	using Endpoint = Protocol::endpoint;
 	using RequestReceivedHandler = std::function<void(const Endpoint & clientEndpoint,
 	                                                  RequestMessage & requestMessage,
 	                                                  ResponseMessage & response)>;
 
+	struct RequestContext
+	{
+		Endpoint clientEndpoint;
+		// The point in time after which the client isn't waiting for the response anymore.
+		// It is time::TimePoint::max() if the client didn't tell.
+		time::TimePoint deadline;
+		// The point in time at which the request has been received.
+		time::TimePoint receiveTime;
+		// The service the request is addressed to (see ServiceRouter) or 0 if the client didn't tell.
+		internal::ServiceHeader::ServiceId serviceId{0};
+		std::uint8_t priority{0};
+
+		bool isExpired() const
+		{ return time::now() >= deadline; }
+	};
+
+	using ContextRequestHandler = std::function<void(const RequestContext & requestContext,
+	                                                 RequestMessage & requestMessage,
+	                                                 ResponseMessage & response)>;
+
+	/**
+	 * Sends the response to a request of a handler which has been advertised with advertiseDeferredService().
+	 * Copies of a responder refer to the same request and may be invoked from any thread. Only the first response is
+	 * sent. If all copies are gone without a response, the request is dropped.
+	 */
+	class Responder
+	{
+	public:
+		explicit Responder(std::shared_ptr<PendingReply> pendingReply)
+			: pendingReply(std::move(pendingReply))
+		{}
+
+		void respond(const ResponseMessage & response) const
+		{
+			if (pendingReply->responded.exchange(true))
+				return;
+
+			pendingReply->server.respond(pendingReply->reply, response);
+		}
+
+	private:
+		std::shared_ptr<PendingReply> pendingReply;
+	};
+
+	using DeferredRequestHandler = std::function<void(const RequestContext & requestContext,
+	                                                  RequestMessage & requestMessage,
+	                                                  Responder responder)>;
+
 	ServiceServer(asionet::Context & context,
 	              uint16_t bindingPort,
 	              std::size_t maxMessageSize = 512)
 		: context(context)
 		  , bindingPort(bindingPort)
-		  , acceptor(context)
 		  , maxMessageSize(maxMessageSize)
 		  , operationManager(context, [this] { this->cancelOperation(); })
-	{}
+		  , admission(std::make_shared<Admission>())
+	{
+		shards.push_back(std::make_unique<Shard>(context));
+	}
+
+	~ServiceServer()
+	{
+		// Connections which are closed afterwards must not resume accepting. This waits for those which are resuming.
+		{
+			std::lock_guard<std::mutex> lock{admission->serverMutex};
+			admission->serverAlive = false;
+		}
+		cancelOperation();
+		// Nobody would time out the connections of the idle reaper anymore.
+		stopIdleReaper();
+	}
 
 	void advertiseService(RequestReceivedHandler requestReceivedHandler,
 	                      time::Duration receiveTimeout = std::chrono::seconds(60),
 	                      time::Duration sendTimeout = std::chrono::seconds(10))
 	{
-		auto asyncOperation = [this](auto && ... args)
-		{
-			this->advertiseServiceOperation(std::forward<decltype(args)>(args)...);
-		};
-		operationManager.startOperation(asyncOperation, requestReceivedHandler, receiveTimeout, sendTimeout);
+		advertiseServiceWithContext(
+			[requestReceivedHandler](const auto & requestContext, auto & requestMessage, auto & response)
+			{ requestReceivedHandler(requestContext.clientEndpoint, requestMessage, response); },
+			receiveTimeout, sendTimeout);
+	}
+
+	/**
+	 * Like advertiseService() but the handler receives the deadline of the request alongside the client's endpoint.
+	 * Requests whose deadline has already passed are dropped without calling the handler. A handler which takes some
+	 * time may check RequestContext::isExpired() to abort early since nobody is going to receive its response anyway.
+	 */
+	void advertiseServiceWithContext(ContextRequestHandler requestReceivedHandler,
+	                                 time::Duration receiveTimeout = std::chrono::seconds(60),
+	                                 time::Duration sendTimeout = std::chrono::seconds(10))
+	{
+		RequestDispatcher dispatcher =
+			[this, requestReceivedHandler](const auto & requestContext, auto & requestMessage, auto & reply)
+			{
+				ResponseMessage response;
+				requestReceivedHandler(requestContext, requestMessage, response);
+				this->respond(reply, response);
+			};
+		startAdvertising(dispatcher, receiveTimeout, sendTimeout);
+	}
+
+	/**
+	 * Like advertiseServiceWithContext() but instead of filling in the response right away, the handler receives a
+	 * Responder which can be invoked later on (e.g. after calling other services) from any thread.
+	 * Meanwhile, the server keeps on handling other requests.
+	 */
+	void advertiseDeferredService(DeferredRequestHandler requestReceivedHandler,
+	                              time::Duration receiveTimeout = std::chrono::seconds(60),
+	                              time::Duration sendTimeout = std::chrono::seconds(10))
+	{
+		RequestDispatcher dispatcher =
+			[this, requestReceivedHandler](const auto & requestContext, auto & requestMessage, auto & reply)
+			{
+				auto pendingReply = std::make_shared<PendingReply>(*this, std::move(reply));
+				requestReceivedHandler(requestContext, requestMessage, Responder{std::move(pendingReply)});
+			};
+		startAdvertising(dispatcher, receiveTimeout, sendTimeout);
 	}
 
 	void cancel()
@@ -75,11 +197,203 @@ public:
 		operationManager.cancelOperation();
 	}
 
+	/**
+	 * After sending a response, the server keeps the connection open and waits up to idleTimeout for the next request
+	 * of the client. The connection is closed after maxRequestsPerConnection requests have been served.
+	 * Setting maxRequestsPerConnection to 1 closes each connection after its first response.
+	 * Changes only apply to connections which are accepted afterwards.
+	 */
+	void setKeepAlive(time::Duration idleTimeout, std::size_t maxRequestsPerConnection)
+	{
+		this->idleTimeout = idleTimeout;
+		this->maxRequestsPerConnection = maxRequestsPerConnection;
+	}
+
+	/**
+	 * Runs the handler on the threads of computeContext (e.g. a WorkerPool of its own) instead of the threads which
+	 * do the I/O so that expensive handlers do not hold up reading and writing other connections.
+	 * Requests wait in one queue per priority (see internal::ServicePriorityOf) and the most urgent ones are handled
+	 * first. To not starve the others, a queue which has been passed over several times in a row takes its turn.
+	 * If maxQueuedRequests requests of the same priority are already waiting for a free compute thread, further
+	 * requests of that priority are answered with error::overloaded right away.
+	 * Must be called before advertising the service.
+	 */
+	void setComputeOffload(asionet::Context & computeContext, std::size_t maxQueuedRequests)
+	{
+		this->computeContext = &computeContext;
+		this->maxQueuedRequests = maxQueuedRequests;
+	}
+
+	/**
+	 * Limits the number of connections which are open at the same time. Once the limit is reached, the server either
+	 * stops accepting until one of them is closed (leaving further connections to the backlog of the kernel) or, if
+	 * rejectExcessConnections is set, keeps accepting but answers each excess connection with a rejection which fails
+	 * the client's call with error::overloaded.
+	 */
+	void setMaxConnections(std::size_t maxConnections, bool rejectExcessConnections = false)
+	{
+		{
+			std::lock_guard<std::mutex> lock{admission->mutex};
+			admission->maxConnections = maxConnections;
+			admission->rejectExcessConnections = rejectExcessConnections;
+		}
+		resumeAccepting();
+	}
+
+	/**
+	 * Sheds requests once they have to wait too long before their handler runs, e.g. because the compute threads or
+	 * the threads doing the I/O cannot keep up. If the waiting time hasn't dropped below 'target' at least once
+	 * during 'interval', requests are answered with error::overloaded at an increasing rate until it does (CoDel).
+	 * This keeps the latency of the remaining requests bounded instead of making every request slower.
+	 * Each priority is tracked on its own since urgent requests hardly wait and would hide the waiting times of others.
+	 * Must be called before advertising the service.
+	 */
+	void setLoadShedding(time::Duration target = std::chrono::milliseconds(5),
+	                     time::Duration interval = std::chrono::milliseconds(100))
+	{
+		loadShedders.assign(internal::ServiceHeader::NUM_PRIORITIES, utils::LoadShedder{target, interval});
+	}
+
+	/**
+	 * Lets a single reaper time out all connections which are waiting for a request instead of arming a timer per
+	 * connection, which pays off for servers with lots of idle connections. The reaper checks the connections in
+	 * batches every 'resolution', so they are closed up to one resolution after their receive or idle timeout.
+	 * Must be called before advertising the service.
+	 */
+	void setIdleReaper(time::Duration resolution = std::chrono::seconds(1))
+	{
+		idleReaper = std::make_unique<IdleReaper>(context, resolution);
+	}
+
+	/**
+	 * Caches the encoded responses keyed by the encoded requests so that a repeated request skips decoding, the handler
+	 * and encoding. Cached responses expire after timeToLive and the least recently used ones are evicted once all
+	 * requests and responses in the cache take more than maxBytes. Only use this if the response depends on nothing
+	 * but the request message (e.g. not on the client or the time). Must be called before advertising the service.
+	 */
+	void setResponseCache(std::size_t maxBytes, time::Duration timeToLive)
+	{
+		responseCache = std::make_unique<ResponseCache>(maxBytes, timeToLive);
+	}
+
+	/**
+	 * Lets concurrent requests with the same encoded message share a single call of the handler (singleflight).
+	 * While a request is being handled, identical requests wait for its response instead of calling the handler
+	 * themselves and are answered with the same encoded response. If the request in front is dropped or rejected, so
+	 * are the ones waiting for it. Like with the response cache, the response must depend on nothing but the request
+	 * message. Must be called before advertising the service.
+	 */
+	void setRequestCoalescing(bool enabled = true)
+	{
+		coalescing = enabled;
+	}
+
+	// Number of requests which have been answered with the response of an identical request.
+	std::size_t numCoalescedRequests() const
+	{
+		return coalescedRequests;
+	}
+
+	// Number of requests which have been answered from the response cache.
+	std::size_t numCachedResponses() const
+	{
+		return responseCache ? responseCache->numHits.load() : 0;
+	}
+
+	std::size_t numConnections() const
+	{
+		std::lock_guard<std::mutex> lock{admission->mutex};
+		return admission->numConnections;
+	}
+
+	// Number of connections which have been rejected because of too many open connections.
+	std::size_t numRejectedConnections() const
+	{
+		std::lock_guard<std::mutex> lock{admission->mutex};
+		return admission->numRejectedConnections;
+	}
+
+	// Number of requests which have been shed because they had to wait too long.
+	std::size_t numShedRequests() const
+	{
+		return shedRequests;
+	}
+
+	// Number of connections which have been closed by the idle reaper.
+	std::size_t numReapedConnections() const
+	{
+		return idleReaper ? idleReaper->numReapedConnections.load() : 0;
+	}
+
+	// Number of times an acceptor has been paused because of too many open connections.
+	std::size_t numPausedAccepts() const
+	{
+		std::lock_guard<std::mutex> lock{admission->mutex};
+		return admission->numPausedAccepts;
+	}
+
+#ifdef SO_REUSEPORT
+	/**
+	 * Opens one acceptor per given context instead of a single one. All of them are bound to the same port using
+	 * SO_REUSEPORT so that the kernel spreads incoming connections over them. Each connection is then served by the
+	 * context of the acceptor which accepted it, e.g. a context per thread each run by a Worker.
+	 * Must be called before advertising the service.
+	 */
+	void setShards(const std::vector<std::reference_wrapper<asionet::Context>> & contexts)
+	{
+		shards.clear();
+		for (auto & shardContext : contexts)
+			shards.push_back(std::make_unique<Shard>(shardContext));
+	}
+#endif
+
 private:
+	// The router dispatches to its services on its own.
+	template<typename... Services>
+	friend class ServiceRouter;
+
+	struct ServiceState;
+
+	// Everything which is needed to answer a request.
+	struct Reply
+	{
+		std::shared_ptr<ServiceState> serviceState;
+		internal::ServiceHeader header;
+		// Whether to receive the next request of a non-multiplexing client after answering this one.
+		bool receiveNext;
+		// The encoded request if responses are cached or identical requests are coalesced.
+		std::shared_ptr<const std::string> requestKey;
+		// Whether identical requests wait for the response to this one.
+		bool leading{false};
+	};
+
+	struct PendingReply
+	{
+		PendingReply(ServiceServer<Service> & server, Reply && reply)
+			: server(server)
+			  , reply(std::move(reply))
+		{}
+
+		~PendingReply()
+		{
+			if (!responded)
+				server.dropRequest(reply);
+		}
+
+		ServiceServer<Service> & server;
+		Reply reply;
+		std::atomic<bool> responded{false};
+	};
+
+	// Calls the handler of the service and eventually responds to the request.
+	using RequestDispatcher = std::function<void(const RequestContext & requestContext,
+	                                             RequestMessage & requestMessage,
+	                                             Reply & reply)>;
+
 	struct AcceptState
 	{
 		AcceptState(ServiceServer<Service> & server,
-		            RequestReceivedHandler && requestReceivedHandler,
+		            RequestDispatcher && requestReceivedHandler,
 		            time::Duration && receiveTimeout,
 		            time::Duration && sendTimeout)
 			: requestReceivedHandler(std::move(requestReceivedHandler))
@@ -88,109 +402,848 @@ private:
 			  , finishedNotifier(server.operationManager)
 		{}
 
-		RequestReceivedHandler requestReceivedHandler;
+		RequestDispatcher requestReceivedHandler;
 		time::Duration receiveTimeout;
 		time::Duration sendTimeout;
 		AsyncOperationManager<PendingOperationReplacer>::FinishedOperationNotifier finishedNotifier;
 	};
 
+	// An acceptor together with the context which serves the connections it accepts.
+	struct Shard
+	{
+		explicit Shard(asionet::Context & context)
+			: context(context)
+			  , acceptor(context)
+		{}
+
+		asionet::Context & context;
+		Acceptor acceptor;
+	};
+
+	// Keeps track of the open connections. Since connections may outlive the server, they share it with the server.
+	struct Admission
+	{
+		mutable std::mutex mutex;
+		std::size_t maxConnections{std::numeric_limits<std::size_t>::max()};
+		bool rejectExcessConnections{false};
+		std::size_t numConnections{0};
+		std::size_t numRejectedConnections{0};
+		std::size_t numPausedAccepts{0};
+		// Acceptors which wait for connections to be closed. They refer to the server.
+		std::vector<std::function<void()>> pausedAccepts;
+		// Held while calling back into the server. The server clears 'serverAlive' under it when it is destroyed.
+		std::mutex serverMutex;
+		bool serverAlive{true};
+
+		void resume()
+		{
+			std::lock_guard<std::mutex> serverLock{serverMutex};
+			std::vector<std::function<void()>> resumedAccepts;
+			{
+				std::lock_guard<std::mutex> lock{mutex};
+				if (!serverAlive || (numConnections >= maxConnections && !rejectExcessConnections))
+					return;
+				resumedAccepts.swap(pausedAccepts);
+			}
+
+			for (auto & accept : resumedAccepts)
+				accept();
+		}
+
+		void release()
+		{
+			{
+				std::lock_guard<std::mutex> lock{mutex};
+				numConnections--;
+			}
+			resume();
+		}
+	};
+
+	// Tracks the receive deadlines of all connections in a timing wheel.
+	struct IdleReaper
+	{
+		static constexpr std::size_t NUM_SLOTS = 64;
+
+		IdleReaper(asionet::Context & context, time::Duration resolution)
+			: resolution(resolution)
+			  , wheel(resolution, NUM_SLOTS)
+			  , timer(std::make_shared<Timer>(context))
+		{}
+
+		time::Duration resolution;
+		std::mutex mutex;
+		utils::TimingWheel<std::weak_ptr<ServiceState>> wheel;
+		std::shared_ptr<Timer> timer;
+		bool ticking{false};
+		std::atomic<std::size_t> numReapedConnections{0};
+	};
+
 	struct ServiceState
 	{
 		using Ptr = std::shared_ptr<ServiceState>;
 
-		ServiceState(ServiceServer<Service> & server, const AcceptState & acceptState)
-			: socket(server.context)
-			  , buffer(server.maxMessageSize + internal::Frame::HEADER_SIZE)
+		~ServiceState()
+		{
+			if (admission)
+				admission->release();
+		}
+
+		ServiceState(ServiceServer<Service> & server, const AcceptState & acceptState, asionet::Context & context)
+			: socket(context)
+			  , buffer(server.maxMessageSize + Framing::MAX_HEADER_SIZE + Framing::TRAILER_SIZE
+			           + internal::ServiceHeader::MAX_SIZE)
 			  , requestReceivedHandler(acceptState.requestReceivedHandler)
 			  , receiveTimeout(acceptState.receiveTimeout)
 			  , sendTimeout(acceptState.sendTimeout)
+			  , idleTimeout(server.idleTimeout)
+			  , maxRequests(server.maxRequestsPerConnection)
+			  , writeQueue(socket, sendTimeout)
+			  , idleReaping(server.idleReaper != nullptr)
 		{}
 
 		Socket socket;
 		boost::asio::streambuf buffer;
-		RequestReceivedHandler requestReceivedHandler;
+		RequestDispatcher requestReceivedHandler;
 		time::Duration receiveTimeout;
 		time::Duration sendTimeout;
+		time::Duration idleTimeout;
+		std::size_t maxRequests;
+		std::size_t numRequests{0};
+		// Responses which are sent while another one is being written are sent together once that write completes.
+		stream::WriteQueue<Socket, Framing> writeQueue;
+		std::mutex writeMutex;
+		std::size_t numPendingWrites{0};
+		// Whether to receive the next request as soon as all responses have been sent.
+		bool receiveAfterWriting{false};
+		// Set if the connection counts as open.
+		std::shared_ptr<Admission> admission;
+		// Whether the idle reaper times out receiving instead of a timer.
+		bool idleReaping;
+		// Guards closing the socket by the idle reaper.
+		std::mutex receiveMutex;
+		// The point in time at which the idle reaper closes the connection.
+		time::TimePoint receiveDeadline{time::TimePoint::max()};
+		bool tracked{false};
+	};
+
+	struct Request
+	{
+		internal::ServiceHeader header;
+		RequestMessage message;
+		// Whether this is the last request which is served over its connection.
+		bool last{false};
+		std::shared_ptr<const internal::ServiceMessage> cachedResponse;
+		std::shared_ptr<const std::string> requestKey;
+	};
+
+	struct QueuedRequest
+	{
+		RequestContext requestContext;
+		RequestMessage message;
+		Reply reply;
+	};
+
+	// Requests of the same priority which wait for a compute thread.
+	struct Lane
+	{
+		std::deque<QueuedRequest> requests;
+		// How often the lane has been passed over in favor of a more urgent one since it's been served last.
+		std::size_t numSkipped{0};
+	};
+
+	// How often a lane may be passed over in a row before it's served anyway.
+	static constexpr std::size_t MAX_SKIPPED = 8;
+
+	struct ResponseCache
+	{
+		ResponseCache(std::size_t maxBytes, time::Duration timeToLive)
+			: entries(maxBytes)
+			  , timeToLive(timeToLive)
+		{}
+
+		std::mutex mutex;
+		utils::LruCache<std::string, std::shared_ptr<const internal::ServiceMessage>> entries;
+		time::Duration timeToLive;
+		std::atomic<std::size_t> numHits{0};
 	};
 
 	asionet::Context & context;
 	std::uint16_t bindingPort;
-	Acceptor acceptor;
+	std::vector<std::unique_ptr<Shard>> shards;
 	std::size_t maxMessageSize;
+	time::Duration idleTimeout{std::chrono::seconds(10)};
+	std::size_t maxRequestsPerConnection{1000};
+	asionet::Context * computeContext{nullptr};
+	std::size_t maxQueuedRequests{0};
+	std::array<Lane, internal::ServiceHeader::NUM_PRIORITIES> lanes;
+	std::mutex lanesMutex;
+	// One per priority.
+	std::vector<utils::LoadShedder> loadShedders;
+	std::mutex loadShedderMutex;
+	std::atomic<std::size_t> shedRequests{0};
 	std::atomic<bool> running{false};
 	AsyncOperationManager<PendingOperationReplacer> operationManager;
+	std::shared_ptr<Admission> admission;
+	std::unique_ptr<IdleReaper> idleReaper;
+	std::unique_ptr<ResponseCache> responseCache;
+	bool coalescing{false};
+	// Requests which wait for the response to an identical request, by encoded request.
+	std::unordered_map<std::string, std::vector<Reply>> flights;
+	std::mutex flightsMutex;
+	std::atomic<std::size_t> coalescedRequests{0};
 
-	void advertiseServiceOperation(RequestReceivedHandler & requestReceivedHandler,
+	void startAdvertising(RequestDispatcher & dispatcher, time::Duration & receiveTimeout, time::Duration & sendTimeout)
+	{
+		auto asyncOperation = [this](auto && ... args)
+		{
+			this->advertiseServiceOperation(std::forward<decltype(args)>(args)...);
+		};
+		operationManager.startOperation(asyncOperation, dispatcher, receiveTimeout, sendTimeout);
+	}
+
+	void advertiseServiceOperation(RequestDispatcher & requestReceivedHandler,
 	                               time::Duration & receiveTimeout,
 	                               time::Duration & sendTimeout)
 	{
 		running = true;
 		auto acceptState = std::make_shared<AcceptState>(
 			*this, std::move(requestReceivedHandler), std::move(receiveTimeout), std::move(sendTimeout));
-		accept(acceptState);
+
+		for (auto & shard : shards)
+		{
+			auto shardAcceptState = acceptState;
+			accept(shardAcceptState, *shard);
+		}
 	}
 
-	void accept(std::shared_ptr<AcceptState> & acceptState)
+	void openAcceptor(Shard & shard)
 	{
-		if (!acceptor.is_open())
-			acceptor = Acceptor{context, Protocol::endpoint{Protocol::v4(), bindingPort}};
+		Protocol::endpoint endpoint{Protocol::v4(), bindingPort};
+		if (shards.size() == 1)
+		{
+			shard.acceptor = Acceptor{shard.context, endpoint};
+			return;
+		}
 
-		auto serviceState = std::make_shared<ServiceState>(*this, *acceptState);
+#ifdef SO_REUSEPORT
+		using ReusePort = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+		shard.acceptor.open(endpoint.protocol());
+		shard.acceptor.set_option(Acceptor::reuse_address{true});
+		shard.acceptor.set_option(ReusePort{true});
+		shard.acceptor.bind(endpoint);
+		shard.acceptor.listen();
+#endif
+	}
+
+	void accept(std::shared_ptr<AcceptState> & acceptState, Shard & shard)
+	{
+		if (!shard.acceptor.is_open())
+			openAcceptor(shard);
+
+		auto serviceState = std::make_shared<ServiceState>(*this, *acceptState, shard.context);
 
 		// keep reference due to std::move()
 		auto & socketRef = serviceState->socket;
 
-		acceptor.async_accept(
+		shard.acceptor.async_accept(
 			socketRef,
-			[this, acceptState = std::move(acceptState), serviceState = std::move(serviceState)]
+			[this, acceptState = std::move(acceptState), serviceState = std::move(serviceState), &shard]
 				(const auto & acceptError) mutable
 			{
 				if (!running)
 					return;
 
 				if (!acceptError && !operationManager.isCanceled())
-					this->handleService(serviceState);
+				{
+					if (this->admit(serviceState))
+						this->handleService(serviceState);
+					else
+						this->rejectConnection(serviceState);
+				}
+
+				if (this->pauseAccepting(acceptState, shard))
+					return;
 
 				// The next accept event will be put on the event queue.
-				this->accept(acceptState);
+				this->accept(acceptState, shard);
+			});
+	}
+
+	bool admit(const std::shared_ptr<ServiceState> & serviceState)
+	{
+		std::lock_guard<std::mutex> lock{admission->mutex};
+		// Without rejecting, a few excess connections are admitted if several acceptors accept at the same time.
+		if (admission->numConnections >= admission->maxConnections && admission->rejectExcessConnections)
+		{
+			admission->numRejectedConnections++;
+			return false;
+		}
+
+		admission->numConnections++;
+		serviceState->admission = admission;
+		return true;
+	}
+
+	// Returns true if the acceptor waits for connections to be closed instead of accepting the next one.
+	bool pauseAccepting(std::shared_ptr<AcceptState> & acceptState, Shard & shard)
+	{
+		std::lock_guard<std::mutex> lock{admission->mutex};
+		if (admission->numConnections < admission->maxConnections || admission->rejectExcessConnections)
+			return false;
+
+		admission->numPausedAccepts++;
+		admission->pausedAccepts.push_back(
+			[this, acceptState, &shard]() mutable
+			{
+				if (running)
+					this->accept(acceptState, shard);
 			});
+		return true;
+	}
+
+	void resumeAccepting()
+	{
+		admission->resume();
+	}
+
+	void dropPausedAccepts()
+	{
+		std::vector<std::function<void()>> pausedAccepts;
+		std::lock_guard<std::mutex> lock{admission->mutex};
+		pausedAccepts.swap(admission->pausedAccepts);
 	}
 
-	bool handleService(std::shared_ptr<ServiceState> & serviceState)
+	// Sends a rejection instead of serving the connection.
+	void rejectConnection(std::shared_ptr<ServiceState> & serviceState)
 	{
+		auto sendData = std::make_shared<std::string>();
+		internal::ServiceHeader{internal::ServiceHeader::OVERLOADED | internal::ServiceHeader::CLOSING, 0}
+			.writeTo(*sendData);
+
 		auto & socketRef = serviceState->socket;
-		auto & bufferRef = serviceState->buffer;
+		auto & sendTimeoutRef = serviceState->sendTimeout;
+		asionet::stream::asyncWrite<Framing>(
+			socketRef, *sendData, sendTimeoutRef,
+			[this, serviceState, sendData](const auto & errorCode) mutable
+			{
+				if (errorCode)
+					return;
+
+				boost::system::error_code ignoredError;
+				serviceState->socket.shutdown(Socket::shutdown_send, ignoredError);
+				this->discardUntilClosed(serviceState);
+			});
+	}
+
+	// Closing the connection while there's still unread data would reset it before the client has read our response.
+	// So we wait for the client to close it.
+	void discardUntilClosed(std::shared_ptr<ServiceState> & serviceState)
+	{
+		auto readOperation = [](auto & socket, const auto & buffers, auto && handler)
+		{ socket.async_read_some(buffers, std::forward<decltype(handler)>(handler)); };
+
+		auto & socketRef = serviceState->socket;
+		auto buffers = serviceState->buffer.prepare(std::min<std::size_t>(64, serviceState->buffer.max_size()));
+		closeable::timedAsyncOperation(
+			readOperation, socketRef, serviceState->sendTimeout,
+			[this, serviceState](const auto & errorCode, std::size_t)
+			{
+				auto state = serviceState;
+				if (!errorCode)
+					this->discardUntilClosed(state);
+			},
+			socketRef, buffers);
+	}
+
+	void handleService(std::shared_ptr<ServiceState> & serviceState)
+	{
 		auto & receiveTimeoutRef = serviceState->receiveTimeout;
+		receiveRequest(serviceState, receiveTimeoutRef);
+	}
 
-		asionet::message::asyncReceive<RequestMessage>(
-			socketRef, bufferRef, receiveTimeoutRef,
-			[this, serviceState = std::move(serviceState)](const auto & errorCode, auto & request)
+	void receiveRequest(std::shared_ptr<ServiceState> & serviceState, const time::Duration & timeout)
+	{
+		auto & socketRef = serviceState->socket;
+		auto & bufferRef = serviceState->buffer;
+
+		// The reaper must not close the socket while we're starting to read.
+		auto lockedState = serviceState;
+		std::unique_lock<std::mutex> receiveLock;
+		auto readTimeout = timeout;
+		if (serviceState->idleReaping)
+		{
+			receiveLock = std::unique_lock<std::mutex>{lockedState->receiveMutex};
+			lockedState->receiveDeadline = time::now() + timeout;
+			trackIdleConnection(lockedState);
+			readTimeout = closeable::noTimeout;
+		}
+
+		// A multiplexing client may send several requests back to back which we then receive all at once.
+		asionet::stream::asyncReadFrames<Framing>(
+			socketRef, bufferRef, readTimeout,
+			[this, serviceState = std::move(serviceState)](const auto & errorCode, const auto & frames) mutable
 			{
+				if (serviceState->idleReaping)
+				{
+					std::lock_guard<std::mutex> lock{serviceState->receiveMutex};
+					serviceState->receiveDeadline = time::TimePoint::max();
+				}
+
 				// If a receive has timed out we treat it like we've never
 				// received any message (and therefor we do not call the handler).
+				// This also happens if the client closes an idle connection.
 				if (errorCode)
 					return;
 
-				ResponseMessage response;
-				serviceState->requestReceivedHandler(serviceState->socket.remote_endpoint(), request, response);
+				auto receiveTime = time::now();
+
+				// Decode all requests before receiving the next ones since this invalidates the frames.
+				std::vector<Request> requests;
+				requests.reserve(frames.size());
+				bool lastRequest = false;
+				for (const auto & frame : frames)
+				{
+					Request request;
+					if (this->decodeRequest(frame, request))
+					{
+						lastRequest = true;
+						break;
+					}
+
+					requests.push_back(std::move(request));
+					if (++serviceState->numRequests >= serviceState->maxRequests)
+					{
+						requests.back().last = true;
+						lastRequest = true;
+						break;
+					}
+				}
+
+				if (requests.empty())
+					return;
+
+				// A multiplexing client sends further requests over the same connection without waiting for our
+				// response. So we're already receiving the next request while handling the current one.
+				// Any other client sends its next request after having received the response.
+				auto multiplexed = requests.front().header.isMultiplexed();
+				if (multiplexed)
+				{
+					boost::system::error_code ignoredError;
+					serviceState->socket.set_option(Protocol::no_delay{true}, ignoredError);
+
+					if (!lastRequest)
+					{
+						auto nextServiceState = serviceState;
+						auto & idleTimeoutRef = serviceState->idleTimeout;
+						this->receiveRequest(nextServiceState, idleTimeoutRef);
+					}
+				}
+
+				RequestContext requestContext;
+				requestContext.receiveTime = receiveTime;
+				boost::system::error_code ignoredError;
+				requestContext.clientEndpoint = serviceState->socket.remote_endpoint(ignoredError);
+
+				for (auto & request : requests)
+				{
+					requestContext.deadline = request.header.hasTimeout()
+					                          ? receiveTime + request.header.getTimeout()
+					                          : time::TimePoint::max();
+					requestContext.serviceId = request.header.getServiceId();
+					requestContext.priority = request.header.getPriority();
+
+					// Responses are matched to requests by their id alone.
+					auto requestOnlyFlags = internal::ServiceHeader::TIMEOUT
+					                        | internal::ServiceHeader::SERVICE
+					                        | internal::ServiceHeader::PRIORITY
+					                        | internal::ServiceHeader::COMPRESSED;
+					auto responseFlags = (internal::ServiceHeader::Flags) (request.header.getFlags() & ~requestOnlyFlags);
+					if (request.last)
+						responseFlags |= internal::ServiceHeader::CLOSING;
+
+					Reply reply{serviceState,
+					            internal::ServiceHeader{responseFlags, request.header.getRequestId()},
+					            !multiplexed && !lastRequest,
+					            std::move(request.requestKey)};
+
+					// The client has already given up on this request (e.g. while we were busy with the ones in front).
+					if (requestContext.isExpired())
+					{
+						this->dropRequest(reply);
+						continue;
+					}
+
+					if (request.cachedResponse)
+					{
+						auto sendData = std::make_shared<std::string>();
+						internal::writeServiceMessage(reply.header, *request.cachedResponse, *sendData);
+						this->sendResponse(reply.serviceState, sendData, reply.receiveNext);
+						continue;
+					}
+
+					if (!this->lead(reply))
+						continue;
+
+					if (computeContext)
+					{
+						this->offload(requestContext, request, reply);
+						continue;
+					}
+
+					if (this->shed(requestContext))
+					{
+						this->rejectRequest(reply);
+						continue;
+					}
+
+					serviceState->requestReceivedHandler(requestContext, request.message, reply);
+				}
+			});
+	}
+
+	// Decodes the request unless its response is already cached.
+	template<typename ConstBuffer>
+	error::Error decodeRequest(const ConstBuffer & frame, Request & request)
+	{
+		if (!responseCache && !coalescing)
+			return internal::decodeServiceMessage<Compression>(frame, maxMessageSize, request.header, request.message);
+
+		auto numHeaderBytes = request.header.readFrom(frame);
+		if (numHeaderBytes == 0)
+			return error::invalidFrame;
+
+		// Identical requests to different services of a router must not be mixed up, nor compressed ones with others.
+		auto messageFrame = frame.subBuffer(numHeaderBytes);
+		auto key = std::make_shared<std::string>();
+		key->reserve(sizeof(internal::ServiceHeader::ServiceId) + 1 + messageFrame.size());
+		key->push_back((char) (request.header.getServiceId() >> 8));
+		key->push_back((char) request.header.getServiceId());
+		key->push_back((char) request.header.isCompressed());
+		key->append(messageFrame.begin(), messageFrame.end());
+		if (responseCache)
+		{
+			std::lock_guard<std::mutex> lock{responseCache->mutex};
+			if (auto cachedResponse = responseCache->entries.get(*key))
+			{
+				request.cachedResponse = *cachedResponse;
+				responseCache->numHits++;
+				return error::success;
+			}
+		}
+
+		request.requestKey = std::move(key);
+		return internal::decodeServiceMessage<Compression>(frame, maxMessageSize, request.header, request.message);
+	}
+
+	// Returns false if an identical request is already being handled. The reply then waits for its response.
+	bool lead(Reply & reply)
+	{
+		if (!coalescing)
+			return true;
+
+		std::lock_guard<std::mutex> lock{flightsMutex};
+		auto it = flights.find(*reply.requestKey);
+		if (it != flights.end())
+		{
+			it->second.push_back(std::move(reply));
+			coalescedRequests++;
+			return false;
+		}
+
+		flights.emplace(*reply.requestKey, std::vector<Reply>{});
+		reply.leading = true;
+		return true;
+	}
+
+	// Returns the replies which wait for the response to the given one.
+	std::vector<Reply> takeFollowers(Reply & reply)
+	{
+		if (!reply.leading)
+			return {};
 
-				auto & socketRef = serviceState->socket;
-				auto & sendTimeoutRef = serviceState->sendTimeout;
+		reply.leading = false;
+		std::lock_guard<std::mutex> lock{flightsMutex};
+		auto it = flights.find(*reply.requestKey);
+		auto followers = std::move(it->second);
+		flights.erase(it);
+		return followers;
+	}
+
+	void offload(const RequestContext & requestContext, Request & request, Reply & reply)
+	{
+		bool queued = false;
+		{
+			std::lock_guard<std::mutex> lock{lanesMutex};
+			auto & lane = lanes[requestContext.priority];
+			if (lane.requests.size() < maxQueuedRequests)
+			{
+				lane.requests.push_back(QueuedRequest{requestContext, std::move(request.message), std::move(reply)});
+				queued = true;
+			}
+		}
+
+		if (!queued)
+		{
+			rejectRequest(reply);
+			return;
+		}
+
+		// Each posted handler runs whichever request is due once a compute thread is free.
+		computeContext->post([this] { this->handleNextQueuedRequest(); });
+	}
+
+	void handleNextQueuedRequest()
+	{
+		QueuedRequest queuedRequest;
+		{
+			std::lock_guard<std::mutex> lock{lanesMutex};
+			auto & lane = nextLane();
+			queuedRequest = std::move(lane.requests.front());
+			lane.requests.pop_front();
+		}
+
+		auto & requestContext = queuedRequest.requestContext;
+		auto & reply = queuedRequest.reply;
+
+		// The request may have expired while waiting for a compute thread.
+		if (requestContext.isExpired())
+		{
+			dropRequest(reply);
+			return;
+		}
+
+		if (shed(requestContext))
+		{
+			rejectRequest(reply);
+			return;
+		}
+
+		// Keep the state alive since responding moves it out of the reply.
+		auto serviceState = reply.serviceState;
+		serviceState->requestReceivedHandler(requestContext, queuedRequest.message, reply);
+	}
+
+	// Must be called with the lanes locked and at least one request queued.
+	Lane & nextLane()
+	{
+		// Lanes which have been starving take precedence, the least urgent first.
+		for (auto & lane : lanes)
+		{
+			if (!lane.requests.empty() && lane.numSkipped >= MAX_SKIPPED)
+			{
+				lane.numSkipped = 0;
+				return lane;
+			}
+		}
+
+		auto mostUrgent = std::find_if(lanes.rbegin(), lanes.rend(),
+		                               [](const auto & lane) { return !lane.requests.empty(); });
+		mostUrgent->numSkipped = 0;
+		for (auto it = std::next(mostUrgent); it != lanes.rend(); ++it)
+		{
+			if (!it->requests.empty())
+				it->numSkipped++;
+		}
+		return *mostUrgent;
+	}
+
+	// Returns true if the request has been waiting too long for its handler to run.
+	bool shed(const RequestContext & requestContext)
+	{
+		if (loadShedders.empty())
+			return false;
+
+		auto now = time::now();
+		{
+			std::lock_guard<std::mutex> lock{loadShedderMutex};
+			auto & loadShedder = loadShedders[requestContext.priority];
+			if (!loadShedder.shouldShed(now - requestContext.receiveTime, now))
+				return false;
+		}
+
+		shedRequests++;
+		return true;
+	}
+
+	// Tells the client that we're too busy to handle its request.
+	void rejectRequest(Reply & reply)
+	{
+		for (auto & follower : takeFollowers(reply))
+			rejectRequest(follower);
+
+		auto flags = (internal::ServiceHeader::Flags) (reply.header.getFlags() | internal::ServiceHeader::OVERLOADED);
+		auto sendData = std::make_shared<std::string>();
+		internal::ServiceHeader{flags, reply.header.getRequestId()}.writeTo(*sendData);
+		sendResponse(reply.serviceState, sendData, reply.receiveNext);
+	}
+
+	void respond(Reply & reply, const ResponseMessage & response)
+	{
+		// Compressed once for the cache and all the replies.
+		auto messageData = std::make_shared<internal::ServiceMessage>();
+		if (!internal::encodeServiceMessage<Compression>(response, *messageData))
+		{
+			dropRequest(reply);
+			return;
+		}
 
-				asionet::message::asyncSend(
-					socketRef, response, sendTimeoutRef,
-					[this, serviceState = std::move(serviceState)](const auto & errorCode)
+		if (reply.requestKey && responseCache)
+		{
+			// The cache holds a copy of the key and shares the response.
+			auto cost = reply.requestKey->size() + messageData->data.size();
+			std::lock_guard<std::mutex> lock{responseCache->mutex};
+			responseCache->entries.put(*reply.requestKey, messageData, time::now() + responseCache->timeToLive, cost);
+		}
+
+		for (auto & follower : takeFollowers(reply))
+		{
+			auto followerSendData = std::make_shared<std::string>();
+			internal::writeServiceMessage(follower.header, *messageData, *followerSendData);
+			sendResponse(follower.serviceState, followerSendData, follower.receiveNext);
+		}
+
+		auto sendData = std::make_shared<std::string>();
+		internal::writeServiceMessage(reply.header, *messageData, *sendData);
+		sendResponse(reply.serviceState, sendData, reply.receiveNext);
+	}
+
+	// Continues with the next request without answering this one.
+	void dropRequest(Reply & reply)
+	{
+		for (auto & follower : takeFollowers(reply))
+			dropRequest(follower);
+
+		if (!reply.receiveNext)
+			return;
+
+		auto & idleTimeoutRef = reply.serviceState->idleTimeout;
+		receiveRequest(reply.serviceState, idleTimeoutRef);
+	}
+
+	void sendResponse(std::shared_ptr<ServiceState> & serviceState,
+	                  const std::shared_ptr<std::string> & sendData,
+	                  bool receiveAfterWriting)
+	{
+		{
+			std::lock_guard<std::mutex> lock{serviceState->writeMutex};
+			serviceState->receiveAfterWriting = receiveAfterWriting;
+			serviceState->numPendingWrites++;
+		}
+
+		auto & writeQueueRef = serviceState->writeQueue;
+		writeQueueRef.asyncWrite(
+			sendData,
+			[this, serviceState = serviceState](const auto & errorCode) mutable
+			{
+				// We cannot be sure that the message is going to be received at the other side anyway,
+				// so we don't handle anything sending-wise.
+				bool receiveNext = false;
+				{
+					std::lock_guard<std::mutex> lock{serviceState->writeMutex};
+					if (--serviceState->numPendingWrites == 0)
 					{
-						// We cannot be sure that the message is going to be received at the other side anyway,
-						// so we don't handle anything sending-wise.
-					});
+						receiveNext = serviceState->receiveAfterWriting && !errorCode;
+						serviceState->receiveAfterWriting = false;
+					}
+				}
+
+				if (receiveNext)
+				{
+					auto & idleTimeoutRef = serviceState->idleTimeout;
+					this->receiveRequest(serviceState, idleTimeoutRef);
+				}
 			});
 	}
 
+	// Must be called with the receive mutex of the connection locked.
+	void trackIdleConnection(const std::shared_ptr<ServiceState> & serviceState)
+	{
+		if (serviceState->tracked)
+			return;
+
+		serviceState->tracked = true;
+		std::lock_guard<std::mutex> lock{idleReaper->mutex};
+		idleReaper->wheel.add(serviceState, serviceState->receiveDeadline);
+		if (!idleReaper->ticking)
+			scheduleIdleReaping();
+	}
+
+	// Must be called with the mutex of the reaper locked.
+	void scheduleIdleReaping()
+	{
+		idleReaper->ticking = idleReaper->wheel.size() > 0;
+		if (idleReaper->ticking)
+			idleReaper->timer->startTimeout(idleReaper->resolution, [this] { this->reapIdleConnections(); });
+	}
+
+	void reapIdleConnections()
+	{
+		auto now = time::now();
+		std::vector<std::shared_ptr<ServiceState>> connections;
+		{
+			std::lock_guard<std::mutex> lock{idleReaper->mutex};
+			idleReaper->wheel.advance(
+				now,
+				[&connections](auto & connection)
+				{
+					if (auto serviceState = connection.lock())
+						connections.push_back(std::move(serviceState));
+				});
+		}
+
+		// Connections which are busy or whose deadline lies beyond the wheel are checked again later.
+		std::vector<std::pair<std::weak_ptr<ServiceState>, time::TimePoint>> pending;
+		for (auto & serviceState : connections)
+		{
+			std::lock_guard<std::mutex> lock{serviceState->receiveMutex};
+			if (serviceState->receiveDeadline <= now)
+			{
+				closeable::Closer<Socket>::close(serviceState->socket);
+				idleReaper->numReapedConnections++;
+				continue;
+			}
+
+			pending.emplace_back(serviceState, serviceState->receiveDeadline);
+		}
+
+		std::lock_guard<std::mutex> lock{idleReaper->mutex};
+		for (auto & connection : pending)
+			idleReaper->wheel.add(std::move(connection.first), connection.second);
+		scheduleIdleReaping();
+	}
+
+	void stopIdleReaper()
+	{
+		if (!idleReaper)
+			return;
+
+		std::vector<std::shared_ptr<ServiceState>> connections;
+		{
+			std::lock_guard<std::mutex> lock{idleReaper->mutex};
+			idleReaper->timer->cancel();
+			idleReaper->ticking = false;
+			idleReaper->wheel.drain(
+				[&connections](auto & connection)
+				{
+					if (auto serviceState = connection.lock())
+						connections.push_back(std::move(serviceState));
+				});
+		}
+
+		for (auto & serviceState : connections)
+		{
+			std::lock_guard<std::mutex> lock{serviceState->receiveMutex};
+			closeable::Closer<Socket>::close(serviceState->socket);
+		}
+	}
+
 	void cancelOperation()
 	{
 		running = false;
-		closeable::Closer<Acceptor>::close(acceptor);
+		for (auto & shard : shards)
+			closeable::Closer<Acceptor>::close(shard->acceptor);
+		dropPausedAccepts();
 	}
 };
 
@@ -24,6 +24,9 @@
 #ifndef ASIONET_SOCKET_H
 #define ASIONET_SOCKET_H
 
+#include <algorithm>
+#include <mutex>
+#include <vector>
 #include "Stream.h"
 #include "Resolver.h"
 #include "Frame.h"
@@ -37,53 +40,109 @@ namespace socket
 namespace internal
 {
 
-inline bool numDataBytesFromBuffer(const std::vector<char> & buffer, std::size_t numBytesTransferred, std::size_t & numDataBytes)
+// A datagram has to hold exactly one complete frame.
+template<typename Framing>
+bool frameFromDatagram(const std::vector<char> & buffer,
+                       std::size_t numBytesTransferred,
+                       std::size_t & numHeaderBytes,
+                       std::size_t & numDataBytes)
 {
-    if (numBytesTransferred < 4)
+    auto bytes = (const std::uint8_t *) buffer.data();
+    auto status = Framing::decodeHeader(bytes, numBytesTransferred, numHeaderBytes, numDataBytes);
+    if (status != framing::HeaderStatus::complete)
         return false;
 
-    numDataBytes = utils::fromBigEndian<4, std::uint32_t>((const std::uint8_t *) buffer.data());
-    if (numBytesTransferred < 4 + numDataBytes)
+    if (numBytesTransferred < Framing::TRAILER_SIZE
+        || numDataBytes > numBytesTransferred - Framing::TRAILER_SIZE
+        || numHeaderBytes > numBytesTransferred - Framing::TRAILER_SIZE - numDataBytes)
         return false;
 
-    return true;
+    return Framing::checkTrailer(bytes + numHeaderBytes, numDataBytes, bytes + numHeaderBytes + numDataBytes);
 }
 
 }
 
 using ConnectHandler = std::function<void(const error::Error & error)>;
 
+// Cancels a connect which is still in progress, so that its handler is called with error::aborted.
+using ConnectCanceler = std::function<void()>;
+
 using SendHandler = std::function<void(const error::Error & error)>;
 
 using ReceiveHandler = std::function<void(const error::Error & error,
                                           const asionet::internal::ConstVectorBuffer & buffer,
                                           const boost::asio::ip::udp::endpoint & endpoint)>;
 
-template<typename SocketService>
+template<typename SocketService, typename EndpointIterator>
 void asyncConnect(SocketService & socket,
-                  const std::string & host,
-                  std::uint16_t port,
+                  const EndpointIterator & endpointIterator,
                   const time::Duration & timeout,
                   ConnectHandler handler)
+{
+    auto connectOperation = [](auto && ... args)
+    { boost::asio::async_connect(std::forward<decltype(args)>(args)...); };
+
+    closeable::timedAsyncOperation(
+        connectOperation, socket, timeout,
+        [handler = std::move(handler)](const auto & error, auto iterator)
+        {
+            handler(error);
+        },
+        socket, endpointIterator);
+}
+
+namespace internal
+{
+
+// Resolves the host (unless it's numeric or cached) and passes the endpoints to 'connect' along with the remaining time.
+template<typename SocketService, typename Connect>
+void resolveAndConnect(SocketService & socket,
+                       const std::string & host,
+                       std::uint16_t port,
+                       const time::Duration & timeout,
+                       ConnectHandler handler,
+                       Connect connect)
 {
     auto & context = socket.get_executor().context();
     using namespace asionet::internal;
     using Resolver = CloseableResolver<boost::asio::ip::tcp>;
+    using Cache = ResolverCache<boost::asio::ip::tcp>;
+
+    auto service = std::to_string(port);
+
+    // Skip resolving if the host is already an IP address or if we've resolved it recently.
+    Cache::Results results;
+    boost::system::error_code cachedError;
+    if (Cache::resolveNumeric(host, service, results) || Cache::shared().lookup(host, service, results, cachedError))
+    {
+        if (cachedError)
+        {
+            context.post(
+                [handler = std::move(handler), cachedError]
+                { handler(error::Error{error::codes::failedOperation, cachedError}); });
+            return;
+        }
+
+        connect(socket, results, timeout, std::move(handler));
+        return;
+    }
 
     auto startTime = time::now();
 
     // Resolve host.
     auto resolver = std::make_shared<Resolver>(context);
-    Resolver::Query query{host, std::to_string(port)};
+    Resolver::Query query{host, service};
 
     auto resolveOperation = [&resolver](auto && ... args)
     { resolver->async_resolve(std::forward<decltype(args)>(args)...); };
 
     closeable::timedAsyncOperation(
         resolveOperation, *resolver, timeout,
-        [&socket, host, port, timeout, handler = std::move(handler), resolver, startTime]
+        [&socket, host, service, timeout, handler = std::move(handler), connect, resolver, startTime]
             (const auto & error, const auto & endpointIterator)
         {
+            cacheResolveResult(host, service, error, endpointIterator);
+
             if (error)
             {
                 handler(error);
@@ -94,39 +153,328 @@ void asyncConnect(SocketService & socket,
             auto timeSpend = time::now() - startTime;
             auto newTimeout = timeout - timeSpend;
 
-            auto connectOperation = [](auto && ... args)
-            { boost::asio::async_connect(std::forward<decltype(args)>(args)...); };
-
-            closeable::timedAsyncOperation(
-                connectOperation, socket, newTimeout,
-                [handler](const auto & error, auto iterator)
-                {
-                    handler(error);
-                },
-                socket, endpointIterator);
+            connect(socket, endpointIterator, newTimeout, std::move(handler));
         },
         query);
 }
 
-template<typename SocketService, typename EndpointIterator>
+}
+
+template<typename SocketService>
 void asyncConnect(SocketService & socket,
-                  const EndpointIterator & endpointIterator,
+                  const std::string & host,
+                  std::uint16_t port,
                   const time::Duration & timeout,
                   ConnectHandler handler)
 {
-    auto connectOperation = [](auto && ... args)
-    { boost::asio::async_connect(std::forward<decltype(args)>(args)...); };
+    internal::resolveAndConnect(
+        socket, host, port, timeout, std::move(handler),
+        [](auto & socket, const auto & endpointIterator, const auto & timeout, auto handler)
+        { asyncConnect(socket, endpointIterator, timeout, std::move(handler)); });
+}
+
+namespace internal
+{
+
+template<typename SocketService>
+struct RacingConnectState
+{
+    using Endpoint = typename SocketService::endpoint_type;
+
+    RacingConnectState(SocketService & socket, asionet::Context & context, ConnectHandler && handler)
+        : socket(socket)
+          , context(context)
+          , handler(std::move(handler))
+    {}
+
+    // The caller's socket. The winning attempt's socket is moved into it once all attempts have finished.
+    SocketService & socket;
+    asionet::Context & context;
+    ConnectHandler handler;
+    std::vector<Endpoint> endpoints;
+    // One per started attempt.
+    std::vector<std::shared_ptr<SocketService>> sockets;
+    time::TimePoint deadline;
+    time::Duration attemptDelay;
+    std::shared_ptr<Timer> delayTimer;
+    std::mutex mutex;
+    std::size_t numStarted{0};
+    std::size_t numRunning{0};
+    std::size_t numFailed{0};
+    bool decided{false};
+    bool delivered{false};
+    error::Error lastError{error::failedOperation};
+    error::Error result;
+    std::shared_ptr<SocketService> winner;
+};
+
+// Lets the caller cancel a racing connect, even while the host name is still being resolved.
+struct RacingConnectCancellation
+{
+    std::mutex mutex;
+    bool canceled{false};
+    // Aborts the racing once it has started.
+    std::function<void()> abort;
+
+    void cancel()
+    {
+        std::function<void()> abortRacing;
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            canceled = true;
+            abortRacing = std::move(abort);
+        }
+
+        if (abortRacing)
+            abortRacing();
+    }
+
+    // Returns false if the racing has been canceled before it could start.
+    bool start(std::function<void()> abortRacing)
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        if (canceled)
+            return false;
+
+        abort = std::move(abortRacing);
+        return true;
+    }
+};
+
+// Alternates between the address families while otherwise keeping the order of the endpoints.
+template<typename Endpoint>
+std::vector<Endpoint> interleaveAddressFamilies(const std::vector<Endpoint> & endpoints)
+{
+    if (endpoints.empty())
+        return endpoints;
+
+    std::vector<Endpoint> preferred, others;
+    auto preferV6 = endpoints.front().address().is_v6();
+    for (const auto & endpoint : endpoints)
+        (endpoint.address().is_v6() == preferV6 ? preferred : others).push_back(endpoint);
+
+    std::vector<Endpoint> result;
+    result.reserve(endpoints.size());
+    for (std::size_t i = 0; i < std::max(preferred.size(), others.size()); ++i)
+    {
+        if (i < preferred.size())
+            result.push_back(preferred[i]);
+        if (i < others.size())
+            result.push_back(others[i]);
+    }
+    return result;
+}
+
+// Calls the handler once the racing has been decided and none of the attempts is running anymore.
+template<typename SocketService>
+void deliverRacingConnect(const std::shared_ptr<RacingConnectState<SocketService>> & state)
+{
+    {
+        std::lock_guard<std::mutex> lock{state->mutex};
+        if (!state->decided || state->numRunning > 0 || state->delivered)
+            return;
+        state->delivered = true;
+
+        if (state->winner)
+            state->socket = std::move(*state->winner);
+        state->sockets.clear();
+    }
+
+    state->delayTimer->cancel();
+    state->handler(state->result);
+}
+
+template<typename SocketService>
+void finishRacingConnect(const std::shared_ptr<RacingConnectState<SocketService>> & state,
+                         const error::Error & error,
+                         const std::shared_ptr<SocketService> & winner)
+{
+    {
+        std::lock_guard<std::mutex> lock{state->mutex};
+        if (state->decided)
+            return;
+        state->decided = true;
+        state->result = error;
+        state->winner = winner;
+
+        // Cancel the attempts which are still running. Their handlers are waited for before delivering the result.
+        for (auto & attemptSocket : state->sockets)
+        {
+            if (attemptSocket != winner)
+                closeable::Closer<SocketService>::close(*attemptSocket);
+        }
+    }
+
+    state->delayTimer->cancel();
+    deliverRacingConnect(state);
+}
+
+template<typename SocketService>
+void startRacingConnectAttempt(const std::shared_ptr<RacingConnectState<SocketService>> & state);
+
+// Starts the next attempt if the previous ones neither succeeded nor failed in time.
+template<typename SocketService>
+void scheduleRacingConnectAttempt(const std::shared_ptr<RacingConnectState<SocketService>> & state)
+{
+    // The timer's handler keeps the timer alive since the state drops it as soon as the racing is over.
+    std::weak_ptr<RacingConnectState<SocketService>> weakState = state;
+    auto delayTimer = state->delayTimer;
+    delayTimer->startTimeout(
+        state->attemptDelay,
+        [weakState, delayTimer]
+        {
+            if (auto state = weakState.lock())
+                startRacingConnectAttempt(state);
+        });
+}
+
+template<typename SocketService>
+void startRacingConnectAttempt(const std::shared_ptr<RacingConnectState<SocketService>> & state)
+{
+    std::shared_ptr<SocketService> attemptSocket;
+    typename SocketService::endpoint_type endpoint;
+    time::Duration timeout;
+    bool attemptsLeft;
+    {
+        std::lock_guard<std::mutex> lock{state->mutex};
+        if (state->decided || state->numStarted == state->endpoints.size())
+            return;
+
+        endpoint = state->endpoints[state->numStarted];
+        attemptSocket = std::make_shared<SocketService>(state->context);
+        state->sockets.push_back(attemptSocket);
+        state->numStarted++;
+        state->numRunning++;
+        attemptsLeft = state->numStarted < state->endpoints.size();
+        timeout = state->deadline - time::now();
+    }
+
+    // Each attempt replaces the timer's pending tick. Once the last one has started, nothing is left to schedule.
+    if (attemptsLeft)
+        scheduleRacingConnectAttempt(state);
+    else
+        state->delayTimer->cancel();
+
+    auto connectOperation = [](auto & socket, const auto & endpoint, auto && handler)
+    { socket.async_connect(endpoint, std::forward<decltype(handler)>(handler)); };
 
     closeable::timedAsyncOperation(
-        connectOperation, socket, timeout,
-        [handler = std::move(handler)](const auto & error, auto iterator)
+        connectOperation, *attemptSocket, timeout,
+        [state, attemptSocket](const auto & error)
         {
-            handler(error);
+            bool allFailed;
+            {
+                std::lock_guard<std::mutex> lock{state->mutex};
+                state->numRunning--;
+                if (error && error != error::aborted)
+                {
+                    state->lastError = error;
+                    state->numFailed++;
+                }
+                allFailed = state->numFailed == state->endpoints.size();
+            }
+
+            if (!error)
+                finishRacingConnect(state, error, attemptSocket);
+            // Either we've run out of time or the racing has been decided already.
+            else if (error == error::aborted || allFailed)
+                finishRacingConnect(state, error, std::shared_ptr<SocketService>{});
+            else
+                startRacingConnectAttempt(state);
+
+            // The racing may have been decided by another attempt which waits for this one.
+            deliverRacingConnect(state);
         },
-        socket, endpointIterator);
+        *attemptSocket, endpoint);
+}
+
+template<typename SocketService, typename EndpointIterator>
+void startRacingConnect(SocketService & socket,
+                        const EndpointIterator & endpointIterator,
+                        const time::Duration & timeout,
+                        const time::Duration & attemptDelay,
+                        ConnectHandler handler,
+                        const std::shared_ptr<RacingConnectCancellation> & cancellation)
+{
+    using Iterator = boost::asio::ip::basic_resolver_iterator<typename SocketService::protocol_type>;
+    using State = RacingConnectState<SocketService>;
+    auto & context = socket.get_executor().context();
+
+    auto state = std::make_shared<State>(socket, context, std::move(handler));
+    state->deadline = time::now() + timeout;
+    state->attemptDelay = attemptDelay;
+    state->delayTimer = std::make_shared<Timer>(context);
+
+    std::vector<typename State::Endpoint> endpoints;
+    for (Iterator it = endpointIterator, end; it != end; ++it)
+        endpoints.push_back(it->endpoint());
+    state->endpoints = interleaveAddressFamilies(endpoints);
+
+    if (state->endpoints.empty())
+    {
+        context.post([state] { state->handler(error::failedOperation); });
+        return;
+    }
+
+    std::weak_ptr<State> weakState = state;
+    auto abort = [weakState]
+    {
+        if (auto state = weakState.lock())
+            finishRacingConnect(state, error::aborted, std::shared_ptr<SocketService>{});
+    };
+    if (!cancellation->start(abort))
+    {
+        context.post([state] { state->handler(error::aborted); });
+        return;
+    }
+
+    startRacingConnectAttempt(state);
+}
+
 }
 
-template<typename DatagramSocket>
+/**
+ * Connects to the first endpoint which accepts the connection ("happy eyeballs"). Instead of trying one endpoint after
+ * another, a connection attempt to the next endpoint is started whenever the previous one hasn't finished within
+ * 'attemptDelay', alternating between IPv6 and IPv4 addresses. As soon as one attempt succeeds, the others are
+ * canceled. Failed attempts are followed by the next one right away.
+ * Each attempt uses a socket of its own. The winner is moved into 'socket' after all attempts have finished, so the
+ * handler is called only then. Since 'socket' isn't used for connecting, closing it does not cancel the racing but
+ * calling the returned canceler does.
+ */
+template<typename SocketService, typename EndpointIterator>
+ConnectCanceler asyncConnectRacing(SocketService & socket,
+                                   const EndpointIterator & endpointIterator,
+                                   const time::Duration & timeout,
+                                   const time::Duration & attemptDelay,
+                                   ConnectHandler handler)
+{
+    auto cancellation = std::make_shared<internal::RacingConnectCancellation>();
+    internal::startRacingConnect(socket, endpointIterator, timeout, attemptDelay, std::move(handler), cancellation);
+    return [cancellation] { cancellation->cancel(); };
+}
+
+// A racing which is canceled while the host name is being resolved ends once resolving is done.
+template<typename SocketService>
+ConnectCanceler asyncConnectRacing(SocketService & socket,
+                                   const std::string & host,
+                                   std::uint16_t port,
+                                   const time::Duration & timeout,
+                                   const time::Duration & attemptDelay,
+                                   ConnectHandler handler)
+{
+    auto cancellation = std::make_shared<internal::RacingConnectCancellation>();
+    internal::resolveAndConnect(
+        socket, host, port, timeout, std::move(handler),
+        [attemptDelay, cancellation](auto & socket, const auto & endpointIterator, const auto & timeout, auto handler)
+        {
+            internal::startRacingConnect(
+                socket, endpointIterator, timeout, attemptDelay, std::move(handler), cancellation);
+        });
+    return [cancellation] { cancellation->cancel(); };
+}
+
+template<typename Framing = framing::Default, typename DatagramSocket>
 void asyncSendTo(DatagramSocket & socket,
                  const std::string & sendData,
                  const std::string & ip,
@@ -135,18 +483,25 @@ void asyncSendTo(DatagramSocket & socket,
                  SendHandler handler)
 {
     using Endpoint = boost::asio::ip::udp::endpoint;
-    asyncSendTo(socket, sendData, Endpoint{boost::asio::ip::address::from_string(ip), port}, timeout, handler);
+    asyncSendTo<Framing>(socket, sendData, Endpoint{boost::asio::ip::address::from_string(ip), port}, timeout, handler);
 };
 
-template<typename DatagramSocket, typename Endpoint>
+template<typename Framing = framing::Default, typename DatagramSocket, typename Endpoint>
 void asyncSendTo(DatagramSocket & socket,
                  const std::string & sendData,
                  const Endpoint & endpoint,
                  const time::Duration & timeout,
                  SendHandler handler)
 {
-    using namespace asionet::internal;
+    using Frame = asionet::internal::BasicFrame<Framing>;
     auto frame = std::make_shared<Frame>((const std::uint8_t *) sendData.c_str(), sendData.size());
+    if (!frame->isValid())
+    {
+        socket.get_executor().context().post(
+            [handler] { handler(error::invalidFrame); });
+        return;
+    }
+
     auto && buffers = frame->getBuffers();
 
     auto asyncOperation = [&socket](auto && ... args)
@@ -167,13 +522,12 @@ void asyncSendTo(DatagramSocket & socket,
         buffers, endpoint);
 };
 
-template<typename DatagramSocket>
+template<typename Framing = framing::Default, typename DatagramSocket>
 void asyncReceiveFrom(DatagramSocket & socket,
                       std::vector<char> & buffer,
                       const time::Duration & timeout,
                       ReceiveHandler handler)
 {
-    using asionet::internal::Frame;
     using asionet::internal::ConstVectorBuffer;
     using namespace boost::asio::ip;
     auto senderEndpoint = std::make_shared<udp::endpoint>();
@@ -194,14 +548,14 @@ void asyncReceiveFrom(DatagramSocket & socket,
                 return;
             }
 
-            std::size_t numDataBytes{0};
-            if (!internal::numDataBytesFromBuffer(buffer, numBytesTransferred, numDataBytes))
+            std::size_t numHeaderBytes{0}, numDataBytes{0};
+            if (!internal::frameFromDatagram<Framing>(buffer, numBytesTransferred, numHeaderBytes, numDataBytes))
             {
                 handler(error::invalidFrame, ConstVectorBuffer{buffer, 0, 0}, *senderEndpoint);
                 return;
             }
 
-            handler(error, ConstVectorBuffer{buffer, numDataBytes, Frame::HEADER_SIZE}, *senderEndpoint);
+            handler(error, ConstVectorBuffer{buffer, numDataBytes, numHeaderBytes}, *senderEndpoint);
         },
         boost::asio::buffer(buffer),
         senderEndpointRef);
@@ -41,11 +41,99 @@ namespace stream
 namespace internal
 {
 
-inline std::uint32_t numDataBytesFromBuffer(boost::asio::streambuf & streambuf)
+// Upper bound of the number of bytes asyncReadFrames() reads at once.
+constexpr std::size_t MAX_READ_SIZE = 65536;
+
+using framing::HeaderStatus;
+
+// Checks whether the given bytes start with a complete frame whose trailer (if any) is intact.
+template<typename Framing>
+HeaderStatus decodeFrame(const std::uint8_t * bytes,
+                         std::size_t size,
+                         std::size_t maxFrameSize,
+                         std::size_t & numHeaderBytes,
+                         std::size_t & numDataBytes)
+{
+    auto status = Framing::decodeHeader(bytes, size, numHeaderBytes, numDataBytes);
+    if (status != HeaderStatus::complete)
+        return status;
+
+    if (maxFrameSize < Framing::TRAILER_SIZE
+        || numDataBytes > maxFrameSize - Framing::TRAILER_SIZE
+        || numHeaderBytes > maxFrameSize - Framing::TRAILER_SIZE - numDataBytes)
+        return HeaderStatus::invalid;
+
+    if (size < numHeaderBytes + numDataBytes + Framing::TRAILER_SIZE)
+        return HeaderStatus::incomplete;
+
+    if (!Framing::checkTrailer(bytes + numHeaderBytes, numDataBytes, bytes + numHeaderBytes + numDataBytes))
+        return HeaderStatus::invalid;
+
+    return HeaderStatus::complete;
+}
+
+// Collects all complete frames at the front of the buffer without consuming them.
+// Returns false if the buffer starts with a frame which is invalid or too large to ever fit into the buffer.
+template<typename Framing>
+bool splitFrames(boost::asio::streambuf & buffer,
+                 std::vector<asionet::internal::ConstStreamBuffer> & frames,
+                 std::size_t & numFrameBytes)
 {
-    auto numDataBytesStr = std::string{boost::asio::buffers_begin(streambuf.data()),
-                                       boost::asio::buffers_begin(streambuf.data()) + asionet::internal::Frame::HEADER_SIZE};
-    return utils::fromBigEndian<4, std::uint32_t>((const std::uint8_t *) numDataBytesStr.c_str());
+    auto data = buffer.data();
+    auto bytes = (const std::uint8_t *) data.data();
+    auto size = buffer.size();
+
+    numFrameBytes = 0;
+    while (numFrameBytes < size)
+    {
+        std::size_t numHeaderBytes, numDataBytes;
+        auto status = decodeFrame<Framing>(
+            bytes + numFrameBytes, size - numFrameBytes, buffer.max_size(), numHeaderBytes, numDataBytes);
+        if (status == HeaderStatus::invalid)
+            return false;
+
+        if (status == HeaderStatus::incomplete)
+            break;
+
+        frames.emplace_back(data, numDataBytes, numFrameBytes + numHeaderBytes);
+        numFrameBytes += numHeaderBytes + numDataBytes + Framing::TRAILER_SIZE;
+    }
+
+    return true;
+}
+
+// Checks whether the buffer starts with a complete frame without consuming anything.
+template<typename Framing>
+HeaderStatus frontFrame(boost::asio::streambuf & buffer, std::size_t & numHeaderBytes, std::size_t & numDataBytes)
+{
+    return decodeFrame<Framing>(
+        (const std::uint8_t *) buffer.data().data(), buffer.size(), buffer.max_size(), numHeaderBytes, numDataBytes);
+}
+
+template<typename Framing>
+using Frames = std::vector<std::unique_ptr<asionet::internal::BasicFrame<Framing>>>;
+
+// Frames each of the messages and collects the buffers to write. Returns false if one of them cannot be framed.
+template<typename Framing, typename Messages>
+bool makeFrames(const Messages & messages,
+                Frames<Framing> & frames,
+                std::vector<boost::asio::const_buffer> & buffers,
+                std::size_t & numBytes)
+{
+    frames.reserve(frames.size() + messages.size());
+    buffers.reserve(buffers.size() + 3 * messages.size());
+    for (const auto & message : messages)
+    {
+        frames.push_back(std::make_unique<asionet::internal::BasicFrame<Framing>>(
+            (const std::uint8_t *) message.c_str(), message.size()));
+        if (!frames.back()->isValid())
+            return false;
+
+        auto frameBuffers = frames.back()->getBuffers();
+        buffers.insert(buffers.end(), frameBuffers.begin(), frameBuffers.end());
+        numBytes += frames.back()->getSize();
+    }
+    return true;
 }
 
 }
@@ -54,14 +142,24 @@ using WriteHandler = std::function<void(const error::Error & error)>;
 
 using ReadHandler = std::function<void(const error::Error & error, const asionet::internal::ConstStreamBuffer & data)>;
 
-template<typename SyncWriteStream>
+using FramesHandler = std::function<void(const error::Error & error,
+                                         const std::vector<asionet::internal::ConstStreamBuffer> & frames)>;
+
+template<typename Framing = framing::Default, typename SyncWriteStream>
 void asyncWrite(SyncWriteStream & stream,
                 const std::string & writeData,
                 const time::Duration & timeout,
                 WriteHandler handler)
 {
-    using namespace asionet::internal;
+    using Frame = asionet::internal::BasicFrame<Framing>;
     auto frame = std::make_shared<Frame>((const std::uint8_t *) writeData.c_str(), writeData.size());
+    if (!frame->isValid())
+    {
+        stream.get_executor().context().post(
+            [handler] { handler(error::invalidFrame); });
+        return;
+    }
+
     auto buffers = frame->getBuffers();
 
     auto asyncOperation = [](auto && ... args) { boost::asio::async_write(std::forward<decltype(args)>(args)...); };
@@ -81,81 +179,320 @@ void asyncWrite(SyncWriteStream & stream,
         stream, buffers);
 }
 
-template<typename SyncReadStream>
-void asyncRead(SyncReadStream & stream,
-               boost::asio::streambuf & buffer,
-               const time::Duration & timeout,
-               ReadHandler handler)
+// Writes each of the given messages in its own frame with a single (vectored) write operation.
+template<typename Framing = framing::Default, typename SyncWriteStream>
+void asyncWrite(SyncWriteStream & stream,
+                const std::vector<std::string> & writeData,
+                const time::Duration & timeout,
+                WriteHandler handler)
+{
+    auto frames = std::make_shared<internal::Frames<Framing>>();
+    std::vector<boost::asio::const_buffer> buffers;
+    std::size_t numBytes = 0;
+
+    if (!internal::makeFrames<Framing>(writeData, *frames, buffers, numBytes))
+    {
+        stream.get_executor().context().post(
+            [handler] { handler(error::invalidFrame); });
+        return;
+    }
+
+    auto asyncOperation = [](auto && ... args) { boost::asio::async_write(std::forward<decltype(args)>(args)...); };
+
+    closeable::timedAsyncOperation(
+        asyncOperation, stream, timeout,
+        [handler = std::move(handler), frames = std::move(frames), numBytes](const auto & error, auto numBytesTransferred)
+        {
+            if (numBytesTransferred < numBytes)
+            {
+                handler(error::failedOperation);
+                return;
+            }
+
+            handler(error);
+        },
+        stream, buffers);
+}
+
+/**
+ * Reads as many bytes as are available (but at least one complete frame) into the buffer and calls the handler with
+ * all complete frames at once. This takes a single read for a bunch of small frames which have been sent back to back.
+ * Bytes of an incomplete frame at the end are kept in the buffer for the next call.
+ * Like with asyncRead(), the frames are consumed before the handler is called but their data stays valid until the
+ * next read is started. With a timeout of closeable::noTimeout, the read only ends once the stream is closed.
+ */
+template<typename Framing = framing::Default, typename SyncReadStream>
+void asyncReadFrames(SyncReadStream & stream,
+                     boost::asio::streambuf & buffer,
+                     const time::Duration & timeout,
+                     FramesHandler handler)
 {
-    using asionet::internal::Frame;
     using asionet::internal::ConstStreamBuffer;
     using namespace asionet::stream::internal;
 
     auto startTime = time::now();
 
-    auto asyncOperation = [](auto && ... args) { boost::asio::async_read(std::forward<decltype(args)>(args)...); };
+    auto asyncOperation = [&stream](auto && ... args) { stream.async_read_some(std::forward<decltype(args)>(args)...); };
 
-    // Receive frame header.
     closeable::timedAsyncOperation(
         asyncOperation, stream, timeout,
         [&stream, &buffer, timeout, handler = std::move(handler), startTime]
             (const auto & error, auto numBytesTransferred)
         {
+            buffer.commit(numBytesTransferred);
+
+            std::vector<ConstStreamBuffer> frames;
             if (error)
             {
+                buffer.consume(buffer.size());
+                handler(error, frames);
+                return;
+            }
+
+            std::size_t numFrameBytes;
+            if (!splitFrames<Framing>(buffer, frames, numFrameBytes))
+            {
+                buffer.consume(buffer.size());
+                handler(error::invalidFrame, std::vector<ConstStreamBuffer>{});
+                return;
+            }
+
+            // Wait for the rest of the frame.
+            if (frames.empty())
+            {
+                auto timeSpend = time::now() - startTime;
+                auto remainingTimeout = timeout == closeable::noTimeout ? timeout : timeout - timeSpend;
+                asyncReadFrames<Framing>(stream, buffer, remainingTimeout, handler);
+                return;
+            }
+
+            buffer.consume(numFrameBytes);
+            handler(error, frames);
+        },
+        buffer.prepare(std::min(buffer.max_size() - buffer.size(), MAX_READ_SIZE)));
+}
+
+namespace internal
+{
+
+// Consumes the frame at the front of the buffer and passes its data to the handler.
+// The data stays valid until the next read is started on the buffer.
+template<typename Framing>
+void deliverFrontFrame(boost::asio::streambuf & buffer,
+                       std::size_t numHeaderBytes,
+                       std::size_t numDataBytes,
+                       const ReadHandler & handler)
+{
+    using asionet::internal::ConstStreamBuffer;
+
+    ConstStreamBuffer data{buffer, numDataBytes, numHeaderBytes};
+    buffer.consume(numHeaderBytes + numDataBytes + Framing::TRAILER_SIZE);
+    handler(error::success, data);
+}
+
+// Checks whether the buffer starts with a complete frame. If not, tells how many bytes have to be read at least to
+// complete it without reading any byte of the following frame.
+template<typename Framing>
+HeaderStatus missingFrameBytes(boost::asio::streambuf & buffer,
+                               std::size_t & numHeaderBytes,
+                               std::size_t & numDataBytes,
+                               std::size_t & numMissingBytes)
+{
+    auto bytes = (const std::uint8_t *) buffer.data().data();
+    auto size = buffer.size();
+
+    if (Framing::decodeHeader(bytes, size, numHeaderBytes, numDataBytes) == HeaderStatus::incomplete)
+    {
+        // The shortest header is read at once, the rest of a longer one byte by byte.
+        constexpr auto minHeaderSize = framing::MinHeaderSizeOf<Framing>::value;
+        numMissingBytes = size < minHeaderSize ? minHeaderSize - size : 1;
+        return HeaderStatus::incomplete;
+    }
+
+    auto status = decodeFrame<Framing>(bytes, size, buffer.max_size(), numHeaderBytes, numDataBytes);
+    if (status == HeaderStatus::incomplete)
+        numMissingBytes = numHeaderBytes + numDataBytes + Framing::TRAILER_SIZE - size;
+    return status;
+}
+
+// Reads exactly the missing bytes of the frame at the front of the buffer until it is complete.
+template<typename Framing, typename SyncReadStream>
+void asyncReadExactly(SyncReadStream & stream,
+                      boost::asio::streambuf & buffer,
+                      std::size_t numMissingBytes,
+                      const time::Duration & timeout,
+                      ReadHandler handler)
+{
+    using asionet::internal::ConstStreamBuffer;
+
+    auto startTime = time::now();
+
+    auto asyncOperation = [](auto && ... args) { boost::asio::async_read(std::forward<decltype(args)>(args)...); };
+
+    closeable::timedAsyncOperation(
+        asyncOperation, stream, timeout,
+        [&stream, &buffer, numMissingBytes, timeout, handler = std::move(handler), startTime]
+            (const auto & error, auto numBytesTransferred)
+        {
+            if (error)
+            {
+                buffer.consume(buffer.size());
                 handler(error, ConstStreamBuffer{buffer, 0, 0});
-                buffer.consume(numBytesTransferred);
                 return;
             }
 
-            if (numBytesTransferred != Frame::HEADER_SIZE)
+            if (numBytesTransferred != numMissingBytes)
             {
+                buffer.consume(buffer.size());
                 handler(error::invalidFrame, ConstStreamBuffer{buffer, 0, 0});
-                buffer.consume(numBytesTransferred);
                 return;
             }
 
-            auto numDataBytes = numDataBytesFromBuffer(buffer);
-            if (numDataBytes == 0)
+            std::size_t numHeaderBytes = 0, numDataBytes = 0, numStillMissingBytes = 0;
+            switch (missingFrameBytes<Framing>(buffer, numHeaderBytes, numDataBytes, numStillMissingBytes))
+            {
+                case HeaderStatus::complete:
+                    deliverFrontFrame<Framing>(buffer, numHeaderBytes, numDataBytes, handler);
+                    return;
+                case HeaderStatus::invalid:
+                    buffer.consume(buffer.size());
+                    handler(error::invalidFrame, ConstStreamBuffer{buffer, 0, 0});
+                    return;
+                case HeaderStatus::incomplete:
+                    break;
+            }
+
+            auto timeSpend = time::now() - startTime;
+            auto remainingTimeout = timeout == closeable::noTimeout ? timeout : timeout - timeSpend;
+            asyncReadExactly<Framing>(stream, buffer, numStillMissingBytes, remainingTimeout, handler);
+        },
+        stream, buffer, boost::asio::transfer_exactly(numMissingBytes));
+}
+
+// Reads as many bytes as are available until the buffer holds at least one complete frame.
+template<typename Framing, typename SyncReadStream>
+void asyncReadAvailable(SyncReadStream & stream,
+                        boost::asio::streambuf & buffer,
+                        const time::Duration & timeout,
+                        ReadHandler handler)
+{
+    using asionet::internal::ConstStreamBuffer;
+
+    auto startTime = time::now();
+
+    auto asyncOperation = [&stream](auto && ... args) { stream.async_read_some(std::forward<decltype(args)>(args)...); };
+
+    closeable::timedAsyncOperation(
+        asyncOperation, stream, timeout,
+        [&stream, &buffer, timeout, handler = std::move(handler), startTime]
+            (const auto & error, auto numBytesTransferred)
+        {
+            buffer.commit(numBytesTransferred);
+
+            if (error)
             {
+                buffer.consume(buffer.size());
                 handler(error, ConstStreamBuffer{buffer, 0, 0});
-                buffer.consume(numBytesTransferred);
                 return;
             }
 
+            std::size_t numHeaderBytes = 0, numDataBytes = 0;
+            switch (frontFrame<Framing>(buffer, numHeaderBytes, numDataBytes))
+            {
+                case HeaderStatus::complete:
+                    deliverFrontFrame<Framing>(buffer, numHeaderBytes, numDataBytes, handler);
+                    return;
+                case HeaderStatus::invalid:
+                    buffer.consume(buffer.size());
+                    handler(error::invalidFrame, ConstStreamBuffer{buffer, 0, 0});
+                    return;
+                case HeaderStatus::incomplete:
+                    break;
+            }
+
+            // Wait for the rest of the frame.
             auto timeSpend = time::now() - startTime;
-            auto newTimeout = timeout - timeSpend;
-
-	        auto asyncOperation = [](auto && ... args) { boost::asio::async_read(std::forward<decltype(args)>(args)...); };
-
-            // Receive actual data.
-            // At this point, we DON'T consume the frame's header bytes in the buffer which we're going to do in the following handler.
-            closeable::timedAsyncOperation(
-                asyncOperation, stream, newTimeout,
-                [&buffer, handler = std::move(handler), numDataBytes]
-                    (const auto & error, auto numBytesTransferred)
-                {
-                    if (error)
-                    {
-                        handler(error, ConstStreamBuffer{buffer, 0, 0});
-                        buffer.consume(Frame::HEADER_SIZE + numBytesTransferred);
-                        return;
-                    }
-
-                    if (numBytesTransferred != numDataBytes)
-                    {
-                        handler(error::invalidFrame, ConstStreamBuffer{buffer, 0, 0});
-                        buffer.consume(Frame::HEADER_SIZE + numBytesTransferred);
-                        return;
-                    }
-
-                    handler(error, ConstStreamBuffer{buffer, numDataBytes, Frame::HEADER_SIZE});
-                    buffer.consume(Frame::HEADER_SIZE + numBytesTransferred);
-                },
-                stream, buffer, boost::asio::transfer_exactly(numDataBytes));
+            auto remainingTimeout = timeout == closeable::noTimeout ? timeout : timeout - timeSpend;
+            asyncReadAvailable<Framing>(stream, buffer, remainingTimeout, handler);
         },
-        stream, buffer, boost::asio::transfer_exactly(Frame::HEADER_SIZE));
-};
+        buffer.prepare(std::min(buffer.max_size() - buffer.size(), MAX_READ_SIZE)));
+}
+
+}
+
+/**
+ * Reads a single frame and calls the handler with its data.
+ * Only the bytes of this frame are read from the stream, so the buffer is empty again once the handler is called.
+ * The frame is consumed before the handler is called which allows the handler to start the next read once it is done
+ * with the received data.
+ */
+template<typename Framing = framing::Default, typename SyncReadStream>
+void asyncRead(SyncReadStream & stream,
+               boost::asio::streambuf & buffer,
+               const time::Duration & timeout,
+               ReadHandler handler)
+{
+    using asionet::internal::ConstStreamBuffer;
+    using namespace asionet::stream::internal;
+
+    std::size_t numHeaderBytes = 0, numDataBytes = 0, numMissingBytes = 0;
+    switch (missingFrameBytes<Framing>(buffer, numHeaderBytes, numDataBytes, numMissingBytes))
+    {
+        case HeaderStatus::complete:
+            // Don't call the handler from within this function since it may start the next read right away.
+            stream.get_executor().context().post(
+                [&buffer, numHeaderBytes, numDataBytes, handler = std::move(handler)]
+                { deliverFrontFrame<Framing>(buffer, numHeaderBytes, numDataBytes, handler); });
+            return;
+        case HeaderStatus::invalid:
+            buffer.consume(buffer.size());
+            stream.get_executor().context().post(
+                [&buffer, handler = std::move(handler)]
+                { handler(error::invalidFrame, ConstStreamBuffer{buffer, 0, 0}); });
+            return;
+        case HeaderStatus::incomplete:
+            break;
+    }
+
+    asyncReadExactly<Framing>(stream, buffer, numMissingBytes, timeout, std::move(handler));
+}
+
+/**
+ * Like asyncRead() but instead of reading exactly the bytes of one frame, this reads as many bytes as are available.
+ * So a single read usually takes a whole frame and often some of the following ones too. Those stay in the buffer and
+ * the next call takes them from there without reading from the stream at all. Therefore, the same buffer has to be
+ * passed to each call on a stream and the stream must not be read from in any other way.
+ */
+template<typename Framing = framing::Default, typename SyncReadStream>
+void asyncReadAhead(SyncReadStream & stream,
+                    boost::asio::streambuf & buffer,
+                    const time::Duration & timeout,
+                    ReadHandler handler)
+{
+    using asionet::internal::ConstStreamBuffer;
+    using namespace asionet::stream::internal;
+
+    std::size_t numHeaderBytes = 0, numDataBytes = 0;
+    switch (frontFrame<Framing>(buffer, numHeaderBytes, numDataBytes))
+    {
+        case HeaderStatus::complete:
+            // Don't call the handler from within this function since it may start the next read right away.
+            stream.get_executor().context().post(
+                [&buffer, numHeaderBytes, numDataBytes, handler = std::move(handler)]
+                { deliverFrontFrame<Framing>(buffer, numHeaderBytes, numDataBytes, handler); });
+            return;
+        case HeaderStatus::invalid:
+            buffer.consume(buffer.size());
+            stream.get_executor().context().post(
+                [&buffer, handler = std::move(handler)]
+                { handler(error::invalidFrame, ConstStreamBuffer{buffer, 0, 0}); });
+            return;
+        case HeaderStatus::incomplete:
+            break;
+    }
+
+    asyncReadAvailable<Framing>(stream, buffer, timeout, std::move(handler));
+}
 
 }
 }
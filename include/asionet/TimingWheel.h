@@ -0,0 +1,120 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 Philipp Badenhoop
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef ASIONET_TIMINGWHEEL_H
+#define ASIONET_TIMINGWHEEL_H
+
+#include <algorithm>
+#include <vector>
+#include "Time.h"
+
+namespace asionet
+{
+namespace utils
+{
+
+/**
+ * Coarse timer for a large number of entries. Instead of keeping the entries ordered, each one is put into one of
+ * 'numSlots' slots which together span numSlots * resolution. Advancing the wheel hands out the entries of all slots
+ * which have passed in one go, so entries expire up to one resolution late. Expiries beyond the span of the wheel are
+ * put into its last slot, so entries may also expire too early and have to be added again.
+ * This class is not thread-safe.
+ */
+template<typename Value>
+class TimingWheel
+{
+public:
+	TimingWheel(time::Duration resolution, std::size_t numSlots, time::TimePoint now = time::now())
+		: resolution(resolution)
+		  , slots(numSlots)
+		  , slotTime(now)
+	{}
+
+	void add(Value value, time::TimePoint expiry)
+	{
+		// The current slot has already been handed out.
+		std::size_t numTicks = 1;
+		if (expiry > slotTime + resolution)
+		{
+			auto remaining = expiry - slotTime;
+			auto numFullTicks = remaining / resolution + (remaining % resolution != time::Duration::zero() ? 1 : 0);
+			numTicks = std::min<std::size_t>(numFullTicks, slots.size() - 1);
+		}
+
+		slots[(currentSlot + numTicks) % slots.size()].push_back(std::move(value));
+		numEntries++;
+	}
+
+	// Removes the entries of all slots which have passed until now and calls handler with each of them.
+	template<typename Handler>
+	void advance(time::TimePoint now, Handler handler)
+	{
+		for (std::size_t i = 0; i < slots.size() && slotTime + resolution <= now; i++)
+		{
+			currentSlot = (currentSlot + 1) % slots.size();
+			slotTime += resolution;
+			takeSlot(currentSlot, handler);
+		}
+
+		// We've been away for longer than a whole round, so all slots have passed.
+		if (slotTime + resolution <= now)
+			slotTime = now;
+	}
+
+	// Removes all entries and calls handler with each of them.
+	template<typename Handler>
+	void drain(Handler handler)
+	{
+		for (std::size_t slot = 0; slot < slots.size(); slot++)
+			takeSlot(slot, handler);
+	}
+
+	std::size_t size() const
+	{
+		return numEntries;
+	}
+
+private:
+	time::Duration resolution;
+	std::vector<std::vector<Value>> slots;
+	std::size_t currentSlot{0};
+	// The point in time at which the current slot has been handed out.
+	time::TimePoint slotTime;
+	std::size_t numEntries{0};
+
+	template<typename Handler>
+	void takeSlot(std::size_t slot, Handler & handler)
+	{
+		// The handler may add entries again.
+		std::vector<Value> values;
+		values.swap(slots[slot]);
+		numEntries -= values.size();
+		for (auto & value : values)
+			handler(value);
+	}
+};
+
+}
+}
+
+#endif //ASIONET_TIMINGWHEEL_H
@@ -0,0 +1,201 @@
+/*
+ * The MIT License
+ *
+ * Copyright (c) 2019 Philipp Badenhoop
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef ASIONET_WRITEQUEUE_H
+#define ASIONET_WRITEQUEUE_H
+
+#include <deque>
+#include <mutex>
+#include "Stream.h"
+
+namespace asionet
+{
+namespace stream
+{
+
+/**
+ * Serializes the writes to a stream and coalesces small frames.
+ * While a write is in flight, further frames are queued. Once it completes, the queued frames are written together
+ * with a single (vectored) write, bounded by maxBatchBytes and maxBatchFrames. By default, a batch takes as many frames
+ * as fit into the 64 buffers which boost::asio passes to a single writev call, e.g. 32 frames of framing::Default but
+ * only 21 of framing::Checksummed since each of them has a trailer.
+ * Each handler is called after the write which contains its frame has completed.
+ * The queue and the stream have to outlive the writes which have been started.
+ */
+template<typename SyncWriteStream, typename Framing = framing::Default>
+class WriteQueue
+{
+public:
+	static constexpr std::size_t MAX_BATCH_BUFFERS = 64;
+	static constexpr std::size_t DEFAULT_MAX_BATCH_FRAMES =
+		MAX_BATCH_BUFFERS / asionet::internal::BasicFrame<Framing>::NUM_BUFFERS;
+
+	WriteQueue(SyncWriteStream & stream,
+	           time::Duration timeout,
+	           std::size_t maxBatchBytes = 65536,
+	           std::size_t maxBatchFrames = DEFAULT_MAX_BATCH_FRAMES)
+		: stream(stream)
+		  , timeout(timeout)
+		  , maxBatchBytes(maxBatchBytes)
+		  , maxBatchFrames(maxBatchFrames)
+	{}
+
+	WriteQueue(const WriteQueue &) = delete;
+
+	WriteQueue & operator=(const WriteQueue &) = delete;
+
+	void asyncWrite(std::shared_ptr<const std::string> data, WriteHandler handler)
+	{
+		if (!Frame{(const std::uint8_t *) data->c_str(), data->size()}.isValid())
+		{
+			stream.get_executor().context().post(
+				[handler] { handler(error::invalidFrame); });
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock{mutex};
+			queue.push_back(PendingWrite{std::move(data), std::move(handler)});
+			if (writing)
+				return;
+			writing = true;
+		}
+
+		writeNextBatch();
+	}
+
+	// Returns the number of write operations which have been started so far.
+	std::size_t numBatches() const
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		return batchCounter;
+	}
+
+private:
+	using Frame = asionet::internal::BasicFrame<Framing>;
+
+	struct PendingWrite
+	{
+		std::shared_ptr<const std::string> data;
+		WriteHandler handler;
+	};
+
+	struct Batch
+	{
+		explicit Batch(WriteQueue & queue)
+			: queue(queue)
+		{}
+
+		// If the write never completes because the context is torn down, the queued writes are dropped as well.
+		// Otherwise their handlers would keep whatever they capture alive.
+		~Batch()
+		{
+			if (!completed)
+				queue.dropQueuedWrites();
+		}
+
+		WriteQueue & queue;
+		std::vector<PendingWrite> writes;
+		std::vector<std::unique_ptr<Frame>> frames;
+		std::vector<boost::asio::const_buffer> buffers;
+		std::size_t numBytes{0};
+		bool completed{false};
+	};
+
+	SyncWriteStream & stream;
+	time::Duration timeout;
+	std::size_t maxBatchBytes;
+	std::size_t maxBatchFrames;
+	mutable std::mutex mutex;
+	std::deque<PendingWrite> queue;
+	bool writing{false};
+	std::size_t batchCounter{0};
+
+	void writeNextBatch()
+	{
+		auto batch = std::make_shared<Batch>(*this);
+		{
+			std::lock_guard<std::mutex> lock{mutex};
+			while (!queue.empty() && batch->writes.size() < maxBatchFrames)
+			{
+				// An upper bound, the exact size is known once the frame has been built.
+				auto numFrameBytes = Framing::MAX_HEADER_SIZE + Framing::TRAILER_SIZE + queue.front().data->size();
+				if (!batch->writes.empty() && batch->numBytes + numFrameBytes > maxBatchBytes)
+					break;
+
+				batch->numBytes += numFrameBytes;
+				batch->writes.push_back(std::move(queue.front()));
+				queue.pop_front();
+			}
+
+			if (batch->writes.empty())
+			{
+				writing = false;
+				batch->completed = true;
+				return;
+			}
+			batchCounter++;
+		}
+
+		batch->numBytes = 0;
+		batch->frames.reserve(batch->writes.size());
+		batch->buffers.reserve(3 * batch->writes.size());
+		for (const auto & write : batch->writes)
+		{
+			batch->frames.push_back(std::make_unique<Frame>((const std::uint8_t *) write.data->c_str(), write.data->size()));
+			auto frameBuffers = batch->frames.back()->getBuffers();
+			batch->buffers.insert(batch->buffers.end(), frameBuffers.begin(), frameBuffers.end());
+			batch->numBytes += batch->frames.back()->getSize();
+		}
+
+		auto & buffersRef = batch->buffers;
+
+		auto asyncOperation = [](auto && ... args) { boost::asio::async_write(std::forward<decltype(args)>(args)...); };
+
+		closeable::timedAsyncOperation(
+			asyncOperation, stream, timeout,
+			[this, batch = std::move(batch)](const auto & error, auto numBytesTransferred)
+			{
+				batch->completed = true;
+				auto writeError = numBytesTransferred < batch->numBytes ? error::failedOperation : error;
+				for (const auto & write : batch->writes)
+					write.handler(writeError);
+
+				this->writeNextBatch();
+			},
+			stream, buffersRef);
+	}
+
+	void dropQueuedWrites()
+	{
+		std::deque<PendingWrite> dropped;
+		std::lock_guard<std::mutex> lock{mutex};
+		dropped.swap(queue);
+		writing = false;
+	}
+};
+
+}
+}
+
+#endif //ASIONET_WRITEQUEUE_H
@@ -25,9 +25,13 @@
 #include "TestUtils.h"
 #include <boost/asio/ip/tcp.hpp>
 #include <iostream>
+#include <set>
 #include "../include/asionet/ServiceServer.h"
+#include "../include/asionet/ServiceRouter.h"
 #include "TestService.h"
 #include "../include/asionet/ServiceClient.h"
+#include "../include/asionet/MultiplexedServiceClient.h"
+#include "../include/asionet/LoadBalancedServiceClient.h"
 #include "../include/asionet/DatagramReceiver.h"
 #include "../include/asionet/DatagramSender.h"
 #include "../include/asionet/Worker.h"
@@ -623,6 +627,2090 @@ TEST(asionetTest, LargeTransferSize)
 	runTest1<LargeTransferSize>();
 }
 
+struct PooledServiceClient : std::enable_shared_from_this<PooledServiceClient>
+{
+	std::shared_ptr<ConnectionPool> pool;
+	ServiceServer<TestService> server;
+	ServiceClient<TestService> client;
+	Waiter waiter;
+
+	PooledServiceClient(Context & context)
+		: pool(std::make_shared<ConnectionPool>(context, 1))
+		  , server(context, 10001)
+		  , client(context, pool)
+		  , waiter(context)
+	{}
+
+	void run()
+	{
+		auto self = shared_from_this();
+		constexpr std::size_t numCalls{5};
+		std::atomic<std::size_t> correct{0};
+
+		server.advertiseService(
+			[self](const auto & clientEndpoint, const auto & requestMessage, auto & responseMessage)
+			{ responseMessage = TestMessage::response(requestMessage.getId(), 42); });
+
+		for (std::size_t i = 0; i < numCalls; i++)
+		{
+			Waitable waitable{waiter};
+			client.asyncCall(
+				TestMessage::request(i), "127.0.0.1", 10001, 1s,
+				waitable([&, self, i](const auto & error, auto & response)
+				         {
+					         EXPECT_FALSE(error);
+					         EXPECT_EQ(response.getId(), i);
+					         correct++;
+				         }));
+			waiter.await(waitable);
+		}
+
+		EXPECT_EQ(correct, numCalls);
+		EXPECT_LE(pool->numOpenConnections(ConnectionPool::makeKey("127.0.0.1", 10001)), 1);
+	}
+};
+
+TEST(asionetTest, PooledServiceClient)
+{
+	runTest1<PooledServiceClient>();
+}
+
+struct IdleConnectionExpiry : std::enable_shared_from_this<IdleConnectionExpiry>
+{
+	std::shared_ptr<ConnectionPool> pool;
+	boost::asio::ip::tcp::acceptor acceptor;
+	boost::asio::ip::tcp::socket serverSocket;
+	Waiter waiter;
+
+	IdleConnectionExpiry(Context & context)
+		: pool(std::make_shared<ConnectionPool>(context, 64, 8, 100ms))
+		  , acceptor(context, boost::asio::ip::tcp::endpoint{boost::asio::ip::tcp::v4(), 10001})
+		  , serverSocket(context)
+		  , waiter(context)
+	{}
+
+	void run()
+	{
+		auto self = shared_from_this();
+		auto key = ConnectionPool::makeKey("127.0.0.1", 10001);
+
+		ConnectionPool::SocketPtr socket;
+		Waitable acquired{waiter};
+		pool->asyncAcquire(key, acquired([&socket](const auto & acquiredSocket, bool reused) { socket = acquiredSocket; }));
+		waiter.await(acquired);
+
+		Waitable accepted{waiter}, connected{waiter};
+		acceptor.async_accept(serverSocket, accepted([self](const auto & error) { EXPECT_FALSE(error); }));
+		socket::asyncConnect(*socket, "127.0.0.1", 10001, 1s, connected([self](const auto & error) { EXPECT_FALSE(error); }));
+		waiter.await(accepted && connected);
+
+		pool->release(key, socket);
+		EXPECT_EQ(pool->numIdleConnections(key), 1);
+
+		// Nobody acquires a connection of this key again, yet the idle one is closed.
+		std::this_thread::sleep_for(300ms);
+		EXPECT_FALSE(socket->is_open());
+		EXPECT_EQ(pool->numIdleConnections(key), 0);
+		EXPECT_EQ(pool->numOpenConnections(key), 0);
+	}
+};
+
+TEST(asionetTest, IdleConnectionExpiry)
+{
+	runTest1<IdleConnectionExpiry>();
+}
+
+struct MultiplexedCalls : std::enable_shared_from_this<MultiplexedCalls>
+{
+	ServiceServer<TestService> server;
+	MultiplexedServiceClient<TestService> client;
+	Waiter waiter;
+
+	MultiplexedCalls(Context & context)
+		: server(context, 10001)
+		  , client(context)
+		  , waiter(context)
+	{}
+
+	void run()
+	{
+		auto self = shared_from_this();
+		constexpr std::size_t numCalls{20};
+		std::atomic<std::size_t> numResponses{0};
+		std::atomic<std::size_t> correct{0};
+		std::mutex mutex;
+		std::set<std::uint16_t> clientPorts;
+
+		server.advertiseService(
+			[&, self](const auto & clientEndpoint, const auto & requestMessage, auto & responseMessage)
+			{
+				{
+					std::lock_guard<std::mutex> lock{mutex};
+					clientPorts.insert(clientEndpoint.port());
+				}
+				responseMessage = TestMessage::response(requestMessage.getId(), 42);
+			});
+
+		Waitable waitable{waiter};
+		for (std::size_t i = 0; i < numCalls; i++)
+		{
+			client.asyncCall(
+				TestMessage::request(i), "127.0.0.1", 10001, 1s,
+				[&, self, i](const auto & error, auto & response)
+				{
+					if (!error && response.getId() == i)
+						correct++;
+					if (++numResponses == numCalls)
+						waitable.setReady();
+				});
+		}
+		waiter.await(waitable);
+
+		EXPECT_EQ(correct, numCalls);
+		EXPECT_EQ(clientPorts.size(), 1);
+	}
+};
+
+TEST(asionetTest, MultiplexedCalls)
+{
+	runTest1<MultiplexedCalls>();
+}
+
+struct KeepAlive : std::enable_shared_from_this<KeepAlive>
+{
+	std::shared_ptr<ConnectionPool> pool;
+	ServiceServer<TestService> server;
+	ServiceClient<TestService> client;
+	Waiter waiter;
+
+	KeepAlive(Context & context)
+		: pool(std::make_shared<ConnectionPool>(context))
+		  , server(context, 10001)
+		  , client(context, pool)
+		  , waiter(context)
+	{}
+
+	void run()
+	{
+		auto self = shared_from_this();
+		constexpr std::size_t numCalls{5};
+		constexpr std::size_t maxRequestsPerConnection{2};
+		std::atomic<std::size_t> correct{0};
+		std::mutex mutex;
+		std::set<std::uint16_t> clientPorts;
+
+		server.setKeepAlive(1s, maxRequestsPerConnection);
+		server.advertiseService(
+			[&, self](const auto & clientEndpoint, const auto & requestMessage, auto & responseMessage)
+			{
+				{
+					std::lock_guard<std::mutex> lock{mutex};
+					clientPorts.insert(clientEndpoint.port());
+				}
+				responseMessage = TestMessage::response(requestMessage.getId(), 42);
+			});
+
+		for (std::size_t i = 0; i < numCalls; i++)
+		{
+			Waitable waitable{waiter};
+			client.asyncCall(
+				TestMessage::request(i), "127.0.0.1", 10001, 1s,
+				waitable([&, self, i](const auto & error, auto & response)
+				         {
+					         EXPECT_FALSE(error);
+					         EXPECT_EQ(response.getId(), i);
+					         correct++;
+				         }));
+			waiter.await(waitable);
+		}
+
+		EXPECT_EQ(correct, numCalls);
+		EXPECT_EQ(clientPorts.size(), (numCalls + maxRequestsPerConnection - 1) / maxRequestsPerConnection);
+	}
+};
+
+TEST(asionetTest, KeepAlive)
+{
+	runTest1<KeepAlive>();
+}
+
+struct ResolverCaching : std::enable_shared_from_this<ResolverCaching>
+{
+	using Cache = ResolverCache<boost::asio::ip::tcp>;
+
+	Resolver<boost::asio::ip::tcp> resolver;
+	Waiter waiter;
+
+	ResolverCaching(asionet::Context & context)
+		: resolver(context)
+		  , waiter(context)
+	{}
+
+	void run()
+	{
+		auto self = shared_from_this();
+
+		Cache cache{2};
+		Cache::Results results;
+		boost::system::error_code error;
+		ASSERT_TRUE(Cache::resolveNumeric("127.0.0.1", "80", results));
+		EXPECT_EQ(results.begin()->endpoint().port(), 80);
+		EXPECT_FALSE(Cache::resolveNumeric("localhost", "80", results));
+		EXPECT_FALSE(Cache::resolveNumeric("127.0.0.1", "http", results));
+
+		// The least recently used entry gets evicted.
+		cache.insert("a", "80", results, error);
+		cache.insert("b", "80", results, error);
+		EXPECT_TRUE(cache.lookup("a", "80", results, error));
+		cache.insert("c", "80", results, error);
+		EXPECT_EQ(cache.size(), 2);
+		EXPECT_FALSE(cache.lookup("b", "80", results, error));
+
+		// Unknown hosts are remembered as well.
+		cache.insert("unknown", "80", Cache::Results{}, boost::asio::error::host_not_found);
+		EXPECT_TRUE(cache.lookup("unknown", "80", results, error));
+		EXPECT_EQ(error, boost::asio::error::host_not_found);
+
+		// Temporary and local failures are not.
+		cache.insert("canceled", "80", Cache::Results{}, boost::asio::error::operation_aborted);
+		EXPECT_FALSE(cache.lookup("canceled", "80", results, error));
+		cache.insert("flaky", "80", Cache::Results{}, boost::asio::error::host_not_found_try_again);
+		EXPECT_FALSE(cache.lookup("flaky", "80", results, error));
+		cache.insert("broken", "80", Cache::Results{}, boost::asio::error::no_recovery);
+		EXPECT_FALSE(cache.lookup("broken", "80", results, error));
+
+		Cache::shared().clear();
+		Waitable waitable{waiter};
+		resolver.asyncResolve(
+			"localhost", "80", 5s,
+			waitable([self](const auto & error, const auto & endpointIterator) { EXPECT_FALSE(error); }));
+		waiter.await(waitable);
+
+		error = boost::system::error_code{};
+		EXPECT_TRUE(Cache::shared().lookup("localhost", "80", results, error));
+		EXPECT_FALSE(error);
+	}
+};
+
+TEST(asionetTest, ResolverCaching)
+{
+	runTest1<ResolverCaching>();
+}
+
+struct LoadBalancing : std::enable_shared_from_this<LoadBalancing>
+{
+	ServiceServer<TestService> server1;
+	ServiceServer<TestService> server2;
+	LoadBalancedServiceClient<TestService> client;
+	Waiter waiter;
+
+	LoadBalancing(Context & context)
+		: server1(context, 10001)
+		  , server2(context, 10002)
+		  , client(context)
+		  , waiter(context)
+	{}
+
+	void run()
+	{
+		auto self = shared_from_this();
+		constexpr std::size_t numCalls{30};
+		std::atomic<std::size_t> numCalls1{0};
+		std::atomic<std::size_t> numCalls2{0};
+
+		server1.advertiseService(
+			[&, self](const auto & clientEndpoint, const auto & requestMessage, auto & responseMessage)
+			{
+				numCalls1++;
+				responseMessage = TestMessage::response(requestMessage.getId(), 1);
+			});
+		server2.advertiseService(
+			[&, self](const auto & clientEndpoint, const auto & requestMessage, auto & responseMessage)
+			{
+				numCalls2++;
+				responseMessage = TestMessage::response(requestMessage.getId(), 2);
+			});
+
+		client.addEndpoint("127.0.0.1", 10001);
+		client.addEndpoint("127.0.0.1", 10002);
+		// Nobody is listening there.
+		client.addEndpoint("127.0.0.1", 10003);
+		client.setOutlierEjection(1, 10s);
+
+		auto callAll = [&]
+		{
+			std::atomic<std::size_t> numResponses{0};
+			std::atomic<std::size_t> numFailures{0};
+			Waitable waitable{waiter};
+			for (std::size_t i = 0; i < numCalls; i++)
+			{
+				client.asyncCall(
+					TestMessage::request(i), 1s,
+					[&, self, i](const auto & error, auto & response)
+					{
+						if (error || response.getId() != i)
+							numFailures++;
+						if (++numResponses == numCalls)
+							waitable.setReady();
+					});
+			}
+			waiter.await(waitable);
+			return numFailures.load();
+		};
+
+		// Calls are spread over all endpoints at first.
+		EXPECT_GT(callAll(), 0);
+
+		// Now the unreachable endpoint has been ejected.
+		numCalls1 = 0;
+		numCalls2 = 0;
+		EXPECT_EQ(callAll(), 0);
+		EXPECT_GT(numCalls1, 0);
+		EXPECT_GT(numCalls2, 0);
+		EXPECT_EQ(numCalls1 + numCalls2, numCalls);
+	}
+};
+
+TEST(asionetTest, LoadBalancing)
+{
+	runTest1<LoadBalancing>();
+}
+
+struct FailingEndpoint : std::enable_shared_from_this<FailingEndpoint>
+{
+	ServiceServer<TestService> server;
+	LoadBalancedServiceClient<TestService> client;
+	Waiter waiter;
+
+	FailingEndpoint(Context & context)
+		: server(context, 10001)
+		  , client(context)
+		  , waiter(context)
+	{}
+
+	void run()
+	{
+		auto self = shared_from_this();
+		constexpr std::size_t numCalls{20};
+		std::size_t numFailures{0};
+
+		server.advertiseService(
+			[self](const auto & clientEndpoint, const auto & requestMessage, auto & responseMessage)
+			{
+				std::this_thread::sleep_for(10ms);
+				responseMessage = TestMessage::response(requestMessage.getId(), 42);
+			});
+
+		// Nobody listens on port 10002, so calls to it are refused right away. Keep it from being ejected.
+		client.addEndpoint("127.0.0.1", 10001);
+		client.addEndpoint("127.0.0.1", 10002);
+		client.setOutlierEjection(numCalls, 30s);
+
+		for (std::size_t i = 0; i < numCalls; i++)
+		{
+			Waitable called{waiter};
+			client.asyncCall(
+				TestMessage::request(i), 1s,
+				called([&numFailures](const auto & error, auto & response)
+				       {
+					       if (error)
+						       numFailures++;
+				       }));
+			waiter.await(called);
+		}
+
+		// The refused endpoint is tried at most once before it looks slower than the healthy one.
+		EXPECT_LE(numFailures, 1);
+	}
+};
+
+TEST(asionetTest, FailingEndpoint)
+{
+	runTest1<FailingEndpoint>();
+}
+
+struct HedgedCall : std::enable_shared_from_this<HedgedCall>
+{
+	// Accepts connections but never responds.
+	boost::asio::ip::tcp::acceptor silentServer;
+	ServiceServer<TestService> server;
+	ServiceClient<TestService> client;
+	Waiter waiter;
+
+	HedgedCall(Context & context)
+		: silentServer(context, boost::asio::ip::tcp::endpoint{boost::asio::ip::tcp::v4(), 10001})
+		  , server(context, 10002)
+		  , client(context)
+		  , waiter(context)
+	{}
+
+	void run()
+	{
+		auto self = shared_from_this();
+
+		server.advertiseService(
+			[self](const auto & clientEndpoint, const auto & requestMessage, auto & responseMessage)
+			{
+				responseMessage = TestMessage::response(requestMessage.getId(), 2);
+			});
+
+		client.setHedging(0.95, 50ms);
+
+		// The backup request is sent after the hedging delay and answers first.
+		auto startTime = time::now();
+		Waitable waitable1{waiter};
+		client.asyncCall(
+			TestMessage::request(1), "127.0.0.1", 10001, "127.0.0.1", 10002, 2s,
+			waitable1([self](const auto & error, auto & response)
+			          {
+				          EXPECT_FALSE(error);
+				          EXPECT_EQ(response.getValue(), 2);
+			          }));
+		waiter.await(waitable1);
+		EXPECT_LT(time::now() - startTime, 1s);
+
+		// The backup request is sent right away if the first one fails.
+		startTime = time::now();
+		Waitable waitable2{waiter};
+		client.asyncCall(
+			TestMessage::request(2), "127.0.0.1", 10003, "127.0.0.1", 10002, 2s,
+			waitable2([self](const auto & error, auto & response)
+			          {
+				          EXPECT_FALSE(error);
+				          EXPECT_EQ(response.getValue(), 2);
+			          }));
+		waiter.await(waitable2);
+		EXPECT_LT(time::now() - startTime, 1s);
+	}
+};
+
+TEST(asionetTest, HedgedCall)
+{
+	runTest1<HedgedCall>();
+}
+
+struct FrameDraining : std::enable_shared_from_this<FrameDraining>
+{
+	boost::asio::ip::tcp::acceptor acceptor;
+	boost::asio::ip::tcp::socket serverSocket;
+	boost::asio::ip::tcp::socket clientSocket;
+	boost::asio::streambuf buffer;
+	Waiter waiter;
+
+	FrameDraining(Context & context)
+		: acceptor(context, boost::asio::ip::tcp::endpoint{boost::asio::ip::tcp::v4(), 10001})
+		  , serverSocket(context)
+		  , clientSocket(context)
+		  , buffer(64)
+		  , waiter(context)
+	{}
+
+	void run()
+	{
+		auto self = shared_from_this();
+
+		Waitable accepted{waiter}, connected{waiter};
+		acceptor.async_accept(serverSocket, accepted([self](const auto & error) { EXPECT_FALSE(error); }));
+		socket::asyncConnect(clientSocket, "127.0.0.1", 10001, 1s,
+		                     connected([self](const auto & error) { EXPECT_FALSE(error); }));
+		waiter.await(accepted && connected);
+
+		// All messages are written at once and end up in a single read.
+		std::vector<std::string> messages{"first", "", "third"};
+		Waitable written{waiter};
+		stream::asyncWrite(clientSocket, messages, 1s, written([self](const auto & error) { EXPECT_FALSE(error); }));
+		waiter.await(written);
+
+		Waitable read1{waiter};
+		stream::asyncReadFrames(
+			serverSocket, buffer, 1s,
+			read1([self](const auto & error, const auto & frames)
+			      {
+				      EXPECT_FALSE(error);
+				      ASSERT_EQ(frames.size(), 3);
+				      EXPECT_EQ(std::string(frames[0].begin(), frames[0].end()), "first");
+				      EXPECT_EQ(frames[1].size(), 0);
+				      EXPECT_EQ(std::string(frames[2].begin(), frames[2].end()), "third");
+			      }));
+		waiter.await(read1);
+
+		// Frames which do not fit into the buffer are rejected.
+		Waitable written2{waiter};
+		stream::asyncWrite(clientSocket, std::string(100, 'x'), 1s, written2([self](const auto & error) {}));
+		waiter.await(written2);
+
+		Waitable read2{waiter};
+		stream::asyncReadFrames(
+			serverSocket, buffer, 1s,
+			read2([self](const auto & error, const auto & frames) { EXPECT_EQ(error, error::invalidFrame); }));
+		waiter.await(read2);
+	}
+};
+
+TEST(asionetTest, FrameDraining)
+{
+	runTest1<FrameDraining>();
+}
+
+struct ReadAhead : std::enable_shared_from_this<ReadAhead>
+{
+	boost::asio::ip::tcp::acceptor acceptor;
+	boost::asio::ip::tcp::socket serverSocket;
+	boost::asio::ip::tcp::socket clientSocket;
+	boost::asio::streambuf buffer;
+	Waiter waiter;
+
+	ReadAhead(Context & context)
+		: acceptor(context, boost::asio::ip::tcp::endpoint{boost::asio::ip::tcp::v4(), 10001})
+		  , serverSocket(context)
+		  , clientSocket(context)
+		  , buffer(64)
+		  , waiter(context)
+	{}
+
+	void readAhead(const std::string & expected)
+	{
+		auto self = shared_from_this();
+		Waitable read{waiter};
+		stream::asyncReadAhead(
+			serverSocket, buffer, 1s,
+			read([self, expected](const auto & error, const auto & data)
+			     {
+				     EXPECT_FALSE(error);
+				     EXPECT_EQ(std::string(data.begin(), data.end()), expected);
+			     }));
+		waiter.await(read);
+	}
+
+	void run()
+	{
+		auto self = shared_from_this();
+
+		Waitable accepted{waiter}, connected{waiter};
+		acceptor.async_accept(serverSocket, accepted([self](const auto & error) { EXPECT_FALSE(error); }));
+		socket::asyncConnect(clientSocket, "127.0.0.1", 10001, 1s,
+		                     connected([self](const auto & error) { EXPECT_FALSE(error); }));
+		waiter.await(accepted && connected);
+
+		std::vector<std::string> messages{"zeroth", "first", "", "third"};
+		Waitable written{waiter};
+		stream::asyncWrite(clientSocket, messages, 1s, written([self](const auto & error) { EXPECT_FALSE(error); }));
+		waiter.await(written);
+
+		// Without reading ahead, nothing but the frame itself is read.
+		Waitable read0{waiter};
+		stream::asyncRead(
+			serverSocket, buffer, 1s,
+			read0([self](const auto & error, const auto & data)
+			      {
+				      EXPECT_FALSE(error);
+				      EXPECT_EQ(std::string(data.begin(), data.end()), "zeroth");
+			      }));
+		waiter.await(read0);
+		EXPECT_EQ(buffer.size(), 0);
+
+		// The first read ahead takes all frames, the others are left in the buffer for the following reads.
+		readAhead("first");
+		EXPECT_EQ(buffer.size(), 2 * framing::Default::MAX_HEADER_SIZE + 5);
+		readAhead("");
+		readAhead("third");
+		EXPECT_EQ(buffer.size(), 0);
+
+		// A frame which arrives in pieces is read up to its end but not any further.
+		std::string frame{'\0', '\0', '\0', '\6', 'f', 'o', 'u'};
+		boost::asio::write(clientSocket, boost::asio::buffer(frame));
+		Waitable read4{waiter};
+		stream::asyncRead(
+			serverSocket, buffer, 1s,
+			read4([self](const auto & error, const auto & data)
+			      {
+				      EXPECT_FALSE(error);
+				      EXPECT_EQ(std::string(data.begin(), data.end()), "fourth");
+			      }));
+		boost::asio::write(clientSocket, boost::asio::buffer(std::string{"rth\0\0\0\5fifth", 12}));
+		waiter.await(read4);
+		EXPECT_EQ(buffer.size(), 0);
+		readAhead("fifth");
+	}
+};
+
+TEST(asionetTest, ReadAhead)
+{
+	runTest1<ReadAhead>();
+}
+
+struct WriteCoalescing : std::enable_shared_from_this<WriteCoalescing>
+{
+	Context & context;
+	boost::asio::ip::tcp::acceptor acceptor;
+	boost::asio::ip::tcp::socket serverSocket;
+	boost::asio::ip::tcp::socket clientSocket;
+	boost::asio::streambuf buffer;
+	stream::WriteQueue<boost::asio::ip::tcp::socket> writeQueue;
+	Waiter waiter;
+
+	WriteCoalescing(Context & context)
+		: context(context)
+		  , acceptor(context, boost::asio::ip::tcp::endpoint{boost::asio::ip::tcp::v4(), 10001})
+		  , serverSocket(context)
+		  , clientSocket(context)
+		  , writeQueue(clientSocket, 1s, 65536, 4)
+		  , waiter(context)
+	{}
+
+	void run()
+	{
+		auto self = shared_from_this();
+
+		Waitable accepted{waiter}, connected{waiter};
+		acceptor.async_accept(serverSocket, accepted([self](const auto & error) { EXPECT_FALSE(error); }));
+		socket::asyncConnect(clientSocket, "127.0.0.1", 10001, 1s,
+		                     connected([self](const auto & error) { EXPECT_FALSE(error); }));
+		waiter.await(accepted && connected);
+
+		// The single worker is busy while the frames are queued, so only the first one is written on its own.
+		// The others follow in batches of at most four frames.
+		std::vector<Waitable> written;
+		for (std::size_t i = 0; i < 10; ++i)
+			written.emplace_back(waiter);
+		context.post(
+			[self, &written]
+			{
+				for (std::size_t i = 0; i < written.size(); ++i)
+				{
+					self->writeQueue.asyncWrite(
+						std::make_shared<const std::string>(std::to_string(i)),
+						written[i]([self](const auto & error) { EXPECT_FALSE(error); }));
+				}
+			});
+
+		for (std::size_t i = 0; i < written.size(); ++i)
+		{
+			Waitable read{waiter};
+			stream::asyncRead(
+				serverSocket, buffer, 1s,
+				read([self, i](const auto & error, const auto & data)
+				     {
+					     EXPECT_FALSE(error);
+					     EXPECT_EQ(std::string(data.begin(), data.end()), std::to_string(i));
+				     }));
+			waiter.await(read && written[i]);
+		}
+		EXPECT_EQ(writeQueue.numBatches(), 4);
+	}
+};
+
+TEST(asionetTest, WriteCoalescing)
+{
+	runTest1<WriteCoalescing>();
+}
+
+struct VarintTestService
+{
+	using RequestMessage = TestMessage;
+	using ResponseMessage = TestMessage;
+	using Framing = framing::Varint;
+};
+
+struct CustomFraming : std::enable_shared_from_this<CustomFraming>
+{
+	boost::asio::ip::tcp::acceptor acceptor;
+	boost::asio::ip::tcp::socket serverSocket;
+	boost::asio::ip::tcp::socket clientSocket;
+	boost::asio::streambuf buffer;
+	ServiceServer<VarintTestService> server;
+	MultiplexedServiceClient<VarintTestService> client;
+	Waiter waiter;
+
+	CustomFraming(Context & context)
+		: acceptor(context, boost::asio::ip::tcp::endpoint{boost::asio::ip::tcp::v4(), 10002})
+		  , serverSocket(context)
+		  , clientSocket(context)
+		  , server(context, 10001)
+		  , client(context)
+		  , waiter(context)
+	{}
+
+	void run()
+	{
+		auto self = shared_from_this();
+
+		server.advertiseService(
+			[self](const auto & endpoint, const auto & requestMessage, auto & responseMessage)
+			{ responseMessage = TestMessage::response(requestMessage.getId(), 42); });
+
+		Waitable called{waiter};
+		client.asyncCall(
+			TestMessage::request(1), "127.0.0.1", 10001, 1s,
+			called([self](const auto & error, auto & response)
+			       {
+				       EXPECT_FALSE(error);
+				       EXPECT_EQ(response.getId(), 1);
+			       }));
+		waiter.await(called);
+
+		Waitable accepted{waiter}, connected{waiter};
+		acceptor.async_accept(serverSocket, accepted([self](const auto & error) { EXPECT_FALSE(error); }));
+		socket::asyncConnect(clientSocket, "127.0.0.1", 10002, 1s,
+		                     connected([self](const auto & error) { EXPECT_FALSE(error); }));
+		waiter.await(accepted && connected);
+
+		// Fixed-size messages go over the wire without any header.
+		using Fixed = framing::FixedSize<4>;
+		Waitable written{waiter}, rejected{waiter};
+		stream::asyncWrite<Fixed>(
+			clientSocket, std::vector<std::string>{"abcd", "efgh"}, 1s,
+			written([self](const auto & error) { EXPECT_FALSE(error); }));
+		stream::asyncWrite<Fixed>(
+			clientSocket, "abc", 1s, rejected([self](const auto & error) { EXPECT_EQ(error, error::invalidFrame); }));
+		waiter.await(written && rejected);
+
+		for (const auto & expected : {"abcd", "efgh"})
+		{
+			Waitable read{waiter};
+			stream::asyncRead<Fixed>(
+				serverSocket, buffer, 1s,
+				read([self, expected](const auto & error, const auto & data)
+				     {
+					     EXPECT_FALSE(error);
+					     EXPECT_EQ(std::string(data.begin(), data.end()), expected);
+				     }));
+			waiter.await(read);
+		}
+		EXPECT_EQ(buffer.size(), 0);
+	}
+};
+
+TEST(asionetTest, CustomFraming)
+{
+	runTest1<CustomFraming>();
+}
+
+struct ChecksummedFrames : std::enable_shared_from_this<ChecksummedFrames>
+{
+	using Framing = framing::Checksummed<>;
+
+	boost::asio::ip::tcp::acceptor acceptor;
+	boost::asio::ip::tcp::socket serverSocket;
+	boost::asio::ip::tcp::socket clientSocket;
+	boost::asio::streambuf buffer;
+	DatagramReceiver<std::string, Framing> receiver;
+	DatagramSender<std::string, Framing> sender;
+	boost::asio::ip::udp::socket udpSocket;
+	Waiter waiter;
+
+	ChecksummedFrames(Context & context)
+		: acceptor(context, boost::asio::ip::tcp::endpoint{boost::asio::ip::tcp::v4(), 10001})
+		  , serverSocket(context)
+		  , clientSocket(context)
+		  , buffer(64)
+		  , receiver(context, 10000)
+		  , sender(context)
+		  , udpSocket(context, boost::asio::ip::udp::endpoint{boost::asio::ip::udp::v4(), 0})
+		  , waiter(context)
+	{}
+
+	static std::string corruptFrame(const std::string & message)
+	{
+		internal::BasicFrame<Framing> frame{(const std::uint8_t *) message.c_str(), message.size()};
+		std::string bytes(frame.getSize(), '\0');
+		boost::asio::buffer_copy(boost::asio::buffer(&bytes[0], bytes.size()), frame.getBuffers());
+		bytes[framing::Default::MAX_HEADER_SIZE] ^= 0x01;
+		return bytes;
+	}
+
+	void run()
+	{
+		auto self = shared_from_this();
+
+		// A datagram which has been corrupted on its way is rejected.
+		Waitable rejected{waiter};
+		receiver.asyncReceive(
+			1s, rejected([self](const auto & error, auto & message, const auto & senderEndpoint)
+			             { EXPECT_EQ(error, error::invalidFrame); }));
+		udpSocket.send_to(boost::asio::buffer(corruptFrame("Hello World!")),
+		                  boost::asio::ip::udp::endpoint{boost::asio::ip::address_v4::loopback(), 10000});
+		waiter.await(rejected);
+
+		Waitable received{waiter};
+		receiver.asyncReceive(
+			1s, received([self](const auto & error, auto & message, const auto & senderEndpoint)
+			             {
+				             EXPECT_FALSE(error);
+				             EXPECT_EQ(message, "Hello World!");
+			             }));
+		sender.asyncSend("Hello World!", "127.0.0.1", 10000, 1s, [self](const auto & error) { EXPECT_FALSE(error); });
+		waiter.await(received);
+
+		Waitable accepted{waiter}, connected{waiter};
+		acceptor.async_accept(serverSocket, accepted([self](const auto & error) { EXPECT_FALSE(error); }));
+		socket::asyncConnect(clientSocket, "127.0.0.1", 10001, 1s,
+		                     connected([self](const auto & error) { EXPECT_FALSE(error); }));
+		waiter.await(accepted && connected);
+
+		Waitable written{waiter}, read{waiter};
+		stream::asyncWrite<Framing>(clientSocket, "intact", 1s, written([self](const auto & error) { EXPECT_FALSE(error); }));
+		stream::asyncRead<Framing>(
+			serverSocket, buffer, 1s,
+			read([self](const auto & error, const auto & data)
+			     {
+				     EXPECT_FALSE(error);
+				     EXPECT_EQ(std::string(data.begin(), data.end()), "intact");
+			     }));
+		waiter.await(written && read);
+
+		boost::asio::write(clientSocket, boost::asio::buffer(corruptFrame("corrupt")));
+		Waitable readCorrupt{waiter};
+		stream::asyncRead<Framing>(
+			serverSocket, buffer, 1s,
+			readCorrupt([self](const auto & error, const auto & data) { EXPECT_EQ(error, error::invalidFrame); }));
+		waiter.await(readCorrupt);
+	}
+};
+
+TEST(asionetTest, ChecksummedFrames)
+{
+	runTest1<ChecksummedFrames>();
+}
+
+#ifdef ASIONET_WITH_ZLIB
+struct CompressedTestService
+{
+	using RequestMessage = std::string;
+	using ResponseMessage = std::string;
+	using Compression = compression::Zlib<64>;
+};
+
+struct CompressedMessages : std::enable_shared_from_this<CompressedMessages>
+{
+	using Compression = CompressedTestService::Compression;
+
+	ServiceServer<CompressedTestService> server;
+	ServiceClient<CompressedTestService> client;
+	DatagramReceiver<std::string, framing::Default, Compression> receiver;
+	DatagramSender<std::string, framing::Default, Compression> sender;
+	Waiter waiter;
+
+	CompressedMessages(Context & context)
+		: server(context, 10001, 4096)
+		  , client(context, 4096)
+		  , receiver(context, 10000, 4096)
+		  , sender(context)
+		  , waiter(context)
+	{}
+
+	void run()
+	{
+		auto self = shared_from_this();
+
+		server.advertiseService(
+			[self](const auto & endpoint, const auto & requestMessage, auto & responseMessage)
+			{ responseMessage = requestMessage; });
+
+		// Messages which are too large for the buffers without compression as well as small ones which are sent as is.
+		for (const auto & message : {std::string(3000, 'a'), std::string{"small"}})
+		{
+			Waitable called{waiter}, received{waiter};
+			client.asyncCall(
+				message, "127.0.0.1", 10001, 1s,
+				called([self, message](const auto & error, auto & response)
+				       {
+					       EXPECT_FALSE(error);
+					       EXPECT_EQ(response, message);
+				       }));
+			receiver.asyncReceive(
+				1s, received([self, message](const auto & error, auto & receivedMessage, const auto & senderEndpoint)
+				             {
+					             EXPECT_FALSE(error);
+					             EXPECT_EQ(receivedMessage, message);
+				             }));
+			sender.asyncSend(message, "127.0.0.1", 10000, 1s, [self](const auto & error) { EXPECT_FALSE(error); });
+			waiter.await(called && received);
+		}
+
+		// A datagram which never arrives is reported as timed out instead of failing to decode the empty buffer.
+		Waitable timedOut{waiter};
+		receiver.asyncReceive(
+			10ms, timedOut([self](const auto & error, auto & receivedMessage, const auto & senderEndpoint)
+			               { EXPECT_EQ(error, error::aborted); }));
+		waiter.await(timedOut);
+	}
+};
+
+TEST(asionetTest, CompressedMessages)
+{
+	runTest1<CompressedMessages>();
+}
+#endif
+
+struct BatchedCalls : std::enable_shared_from_this<BatchedCalls>
+{
+	ServiceServer<TestService> server;
+	MultiplexedServiceClient<TestService> client;
+	Waiter waiter;
+
+	BatchedCalls(Context & context)
+		: server(context, 10001)
+		  , client(context)
+		  , waiter(context)
+	{}
+
+	void run()
+	{
+		auto self = shared_from_this();
+		constexpr std::size_t numCalls{50};
+		std::atomic<std::size_t> numResponses{0};
+		std::atomic<std::size_t> correct{0};
+
+		server.advertiseService(
+			[self](const auto & clientEndpoint, const auto & requestMessage, auto & responseMessage)
+			{
+				responseMessage = TestMessage::response(requestMessage.getId(), 42);
+			});
+
+		// Small batches so that a burst of calls is split into several of them.
+		client.setBatching(5ms, 256);
+
+		Waitable waitable{waiter};
+		for (std::size_t i = 0; i < numCalls; i++)
+		{
+			client.asyncCall(
+				TestMessage::request(i), "127.0.0.1", 10001, 1s,
+				[&, self, i](const auto & error, auto & response)
+				{
+					if (!error && response.getId() == i)
+						correct++;
+					if (++numResponses == numCalls)
+						waitable.setReady();
+				});
+		}
+		waiter.await(waitable);
+
+		EXPECT_EQ(correct, numCalls);
+	}
+};
+
+TEST(asionetTest, BatchedCalls)
+{
+	runTest1<BatchedCalls>();
+}
+
+struct DeadlinePropagation : std::enable_shared_from_this<DeadlinePropagation>
+{
+	ServiceServer<TestService> server;
+	ServiceClient<TestService> client;
+	boost::asio::ip::tcp::socket socket;
+	boost::asio::streambuf buffer;
+	Waiter waiter;
+
+	DeadlinePropagation(Context & context)
+		: server(context, 10001)
+		  , client(context)
+		  , socket(context)
+		  , buffer(512)
+		  , waiter(context)
+	{}
+
+	void run()
+	{
+		auto self = shared_from_this();
+		std::atomic<std::size_t> numHandled{0};
+
+		server.advertiseServiceWithContext(
+			[self, &numHandled](const auto & requestContext, const auto & requestMessage, auto & responseMessage)
+			{
+				numHandled++;
+				EXPECT_FALSE(requestContext.isExpired());
+				EXPECT_LE(requestContext.deadline, time::now() + 1s);
+				responseMessage = TestMessage::response(requestMessage.getId(), 42);
+			});
+
+		Waitable called{waiter};
+		client.asyncCall(
+			TestMessage::request(1), "127.0.0.1", 10001, 1s,
+			called([self](const auto & error, auto & response)
+			       {
+				       EXPECT_FALSE(error);
+				       EXPECT_EQ(response.getId(), 1);
+			       }));
+		waiter.await(called);
+		EXPECT_EQ(numHandled, 1);
+
+		Waitable connected{waiter};
+		socket::asyncConnect(socket, "127.0.0.1", 10001, 1s,
+		                     connected([self](const auto & error) { EXPECT_FALSE(error); }));
+		waiter.await(connected);
+
+		// The first request has already expired when it arrives so only the second one is handled.
+		std::vector<std::string> requests(2);
+		internal::ServiceHeader expiredHeader{internal::ServiceHeader::MULTIPLEXED, 2};
+		expiredHeader.setTimeout(0s);
+		internal::encodeServiceMessage(expiredHeader, TestMessage::request(2), requests[0]);
+		internal::ServiceHeader header{internal::ServiceHeader::MULTIPLEXED, 3};
+		header.setTimeout(1s);
+		internal::encodeServiceMessage(header, TestMessage::request(3), requests[1]);
+
+		Waitable written{waiter}, read{waiter};
+		stream::asyncWrite(socket, requests, 1s, written([self](const auto & error) { EXPECT_FALSE(error); }));
+		stream::asyncRead(
+			socket, buffer, 1s,
+			read([self](const auto & error, const auto & data)
+			     {
+				     ASSERT_FALSE(error);
+				     internal::ServiceHeader responseHeader;
+				     TestMessage response;
+				     EXPECT_FALSE(internal::decodeServiceMessage(data, 512, responseHeader, response));
+				     EXPECT_EQ(responseHeader.getRequestId(), 3);
+				     EXPECT_FALSE(responseHeader.hasTimeout());
+				     EXPECT_EQ(response.getId(), 3);
+			     }));
+		waiter.await(written && read);
+		EXPECT_EQ(numHandled, 2);
+	}
+};
+
+TEST(asionetTest, DeadlinePropagation)
+{
+	runTest1<DeadlinePropagation>();
+}
+
+struct WarmUp : std::enable_shared_from_this<WarmUp>
+{
+	std::shared_ptr<ConnectionPool> pool;
+	ServiceServer<TestService> server;
+	ServiceClient<TestService> client;
+	Waiter waiter;
+
+	WarmUp(Context & context)
+		: pool(std::make_shared<ConnectionPool>(context))
+		  , server(context, 10001)
+		  , client(context, pool)
+		  , waiter(context)
+	{}
+
+	void run()
+	{
+		auto self = shared_from_this();
+		auto key = ConnectionPool::makeKey("127.0.0.1", 10001);
+		std::atomic<std::size_t> numHandled{0};
+
+		server.advertiseService(
+			[&, self](const auto & clientEndpoint, const auto & requestMessage, auto & responseMessage)
+			{
+				numHandled++;
+				responseMessage = TestMessage::response(requestMessage.getId(), 42);
+			});
+
+		Waitable warmedUp{waiter};
+		client.asyncWarmUp(
+			{{"127.0.0.1", 10001}}, 3, 1s,
+			warmedUp([self](const auto & error, auto numConnections)
+			         {
+				         EXPECT_FALSE(error);
+				         EXPECT_EQ(numConnections, 3);
+			         }));
+		waiter.await(warmedUp);
+		EXPECT_EQ(pool->numIdleConnections(key), 3);
+
+		// Only the connections which cannot be established are missing.
+		Waitable warmedUp2{waiter};
+		client.asyncWarmUp(
+			{{"127.0.0.1", 10001}, {"127.0.0.1", 10003}}, 3, 1s,
+			warmedUp2([self](const auto & error, auto numConnections)
+			          {
+				          EXPECT_EQ(error, error::failedOperation);
+				          EXPECT_EQ(numConnections, 0);
+			          }));
+		waiter.await(warmedUp2);
+		EXPECT_EQ(pool->numIdleConnections(key), 3);
+		EXPECT_EQ(pool->numOpenConnections(ConnectionPool::makeKey("127.0.0.1", 10003)), 0);
+
+		Waitable called{waiter};
+		client.asyncCall(
+			TestMessage::request(1), "127.0.0.1", 10001, 1s,
+			called([self](const auto & error, auto & response) { EXPECT_FALSE(error); }));
+		waiter.await(called);
+		EXPECT_EQ(numHandled, 1);
+		EXPECT_EQ(pool->numOpenConnections(key), 3);
+	}
+};
+
+TEST(asionetTest, WarmUp)
+{
+	runTest1<WarmUp>();
+}
+
+// A local endpoint whose backlog is full, so that connecting to it neither succeeds nor fails until the timeout.
+struct UnansweredEndpoint
+{
+	boost::asio::ip::tcp::endpoint endpoint;
+	boost::asio::ip::tcp::acceptor acceptor;
+	boost::asio::ip::tcp::socket queuedSocket;
+
+	UnansweredEndpoint(Context & context, std::uint16_t port)
+		: endpoint(boost::asio::ip::address_v4::loopback(), port)
+		  , acceptor(context)
+		  , queuedSocket(context)
+	{
+		acceptor.open(endpoint.protocol());
+		acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+		acceptor.bind(endpoint);
+		acceptor.listen(0);
+		queuedSocket.connect(endpoint);
+	}
+};
+
+struct RacingConnect : std::enable_shared_from_this<RacingConnect>
+{
+	using Results = boost::asio::ip::tcp::resolver::results_type;
+
+	boost::asio::ip::tcp::acceptor acceptor;
+	boost::asio::ip::tcp::socket serverSocket;
+	boost::asio::ip::tcp::socket socket;
+	ServiceServer<TestService> server;
+	ServiceClient<TestService> client;
+	UnansweredEndpoint unanswered;
+	Waiter waiter;
+
+	RacingConnect(Context & context)
+		: acceptor(context, boost::asio::ip::tcp::endpoint{boost::asio::ip::tcp::v4(), 10001})
+		  , serverSocket(context)
+		  , socket(context)
+		  , server(context, 10002)
+		  , client(context)
+		  , unanswered(context, 10004)
+		  , waiter(context)
+	{}
+
+	static Results makeResults(const std::vector<std::pair<std::string, std::uint16_t>> & addresses)
+	{
+		std::vector<boost::asio::ip::tcp::endpoint> endpoints;
+		for (const auto & address : addresses)
+			endpoints.emplace_back(boost::asio::ip::make_address(address.first), address.second);
+		return Results::create(endpoints.begin(), endpoints.end(), "", "");
+	}
+
+	void run()
+	{
+		auto self = shared_from_this();
+
+		// Neither an unreachable nor a refusing endpoint hold up the connection.
+		auto startTime = time::now();
+		Waitable accepted{waiter}, connected{waiter};
+		acceptor.async_accept(serverSocket, accepted([self](const auto & error) { EXPECT_FALSE(error); }));
+		socket::asyncConnectRacing(
+			socket, makeResults({{"10.255.255.1", 10001}, {"127.0.0.1", 10003}, {"127.0.0.1", 10001}}), 2s, 50ms,
+			connected([self](const auto & error)
+			          {
+				          EXPECT_FALSE(error);
+				          boost::system::error_code ignoredError;
+				          EXPECT_EQ(self->socket.remote_endpoint(ignoredError).port(), 10001);
+			          }));
+		waiter.await(accepted && connected);
+		EXPECT_LT(time::now() - startTime, 1s);
+
+		boost::asio::ip::tcp::socket failingSocket{acceptor.get_executor()};
+		Waitable failed{waiter};
+		socket::asyncConnectRacing(
+			failingSocket, makeResults({{"127.0.0.1", 10003}}), 1s, 50ms,
+			failed([self, &failingSocket](const auto & error)
+			       {
+				       EXPECT_EQ(error, error::failedOperation);
+				       EXPECT_FALSE(failingSocket.is_open());
+			       }));
+		waiter.await(failed);
+
+		// "localhost" may resolve to ::1 as well where nobody is listening.
+		server.advertiseService(
+			[self](const auto & clientEndpoint, const auto & requestMessage, auto & responseMessage)
+			{ responseMessage = TestMessage::response(requestMessage.getId(), 42); });
+
+		client.setConnectRacing(50ms);
+		Waitable called{waiter};
+		client.asyncCall(
+			TestMessage::request(1), "localhost", 10002, 1s,
+			called([self](const auto & error, auto & response)
+			       {
+				       EXPECT_FALSE(error);
+				       EXPECT_EQ(response.getId(), 1);
+			       }));
+		waiter.await(called);
+
+		// Canceling the client cancels a racing connect as well.
+		startTime = time::now();
+		Waitable canceled{waiter};
+		client.asyncCall(
+			TestMessage::request(2), "127.0.0.1", 10004, 5s,
+			canceled([self](const auto & error, auto & response) { EXPECT_EQ(error, error::aborted); }));
+		std::this_thread::sleep_for(100ms);
+		client.cancel();
+		waiter.await(canceled);
+		EXPECT_LT(time::now() - startTime, 1s);
+	}
+};
+
+TEST(asionetTest, RacingConnect)
+{
+	runTest1<RacingConnect>();
+}
+
+struct RacingConnectWinner : std::enable_shared_from_this<RacingConnectWinner>
+{
+	using Results = boost::asio::ip::tcp::resolver::results_type;
+
+	boost::asio::ip::tcp::acceptor acceptor;
+	boost::asio::ip::tcp::socket serverSocket;
+	boost::asio::ip::tcp::socket socket;
+	boost::asio::ip::tcp::socket canceledSocket;
+	UnansweredEndpoint unanswered;
+	Waiter waiter;
+
+	RacingConnectWinner(Context & context)
+		: acceptor(context, boost::asio::ip::tcp::endpoint{boost::asio::ip::tcp::v4(), 10001})
+		  , serverSocket(context)
+		  , socket(context)
+		  , canceledSocket(context)
+		  , unanswered(context, 10004)
+		  , waiter(context)
+	{}
+
+	void run()
+	{
+		auto self = shared_from_this();
+		auto hanging = boost::asio::ip::tcp::endpoint{boost::asio::ip::make_address("10.255.255.1"), 10001};
+		auto listening = boost::asio::ip::tcp::endpoint{boost::asio::ip::address_v4::loopback(), 10001};
+
+		// The first endpoint hangs until the timeout while the second one wins.
+		Waitable accepted{waiter}, connected{waiter};
+		acceptor.async_accept(serverSocket, accepted([self](const auto & error) { EXPECT_FALSE(error); }));
+		std::vector<boost::asio::ip::tcp::endpoint> endpoints{hanging, listening};
+		socket::asyncConnectRacing(
+			socket, Results::create(endpoints.begin(), endpoints.end(), "", ""), 200ms, 20ms,
+			connected([self](const auto & error) { EXPECT_FALSE(error); }));
+		waiter.await(accepted && connected);
+
+		// The timeout of the hanging attempt must not affect the winning connection.
+		std::this_thread::sleep_for(400ms);
+		ASSERT_TRUE(socket.is_open());
+		Waitable written{waiter}, read{waiter};
+		boost::asio::streambuf buffer;
+		stream::asyncWrite(socket, "still connected", 1s, written([self](const auto & error) { EXPECT_FALSE(error); }));
+		stream::asyncRead(
+			serverSocket, buffer, 1s,
+			read([self](const auto & error, const auto & data)
+			     {
+				     EXPECT_FALSE(error);
+				     EXPECT_EQ(std::string(data.begin(), data.end()), "still connected");
+			     }));
+		waiter.await(written && read);
+
+		// The returned canceler cancels the racing.
+		auto startTime = time::now();
+		Waitable canceled{waiter};
+		std::vector<boost::asio::ip::tcp::endpoint> hangingEndpoints{unanswered.endpoint, unanswered.endpoint};
+		auto cancelConnect = socket::asyncConnectRacing(
+			canceledSocket, Results::create(hangingEndpoints.begin(), hangingEndpoints.end(), "", ""), 5s, 20ms,
+			canceled([self](const auto & error)
+			         {
+				         EXPECT_EQ(error, error::aborted);
+				         EXPECT_FALSE(self->canceledSocket.is_open());
+			         }));
+		std::this_thread::sleep_for(100ms);
+		cancelConnect();
+		waiter.await(canceled);
+		EXPECT_LT(time::now() - startTime, 1s);
+
+		// Canceling after the racing has ended does nothing.
+		cancelConnect();
+	}
+};
+
+TEST(asionetTest, RacingConnectWinner)
+{
+	runTest1<RacingConnectWinner>();
+}
+
+struct DeferredResponse : std::enable_shared_from_this<DeferredResponse>
+{
+	using Responder = ServiceServer<TestService>::Responder;
+
+	ServiceServer<TestService> server;
+	MultiplexedServiceClient<TestService> client;
+	ServiceClient<TestService> pooledClient;
+	Waiter waiter;
+	std::mutex mutex;
+	std::vector<std::pair<protocol::Id, Responder>> responders;
+	std::set<std::uint16_t> clientPorts;
+	// Joined before the test ends since a response may still be in the middle of being sent when the call completes.
+	std::vector<std::thread> threads;
+
+	DeferredResponse(Context & context)
+		: server(context, 10001)
+		  , client(context)
+		  , pooledClient(context, std::make_shared<ConnectionPool>(context))
+		  , waiter(context)
+	{}
+
+	void run()
+	{
+		auto self = shared_from_this();
+		constexpr std::size_t numCalls{10};
+		std::atomic<std::size_t> numResponses{0};
+		std::atomic<std::size_t> correct{0};
+
+		server.advertiseDeferredService(
+			[self](const auto & requestContext, const auto & requestMessage, auto responder)
+			{
+				// Requests with id 0 are never answered.
+				auto id = requestMessage.getId();
+				if (id == 0)
+					return;
+
+				std::lock_guard<std::mutex> lock{self->mutex};
+				if (id >= 100)
+				{
+					self->clientPorts.insert(requestContext.clientEndpoint.port());
+					self->threads.emplace_back([responder, id] { responder.respond(TestMessage::response(id, 42)); });
+					return;
+				}
+
+				self->responders.emplace_back(requestMessage.getId(), responder);
+				if (self->responders.size() < numCalls)
+					return;
+
+				// Respond in reverse order from another thread.
+				auto responders = std::move(self->responders);
+				self->responders.clear();
+				self->threads.emplace_back(
+					[responders]
+					{
+						for (auto it = responders.rbegin(); it != responders.rend(); ++it)
+						{
+							it->second.respond(TestMessage::response(it->first, 42));
+							it->second.respond(TestMessage::response(0, 0));
+						}
+					});
+			});
+
+		Waitable waitable{waiter};
+		for (std::size_t i = 1; i <= numCalls; i++)
+		{
+			client.asyncCall(
+				TestMessage::request(i), "127.0.0.1", 10001, 1s,
+				[&, self, i](const auto & error, auto & response)
+				{
+					if (!error && response.getId() == i)
+						correct++;
+					if (++numResponses == numCalls)
+						waitable.setReady();
+				});
+		}
+		waiter.await(waitable);
+		EXPECT_EQ(correct, numCalls);
+
+		Waitable dropped{waiter};
+		client.asyncCall(
+			TestMessage::request(0), "127.0.0.1", 10001, 100ms,
+			dropped([self](const auto & error, auto & response) { EXPECT_TRUE(error); }));
+		waiter.await(dropped);
+
+		// Over a connection of a non-multiplexing client, the next request is received after the deferred response.
+		for (std::size_t i = 100; i < 103; i++)
+		{
+			Waitable called{waiter};
+			pooledClient.asyncCall(
+				TestMessage::request(i), "127.0.0.1", 10001, 1s,
+				called([self, i](const auto & error, auto & response)
+				       {
+					       EXPECT_FALSE(error);
+					       EXPECT_EQ(response.getId(), i);
+				       }));
+			waiter.await(called);
+		}
+		EXPECT_EQ(clientPorts.size(), 1);
+
+		std::lock_guard<std::mutex> lock{mutex};
+		for (auto & thread : threads)
+			thread.join();
+	}
+};
+
+TEST(asionetTest, DeferredResponse)
+{
+	runTest1<DeferredResponse>();
+}
+
+struct ComputeOffload : std::enable_shared_from_this<ComputeOffload>
+{
+	Context computeContext;
+	WorkerPool computeWorkers;
+	ServiceServer<TestService> server;
+	MultiplexedServiceClient<TestService> client;
+	Waiter waiter;
+
+	ComputeOffload(Context & context)
+		: computeWorkers(computeContext, 1)
+		  , server(context, 10001)
+		  , client(context)
+		  , waiter(context)
+	{}
+
+	void run()
+	{
+		auto self = shared_from_this();
+		constexpr std::size_t numCalls{6};
+		std::atomic<std::size_t> numResponses{0};
+		std::atomic<std::size_t> correct{0};
+		std::atomic<std::size_t> overloaded{0};
+
+		server.setComputeOffload(computeContext, 2);
+		server.advertiseService(
+			[self](const auto & clientEndpoint, const auto & requestMessage, auto & responseMessage)
+			{
+				// Blocking is fine on the compute threads.
+				std::this_thread::sleep_for(50ms);
+				responseMessage = TestMessage::response(requestMessage.getId(), 42);
+			});
+
+		Waitable waitable{waiter};
+		for (std::size_t i = 0; i < numCalls; i++)
+		{
+			client.asyncCall(
+				TestMessage::request(i), "127.0.0.1", 10001, 1s,
+				[&, self, i](const auto & error, auto & response)
+				{
+					if (!error && response.getId() == i)
+						correct++;
+					if (error == error::overloaded)
+						overloaded++;
+					if (++numResponses == numCalls)
+						waitable.setReady();
+				});
+		}
+		waiter.await(waitable);
+
+		// One request is handled while two of them are waiting, the rest is rejected.
+		EXPECT_GE(correct, 2);
+		EXPECT_LE(correct, 3);
+		EXPECT_EQ(correct + overloaded, numCalls);
+	}
+};
+
+TEST(asionetTest, ComputeOffload)
+{
+	runTest1<ComputeOffload>();
+}
+
+struct ShardedAcceptors : std::enable_shared_from_this<ShardedAcceptors>
+{
+	Context shardContext1, shardContext2;
+	ServiceServer<TestService> server;
+	ServiceClient<TestService> client;
+	Waiter waiter;
+	// Stop serving the connections before the server is gone.
+	Worker shardWorker1, shardWorker2;
+
+	ShardedAcceptors(Context & context)
+		: server(context, 10001)
+		  , client(context)
+		  , waiter(context)
+		  , shardWorker1(shardContext1)
+		  , shardWorker2(shardContext2)
+	{}
+
+	void run()
+	{
+		auto self = shared_from_this();
+		constexpr std::size_t numCalls{20};
+		std::mutex mutex;
+		std::set<std::thread::id> threads;
+
+		// The handler must not keep the test alive since it is destroyed on the threads of the shards.
+		server.setShards({shardContext1, shardContext2});
+		server.advertiseService(
+			[&](const auto & clientEndpoint, const auto & requestMessage, auto & responseMessage)
+			{
+				{
+					std::lock_guard<std::mutex> lock{mutex};
+					threads.insert(std::this_thread::get_id());
+				}
+				responseMessage = TestMessage::response(requestMessage.getId(), 42);
+			});
+
+		// Each call uses a new connection which the kernel hands to either of the acceptors.
+		for (std::size_t i = 0; i < numCalls; i++)
+		{
+			Waitable called{waiter};
+			client.asyncCall(
+				TestMessage::request(i), "127.0.0.1", 10001, 1s,
+				called([self, i](const auto & error, auto & response)
+				       {
+					       EXPECT_FALSE(error);
+					       EXPECT_EQ(response.getId(), i);
+				       }));
+			waiter.await(called);
+		}
+
+		EXPECT_EQ(threads.size(), 2);
+		server.cancel();
+	}
+};
+
+TEST(asionetTest, ShardedAcceptors)
+{
+	runTest1<ShardedAcceptors>();
+}
+
+struct AdmissionControl : std::enable_shared_from_this<AdmissionControl>
+{
+	ServiceServer<TestService> server;
+	ServiceClient<TestService> client;
+	boost::asio::ip::tcp::socket socket;
+	Waiter waiter;
+
+	AdmissionControl(Context & context)
+		: server(context, 10001)
+		  , client(context)
+		  , socket(context)
+		  , waiter(context)
+	{}
+
+	void awaitConnections(std::size_t numConnections)
+	{
+		for (std::size_t i = 0; i < 100 && server.numConnections() != numConnections; i++)
+			std::this_thread::sleep_for(10ms);
+		EXPECT_EQ(server.numConnections(), numConnections);
+	}
+
+	void run()
+	{
+		auto self = shared_from_this();
+
+		server.setMaxConnections(1);
+		server.advertiseService(
+			[self](const auto & clientEndpoint, const auto & requestMessage, auto & responseMessage)
+			{ responseMessage = TestMessage::response(requestMessage.getId(), 42); });
+
+		// An idle connection uses up the only slot, so the server stops accepting.
+		Waitable connected{waiter};
+		socket::asyncConnect(socket, "127.0.0.1", 10001, 1s,
+		                     connected([self](const auto & error) { EXPECT_FALSE(error); }));
+		waiter.await(connected);
+		awaitConnections(1);
+		EXPECT_EQ(server.numPausedAccepts(), 1);
+
+		Waitable called1{waiter};
+		client.asyncCall(TestMessage::request(1), "127.0.0.1", 10001, 100ms,
+		                 called1([self](const auto & error, auto & response) { EXPECT_EQ(error, error::aborted); }));
+		waiter.await(called1);
+
+		// Now excess connections are accepted but rejected right away.
+		server.setMaxConnections(1, true);
+		Waitable called2{waiter};
+		client.asyncCall(TestMessage::request(2), "127.0.0.1", 10001, 1s,
+		                 called2([self](const auto & error, auto & response) { EXPECT_EQ(error, error::overloaded); }));
+		waiter.await(called2);
+		EXPECT_GE(server.numRejectedConnections(), 1);
+
+		closeable::Closer<boost::asio::ip::tcp::socket>::close(socket);
+		awaitConnections(0);
+
+		Waitable called3{waiter};
+		client.asyncCall(TestMessage::request(3), "127.0.0.1", 10001, 1s,
+		                 called3([self](const auto & error, auto & response)
+		                         {
+			                         EXPECT_FALSE(error);
+			                         EXPECT_EQ(response.getId(), 3);
+		                         }));
+		waiter.await(called3);
+	}
+};
+
+TEST(asionetTest, AdmissionControl)
+{
+	runTest1<AdmissionControl>();
+}
+
+struct AdmissionAfterDestruction : std::enable_shared_from_this<AdmissionAfterDestruction>
+{
+	std::unique_ptr<ServiceServer<TestService>> server;
+	boost::asio::ip::tcp::socket socket;
+	Waiter waiter;
+
+	AdmissionAfterDestruction(Context & context)
+		: server(std::make_unique<ServiceServer<TestService>>(context, 10001))
+		  , socket(context)
+		  , waiter(context)
+	{}
+
+	void run()
+	{
+		auto self = shared_from_this();
+
+		server->setMaxConnections(1);
+		server->advertiseService(
+			[self](const auto & clientEndpoint, const auto & requestMessage, auto & responseMessage) {});
+
+		Waitable connected{waiter};
+		socket::asyncConnect(socket, "127.0.0.1", 10001, 1s,
+		                     connected([self](const auto & error) { EXPECT_FALSE(error); }));
+		waiter.await(connected);
+		for (std::size_t i = 0; i < 100 && server->numPausedAccepts() != 1; i++)
+			std::this_thread::sleep_for(10ms);
+		EXPECT_EQ(server->numPausedAccepts(), 1);
+
+		// The connection outlives the server. Once it is closed, the server must not resume accepting.
+		server.reset();
+		closeable::Closer<boost::asio::ip::tcp::socket>::close(socket);
+		std::this_thread::sleep_for(50ms);
+	}
+};
+
+TEST(asionetTest, AdmissionAfterDestruction)
+{
+	runTest1<AdmissionAfterDestruction>();
+}
+
+struct LoadShedding : std::enable_shared_from_this<LoadShedding>
+{
+	Context computeContext;
+	WorkerPool computeWorkers;
+	ServiceServer<TestService> server;
+	MultiplexedServiceClient<TestService> client;
+	Waiter waiter;
+
+	LoadShedding(Context & context)
+		: computeWorkers(computeContext, 1)
+		  , server(context, 10001)
+		  , client(context)
+		  , waiter(context)
+	{}
+
+	void run()
+	{
+		auto self = shared_from_this();
+		constexpr std::size_t numCalls{20};
+		std::atomic<std::size_t> numResponses{0};
+		std::atomic<std::size_t> correct{0};
+		std::atomic<std::size_t> overloaded{0};
+
+		server.setComputeOffload(computeContext, numCalls);
+		server.setLoadShedding(5ms, 30ms);
+		server.advertiseService(
+			[self](const auto & clientEndpoint, const auto & requestMessage, auto & responseMessage)
+			{
+				std::this_thread::sleep_for(20ms);
+				responseMessage = TestMessage::response(requestMessage.getId(), 42);
+			});
+
+		Waitable waitable{waiter};
+		for (std::size_t i = 0; i < numCalls; i++)
+		{
+			client.asyncCall(
+				TestMessage::request(i), "127.0.0.1", 10001, 2s,
+				[&, self, i](const auto & error, auto & response)
+				{
+					if (!error && response.getId() == i)
+						correct++;
+					if (error == error::overloaded)
+						overloaded++;
+					if (++numResponses == numCalls)
+						waitable.setReady();
+				});
+		}
+		waiter.await(waitable);
+
+		// The queue keeps growing, so some requests have to be shed but not all of them.
+		EXPECT_GE(correct, 2);
+		EXPECT_GE(overloaded, 1);
+		EXPECT_EQ(correct + overloaded, numCalls);
+		EXPECT_EQ(server.numShedRequests(), overloaded);
+
+		// Once the queue has drained, requests are served again.
+		Waitable called{waiter};
+		client.asyncCall(TestMessage::request(numCalls), "127.0.0.1", 10001, 1s,
+		                 called([self](const auto & error, auto & response) { EXPECT_FALSE(error); }));
+		waiter.await(called);
+	}
+};
+
+TEST(asionetTest, LoadShedding)
+{
+	runTest1<LoadShedding>();
+}
+
+struct IdleReaper : std::enable_shared_from_this<IdleReaper>
+{
+	ServiceServer<TestService> server;
+	ServiceClient<TestService> client;
+	boost::asio::ip::tcp::socket socket;
+	Waiter waiter;
+
+	IdleReaper(Context & context)
+		: server(context, 10001)
+		  , client(context)
+		  , socket(context)
+		  , waiter(context)
+	{}
+
+	void run()
+	{
+		auto self = shared_from_this();
+
+		server.setIdleReaper(20ms);
+		server.advertiseService(
+			[self](const auto & clientEndpoint, const auto & requestMessage, auto & responseMessage)
+			{ responseMessage = TestMessage::response(requestMessage.getId(), 42); },
+			200ms);
+
+		Waitable called{waiter};
+		client.asyncCall(TestMessage::request(1), "127.0.0.1", 10001, 1s,
+		                 called([self](const auto & error, auto & response) { EXPECT_FALSE(error); }));
+		waiter.await(called);
+
+		// This connection never sends a request, so it is closed once the receive timeout is over.
+		Waitable connected{waiter};
+		socket::asyncConnect(socket, "127.0.0.1", 10001, 1s,
+		                     connected([self](const auto & error) { EXPECT_FALSE(error); }));
+		waiter.await(connected);
+
+		std::this_thread::sleep_for(100ms);
+		EXPECT_EQ(server.numReapedConnections(), 0);
+
+		for (std::size_t i = 0; i < 100 && server.numReapedConnections() == 0; i++)
+			std::this_thread::sleep_for(10ms);
+		EXPECT_EQ(server.numReapedConnections(), 1);
+
+		char data;
+		boost::system::error_code readError;
+		socket.read_some(boost::asio::buffer(&data, 1), readError);
+		EXPECT_EQ(readError, boost::asio::error::eof);
+	}
+};
+
+TEST(asionetTest, IdleReaper)
+{
+	runTest1<IdleReaper>();
+}
+
+struct ResponseCache : std::enable_shared_from_this<ResponseCache>
+{
+	ServiceServer<TestService> server;
+	ServiceClient<TestService> client;
+	Waiter waiter;
+	std::atomic<int> numHandled{0};
+
+	ResponseCache(Context & context)
+		: server(context, 10001)
+		  , client(context)
+		  , waiter(context)
+	{}
+
+	void call(protocol::Id id)
+	{
+		auto self = shared_from_this();
+		Waitable called{waiter};
+		client.asyncCall(TestMessage::request(id), "127.0.0.1", 10001, 1s,
+		                 called([self, id](const auto & error, auto & response)
+		                        {
+			                        EXPECT_FALSE(error);
+			                        EXPECT_EQ(response.getId(), id);
+			                        EXPECT_EQ(response.getValue(), 42);
+		                        }));
+		waiter.await(called);
+	}
+
+	void run()
+	{
+		auto self = shared_from_this();
+
+		server.setResponseCache(1024, 200ms);
+		server.advertiseService(
+			[self](const auto & clientEndpoint, const auto & requestMessage, auto & responseMessage)
+			{
+				self->numHandled++;
+				responseMessage = TestMessage::response(requestMessage.getId(), 42);
+			});
+
+		call(1);
+		call(1);
+		call(2);
+		EXPECT_EQ(numHandled, 2);
+		EXPECT_EQ(server.numCachedResponses(), 1);
+
+		// Cached responses expire.
+		std::this_thread::sleep_for(300ms);
+		call(1);
+		EXPECT_EQ(numHandled, 3);
+		EXPECT_EQ(server.numCachedResponses(), 1);
+	}
+};
+
+TEST(asionetTest, ResponseCache)
+{
+	runTest1<ResponseCache>();
+}
+
+struct RequestCoalescing : std::enable_shared_from_this<RequestCoalescing>
+{
+	using Responder = ServiceServer<TestService>::Responder;
+
+	ServiceServer<TestService> server;
+	MultiplexedServiceClient<TestService> client;
+	Waiter waiter;
+	std::mutex mutex;
+	std::vector<Responder> responders;
+
+	RequestCoalescing(Context & context)
+		: server(context, 10001)
+		  , client(context)
+		  , waiter(context)
+	{}
+
+	void run()
+	{
+		auto self = shared_from_this();
+		constexpr std::size_t numCalls{5};
+		std::atomic<std::size_t> numResponses{0};
+		std::atomic<std::size_t> correct{0};
+
+		server.setRequestCoalescing();
+		server.advertiseDeferredService(
+			[self](const auto & requestContext, const auto & requestMessage, auto responder)
+			{
+				std::lock_guard<std::mutex> lock{self->mutex};
+				self->responders.push_back(responder);
+			});
+
+		Waitable waitable{waiter};
+		for (std::size_t i = 0; i < numCalls; i++)
+		{
+			client.asyncCall(
+				TestMessage::request(7), "127.0.0.1", 10001, 1s,
+				[&, self](const auto & error, auto & response)
+				{
+					if (!error && response.getId() == 7 && response.getValue() == 42)
+						correct++;
+					if (++numResponses == numCalls)
+						waitable.setReady();
+				});
+		}
+
+		for (std::size_t i = 0; i < 100 && server.numCoalescedRequests() < numCalls - 1; i++)
+			std::this_thread::sleep_for(10ms);
+		EXPECT_EQ(server.numCoalescedRequests(), numCalls - 1);
+
+		// All identical requests share the first one's handler.
+		std::vector<Responder> pendingResponders;
+		{
+			std::lock_guard<std::mutex> lock{mutex};
+			pendingResponders.swap(responders);
+		}
+		ASSERT_EQ(pendingResponders.size(), 1);
+		pendingResponders.front().respond(TestMessage::response(7, 42));
+		pendingResponders.clear();
+
+		waiter.await(waitable);
+		EXPECT_EQ(correct, numCalls);
+
+		// Once answered, the next identical request calls the handler again.
+		Waitable called{waiter};
+		client.asyncCall(TestMessage::request(7), "127.0.0.1", 10001, 100ms,
+		                 called([self](const auto & error, auto & response) { EXPECT_EQ(error, error::aborted); }));
+		waiter.await(called);
+
+		std::lock_guard<std::mutex> lock{mutex};
+		EXPECT_EQ(responders.size(), 1);
+		responders.clear();
+	}
+};
+
+TEST(asionetTest, RequestCoalescing)
+{
+	runTest1<RequestCoalescing>();
+}
+
+struct RoutedTestService
+{
+	using RequestMessage = TestMessage;
+	using ResponseMessage = TestMessage;
+	static constexpr std::uint16_t ID = 1;
+};
+
+struct RoutedStringService
+{
+	using RequestMessage = std::string;
+	using ResponseMessage = std::string;
+	static constexpr std::uint16_t ID = 2;
+};
+
+struct Routing : std::enable_shared_from_this<Routing>
+{
+	ServiceRouter<RoutedTestService, RoutedStringService> router;
+	std::shared_ptr<ConnectionPool> connectionPool;
+	ServiceClient<RoutedTestService> testClient;
+	ServiceClient<RoutedStringService> stringClient;
+	MultiplexedServiceClient<RoutedStringService> multiplexedClient;
+	ServiceClient<TestService> unroutedClient;
+	Waiter waiter;
+
+	Routing(Context & context)
+		: router(context, 10001)
+		  , connectionPool(std::make_shared<ConnectionPool>(context))
+		  , testClient(context, connectionPool)
+		  , stringClient(context, connectionPool)
+		  , multiplexedClient(context)
+		  , unroutedClient(context)
+		  , waiter(context)
+	{}
+
+	void run()
+	{
+		auto self = shared_from_this();
+
+		router.setHandler<RoutedTestService>(
+			[self](const auto & requestContext, auto & requestMessage, auto & responseMessage)
+			{
+				EXPECT_EQ(requestContext.serviceId, 1);
+				responseMessage = TestMessage::response(requestMessage.getId(), 42);
+			});
+		router.setHandler<RoutedStringService>(
+			[self](const auto & requestContext, auto & requestMessage, auto & responseMessage)
+			{
+				EXPECT_EQ(requestContext.serviceId, 2);
+				responseMessage = requestMessage + " world";
+			});
+		router.advertise();
+
+		// Both services share a connection to the same port.
+		for (int i = 0; i < 2; i++)
+		{
+			Waitable testCalled{waiter}, stringCalled{waiter}, multiplexedCalled{waiter};
+			testClient.asyncCall(TestMessage::request(5), "127.0.0.1", 10001, 1s,
+			                     testCalled([self](const auto & error, auto & response)
+			                                {
+				                                EXPECT_FALSE(error);
+				                                EXPECT_EQ(response.getId(), 5);
+				                                EXPECT_EQ(response.getValue(), 42);
+			                                }));
+			waiter.await(testCalled);
+
+			stringClient.asyncCall("hello", "127.0.0.1", 10001, 1s,
+			                       stringCalled([self](const auto & error, auto & response)
+			                                    {
+				                                    EXPECT_FALSE(error);
+				                                    EXPECT_EQ(response, "hello world");
+			                                    }));
+			waiter.await(stringCalled);
+
+			multiplexedClient.asyncCall("hi", "127.0.0.1", 10001, 1s,
+			                            multiplexedCalled([self](const auto & error, auto & response)
+			                                              {
+				                                              EXPECT_FALSE(error);
+				                                              EXPECT_EQ(response, "hi world");
+			                                              }));
+			waiter.await(multiplexedCalled);
+		}
+		EXPECT_EQ(connectionPool->numOpenConnections(ConnectionPool::makeKey("127.0.0.1", 10001)), 1);
+
+		// There's no service with ID 0 which would take requests that don't address any service.
+		Waitable unroutedCalled{waiter};
+		unroutedClient.asyncCall(TestMessage::request(1), "127.0.0.1", 10001, 100ms,
+		                         unroutedCalled([self](const auto & error, auto & response) { EXPECT_TRUE(error); }));
+		waiter.await(unroutedCalled);
+	}
+};
+
+TEST(asionetTest, Routing)
+{
+	runTest1<Routing>();
+}
+
+struct UrgentTestService
+{
+	using RequestMessage = TestMessage;
+	using ResponseMessage = TestMessage;
+	static constexpr std::uint8_t PRIORITY = 3;
+};
+
+struct PriorityLanes : std::enable_shared_from_this<PriorityLanes>
+{
+	Context computeContext;
+	WorkerPool computeWorkers;
+	ServiceServer<TestService> server;
+	MultiplexedServiceClient<TestService> client;
+	ServiceClient<UrgentTestService> urgentClient;
+	Waiter waiter;
+	std::mutex mutex;
+	std::vector<protocol::Id> handledIds;
+
+	PriorityLanes(Context & context)
+		: computeWorkers(computeContext, 1)
+		  , server(context, 10001)
+		  , client(context)
+		  , urgentClient(context)
+		  , waiter(context)
+	{}
+
+	std::size_t numHandled()
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		return handledIds.size();
+	}
+
+	void run()
+	{
+		auto self = shared_from_this();
+		constexpr std::size_t numCalls{10};
+		std::atomic<std::size_t> numResponses{0};
+
+		// The queue of urgent requests is never full.
+		server.setComputeOffload(computeContext, numCalls / 2);
+		server.advertiseService(
+			[self](const auto & clientEndpoint, const auto & requestMessage, auto & responseMessage)
+			{
+				std::this_thread::sleep_for(20ms);
+				{
+					std::lock_guard<std::mutex> lock{self->mutex};
+					self->handledIds.push_back(requestMessage.getId());
+				}
+				responseMessage = TestMessage::response(requestMessage.getId(), 42);
+			});
+
+		Waitable waitable{waiter};
+		for (std::size_t i = 0; i < numCalls; i++)
+		{
+			client.asyncCall(
+				TestMessage::request(i), "127.0.0.1", 10001, 1s,
+				[&, self](const auto & error, auto & response)
+				{
+					if (++numResponses == numCalls)
+						waitable.setReady();
+				});
+		}
+
+		for (std::size_t i = 0; i < 100 && numHandled() == 0; i++)
+			std::this_thread::sleep_for(5ms);
+
+		Waitable called{waiter};
+		urgentClient.asyncCall(TestMessage::request(100), "127.0.0.1", 10001, 1s,
+		                       called([self](const auto & error, auto & response) { EXPECT_FALSE(error); }));
+		waiter.await(called);
+		waiter.await(waitable);
+
+		// The urgent request overtakes the ones which have been waiting and isn't rejected although they are.
+		std::lock_guard<std::mutex> lock{mutex};
+		auto urgentPosition = std::find(handledIds.begin(), handledIds.end(), 100) - handledIds.begin();
+		EXPECT_LE(urgentPosition, 2);
+		EXPECT_LE(handledIds.size(), numCalls / 2 + 2);
+	}
+};
+
+TEST(asionetTest, PriorityLanes)
+{
+	runTest1<PriorityLanes>();
+}
+
 // --- ATTENTION ---
 // The following tests must be checked manually.
 
@@ -662,6 +2750,186 @@ void testWorkSerializer()
     }
 }
 
+template<typename Framing>
+std::size_t roundTripFrameHeader(std::size_t numDataBytes)
+{
+	std::uint8_t header[Framing::MAX_HEADER_SIZE];
+	std::size_t numHeaderBytes = 0, numDecodedHeaderBytes = 0, numDecodedDataBytes = 0;
+	EXPECT_TRUE(Framing::encodeHeader(numDataBytes, header, numHeaderBytes));
+	EXPECT_EQ(framing::HeaderStatus::incomplete,
+	          Framing::decodeHeader(header, numHeaderBytes - 1, numDecodedHeaderBytes, numDecodedDataBytes));
+	EXPECT_EQ(framing::HeaderStatus::complete,
+	          Framing::decodeHeader(header, numHeaderBytes, numDecodedHeaderBytes, numDecodedDataBytes));
+	EXPECT_EQ(numDecodedHeaderBytes, numHeaderBytes);
+	EXPECT_EQ(numDecodedDataBytes, numDataBytes);
+	return numHeaderBytes;
+}
+
+TEST(asionetTest, FramingPolicies)
+{
+	EXPECT_EQ(roundTripFrameHeader<framing::LengthPrefix32>(300), 4);
+	EXPECT_EQ(roundTripFrameHeader<framing::LengthPrefix64>(std::size_t{1} << 40), 8);
+	EXPECT_EQ(roundTripFrameHeader<framing::Varint>(0), 1);
+	EXPECT_EQ(roundTripFrameHeader<framing::Varint>(127), 1);
+	EXPECT_EQ(roundTripFrameHeader<framing::Varint>(128), 2);
+	EXPECT_EQ(roundTripFrameHeader<framing::Varint>(std::numeric_limits<std::uint32_t>::max()), 5);
+
+	std::uint8_t header[8];
+	std::size_t numHeaderBytes = 0;
+	EXPECT_FALSE(framing::LengthPrefix32::encodeHeader(std::size_t{1} << 32, header, numHeaderBytes));
+	EXPECT_FALSE(framing::FixedSize<4>::encodeHeader(3, header, numHeaderBytes));
+
+	// A varint must end within 10 bytes.
+	std::uint8_t overlong[11];
+	std::fill(std::begin(overlong), std::end(overlong), 0x80);
+	std::size_t numDataBytes = 0;
+	EXPECT_EQ(framing::HeaderStatus::invalid,
+	          framing::Varint::decodeHeader(overlong, sizeof(overlong), numHeaderBytes, numDataBytes));
+}
+
+TEST(asionetTest, Crc32c)
+{
+	std::string check{"123456789"};
+	EXPECT_EQ(utils::crc32c(check.c_str(), check.size()), 0xe3069283);
+	EXPECT_EQ(utils::crc32c(check.c_str() + 4, 5, utils::crc32c(check.c_str(), 4)), 0xe3069283);
+
+	// The hardware implementation (if any) agrees with the portable one, whatever the alignment and size.
+	std::vector<std::uint8_t> data(1000);
+	for (std::size_t i = 0; i < data.size(); i++)
+		data[i] = (std::uint8_t) (i * 31 + 7);
+	for (std::size_t offset = 0; offset < 8; offset++)
+	{
+		for (std::size_t size : {0, 1, 3, 4, 7, 8, 9, 15, 16, 17, 100, 991})
+		{
+			EXPECT_EQ(utils::crc32c(data.data() + offset, size),
+			          ~utils::internal::crc32cPortable(data.data() + offset, size, ~0u));
+		}
+	}
+}
+
+#ifdef ASIONET_WITH_ZLIB
+TEST(asionetTest, Compression)
+{
+	using Compression = compression::Zlib<64>;
+
+	// Only messages which are large enough and actually shrink are compressed.
+	std::string small{"small"};
+	EXPECT_FALSE(compression::internal::compress<Compression>(small));
+	std::string noise(1000, '\0');
+	std::uint32_t state = 1;
+	for (auto & byte : noise)
+	{
+		state = state * 1103515245 + 12345;
+		byte = (char) (state >> 16);
+	}
+	auto original = noise;
+	EXPECT_FALSE(compression::internal::compress<Compression>(noise));
+	EXPECT_EQ(noise, original);
+
+	std::string large(3000, 'a');
+	EXPECT_TRUE(compression::internal::compress<Compression>(large));
+	EXPECT_LT(large.size(), 100);
+	std::string restored;
+	EXPECT_TRUE(compression::internal::decompress<Compression>(internal::ConstStringBuffer{large, large.size(), 0},
+	                                                           3000, restored));
+	EXPECT_EQ(restored, std::string(3000, 'a'));
+	// The original size is checked before decompressing.
+	EXPECT_FALSE(compression::internal::decompress<Compression>(internal::ConstStringBuffer{large, large.size(), 0},
+	                                                            2999, restored));
+	large.back() ^= 0x01;
+	EXPECT_FALSE(compression::internal::decompress<Compression>(internal::ConstStringBuffer{large, large.size(), 0},
+	                                                            3000, restored));
+
+	// The header tells whether the message is compressed.
+	std::string data;
+	internal::ServiceHeader header{internal::ServiceHeader::MULTIPLEXED, 1};
+	EXPECT_TRUE(internal::encodeServiceMessage<Compression>(header, std::string(3000, 'b'), data));
+	internal::ServiceHeader decodedHeader;
+	std::string message;
+	EXPECT_FALSE(internal::decodeServiceMessage<Compression>(
+		internal::ConstStringBuffer{data, data.size(), 0}, 3000, decodedHeader, message));
+	EXPECT_TRUE(decodedHeader.isCompressed());
+	EXPECT_EQ(message, std::string(3000, 'b'));
+	EXPECT_EQ(internal::decodeServiceMessage<compression::None>(
+		internal::ConstStringBuffer{data, data.size(), 0}, 3000, decodedHeader, message), error::decoding);
+}
+#endif
+
+TEST(asionetTest, LruCache)
+{
+	// Enough entries to rehash the index a couple of times while evicting by cost.
+	utils::LruCache<std::string, int> cache{30};
+	for (int i = 0; i < 1000; i++)
+		cache.put(std::to_string(i), i, time::TimePoint::max(), 10);
+	EXPECT_EQ(cache.size(), 3);
+	EXPECT_EQ(cache.cost(), 30);
+	EXPECT_EQ(cache.get("996"), nullptr);
+	ASSERT_NE(cache.get("997"), nullptr);
+	EXPECT_EQ(*cache.get("997"), 997);
+
+	// The least recently used entry goes first.
+	cache.put("1000", 1000, time::TimePoint::max(), 10);
+	EXPECT_EQ(cache.get("998"), nullptr);
+	EXPECT_NE(cache.get("997"), nullptr);
+	cache.erase("997");
+	EXPECT_EQ(cache.cost(), 20);
+}
+
+TEST(asionetTest, ServiceTable)
+{
+	// TestService takes the requests which don't address any service.
+	constexpr auto table = internal::makeServiceTable<RoutedStringService, RoutedTestService, TestService>();
+	EXPECT_EQ(table.find(0), 2);
+	EXPECT_EQ(table.find(1), 1);
+	EXPECT_EQ(table.find(2), 0);
+	EXPECT_EQ(table.find(3), 3);
+}
+
+TEST(asionetTest, MessageVariant)
+{
+	// Two alternatives of the same type are told apart by their index.
+	using Variant = internal::MessageVariant<std::string, std::shared_ptr<int>, std::string>;
+	std::size_t numMessages = Variant::NUM_MESSAGES;
+	Variant variant;
+	EXPECT_EQ(variant.getIndex(), numMessages);
+
+	auto counter = std::make_shared<int>(42);
+	variant.emplace<1>() = counter;
+	EXPECT_EQ(counter.use_count(), 2);
+
+	Variant copy{variant};
+	EXPECT_EQ(copy.getIndex(), 1);
+	EXPECT_EQ(counter.use_count(), 3);
+
+	Variant moved{std::move(copy)};
+	EXPECT_EQ(*moved.get<1>(), 42);
+	EXPECT_EQ(counter.use_count(), 3);
+
+	// Replacing a message destroys the previous one.
+	variant.emplace<2>() = "hello";
+	EXPECT_EQ(variant.getIndex(), 2);
+	EXPECT_EQ(variant.get<2>(), "hello");
+	EXPECT_EQ(counter.use_count(), 2);
+
+	moved = variant;
+	EXPECT_EQ(moved.get<2>(), "hello");
+	EXPECT_EQ(counter.use_count(), 1);
+	copy.reset();
+	moved.reset();
+	EXPECT_EQ(moved.getIndex(), numMessages);
+	EXPECT_EQ(counter.use_count(), 1);
+}
+
+TEST(asionetTest, WriteBatchLimit)
+{
+	using Socket = boost::asio::ip::tcp::socket;
+	// A batch must not take more than the 64 buffers of a single writev call.
+	std::size_t numFrames = stream::WriteQueue<Socket>::DEFAULT_MAX_BATCH_FRAMES;
+	EXPECT_EQ(numFrames, 32);
+	numFrames = stream::WriteQueue<Socket, framing::Checksummed<>>::DEFAULT_MAX_BATCH_FRAMES;
+	EXPECT_EQ(numFrames, 21);
+}
+
 TEST(asionetTest, ConstStreamBuffer)
 {
 	boost::asio::streambuf streambuf;